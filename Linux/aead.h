@@ -0,0 +1,247 @@
+#pragma once
+
+#include "protocol.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#if defined(__aarch64__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+// Authenticated encryption for the payload stream.
+//
+// Keys come from an ephemeral X25519 exchange carried in the handshake options
+// and are expanded with HKDF-SHA256. If both sides set VIMSICLES_PSK, it is
+// mixed in as the HKDF salt, which also authenticates the peers; without it the
+// link is private against passive listeners only.
+//
+// The payload travels as frames: a 4-byte big-endian header (payload length,
+// top bit set on the final frame) followed by the ciphertext and a 16-byte tag.
+// The header is authenticated as AAD and the nonce is a per-session salt plus
+// the frame number, so frames cannot be reordered, replayed or cut off.
+
+#define AEAD_FRAME_SIZE (256 * 1024)
+#define AEAD_HEADER_SIZE 4
+#define AEAD_TAG_SIZE 16
+#define AEAD_FINAL_FLAG 0x80000000u
+#define AEAD_KEY_SIZE 32
+#define AEAD_SALT_SIZE 4
+
+#define CIPHER_AES_GCM "aes-256-gcm"
+#define CIPHER_CHACHA "chacha20-poly1305"
+
+// True when AES-GCM runs in hardware (AES-NI/VAES with CLMUL, or ARMv8 AES)
+inline bool cpu_has_aes()
+{
+#if defined(__x86_64__) || defined(__i386__)
+        return __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul");
+#elif defined(__aarch64__)
+        return (getauxval(AT_HWCAP) & HWCAP_AES) && (getauxval(AT_HWCAP) & HWCAP_PMULL);
+#else
+        return false;
+#endif
+}
+
+// Our preference order, offered by the sender as "enc=a:b"
+inline std::string cipher_preference()
+{
+        if (cpu_has_aes())
+                return std::string(CIPHER_AES_GCM) + ":" + CIPHER_CHACHA;
+        return std::string(CIPHER_CHACHA) + ":" + CIPHER_AES_GCM;
+}
+
+// Receiver side: AES-GCM only wins if both ends have it in hardware, since
+// software AES is several times slower than ChaCha20 on either end.
+inline std::string choose_cipher(const std::string &offer)
+{
+        bool offered_aes    = offer.find(CIPHER_AES_GCM) != std::string::npos;
+        bool offered_chacha = offer.find(CIPHER_CHACHA) != std::string::npos;
+        bool peer_wants_aes = offer.compare(0, strlen(CIPHER_AES_GCM), CIPHER_AES_GCM) == 0;
+        if (offered_aes && (!offered_chacha || (peer_wants_aes && cpu_has_aes())))
+                return CIPHER_AES_GCM;
+        if (offered_chacha)
+                return CIPHER_CHACHA;
+        return "";
+}
+
+inline const EVP_CIPHER *cipher_by_name(const std::string &name)
+{
+        if (name == CIPHER_AES_GCM)
+                return EVP_aes_256_gcm();
+        if (name == CIPHER_CHACHA)
+                return EVP_chacha20_poly1305();
+        throw std::runtime_error("Unsupported cipher: " + name);
+}
+
+// One side of an ephemeral X25519 exchange
+class key_exchange
+{
+      private:
+        std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> key{nullptr, EVP_PKEY_free};
+        std::string public_raw;
+
+      public:
+        key_exchange()
+        {
+                EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_X25519, nullptr);
+                EVP_PKEY *pkey    = nullptr;
+                if (!ctx || EVP_PKEY_keygen_init(ctx) <= 0 || EVP_PKEY_keygen(ctx, &pkey) <= 0)
+                {
+                        EVP_PKEY_CTX_free(ctx);
+                        throw std::runtime_error("Failed to generate X25519 key");
+                }
+                EVP_PKEY_CTX_free(ctx);
+                key.reset(pkey);
+
+                unsigned char raw[32];
+                size_t raw_len = sizeof(raw);
+                EVP_PKEY_get_raw_public_key(pkey, raw, &raw_len);
+                public_raw.assign(reinterpret_cast<char *>(raw), raw_len);
+        }
+
+        std::string public_hex() const
+        {
+                return to_hex(reinterpret_cast<const unsigned char *>(public_raw.data()),
+                              public_raw.size());
+        }
+
+        // Derive `length` bytes of key material bound to both public keys and
+        // to `label`, so different uses of one exchange get independent keys.
+        std::vector<unsigned char> derive(const std::string &peer_hex,
+                                          const std::string &sender_hex,
+                                          const std::string &receiver_hex,
+                                          const std::string &label, size_t length) const
+        {
+                std::string peer_raw = from_hex(peer_hex);
+                EVP_PKEY *peer       = EVP_PKEY_new_raw_public_key(
+                    EVP_PKEY_X25519, nullptr, reinterpret_cast<const unsigned char *>(peer_raw.data()),
+                    peer_raw.size());
+                if (!peer)
+                        throw std::runtime_error("Invalid peer public key");
+
+                unsigned char secret[32];
+                size_t secret_len = sizeof(secret);
+                EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(key.get(), nullptr);
+                bool ok = ctx && EVP_PKEY_derive_init(ctx) > 0 && EVP_PKEY_derive_set_peer(ctx, peer) > 0 &&
+                          EVP_PKEY_derive(ctx, secret, &secret_len) > 0;
+                EVP_PKEY_CTX_free(ctx);
+                EVP_PKEY_free(peer);
+                if (!ok)
+                        throw std::runtime_error("X25519 key agreement failed");
+
+                const char *psk  = getenv("VIMSICLES_PSK");
+                std::string salt = psk ? psk : "";
+                std::string info = "vimsicles " + label + " " + sender_hex + " " + receiver_hex;
+
+                std::vector<unsigned char> out(length);
+                ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+                ok  = ctx && EVP_PKEY_derive_init(ctx) > 0 &&
+                     EVP_PKEY_CTX_set_hkdf_md(ctx, EVP_sha256()) > 0 &&
+                     EVP_PKEY_CTX_set1_hkdf_salt(ctx, reinterpret_cast<const unsigned char *>(salt.data()),
+                                                 salt.size()) > 0 &&
+                     EVP_PKEY_CTX_set1_hkdf_key(ctx, secret, secret_len) > 0 &&
+                     EVP_PKEY_CTX_add1_hkdf_info(ctx, reinterpret_cast<const unsigned char *>(info.data()),
+                                                 info.size()) > 0 &&
+                     EVP_PKEY_derive(ctx, out.data(), &length) > 0;
+                EVP_PKEY_CTX_free(ctx);
+                OPENSSL_cleanse(secret, sizeof(secret));
+                if (!ok)
+                        throw std::runtime_error("HKDF failed");
+                return out;
+        }
+};
+
+// Session keys for one transfer direction
+struct aead_session
+{
+        std::string cipher;
+        unsigned char key[AEAD_KEY_SIZE];
+        unsigned char salt[AEAD_SALT_SIZE];
+
+        aead_session(const std::string &name, const std::vector<unsigned char> &material)
+            : cipher(name)
+        {
+                cipher_by_name(name);
+                memcpy(key, material.data(), AEAD_KEY_SIZE);
+                memcpy(salt, material.data() + AEAD_KEY_SIZE, AEAD_SALT_SIZE);
+        }
+
+        ~aead_session() { OPENSSL_cleanse(key, sizeof(key)); }
+
+        static size_t material_size() { return AEAD_KEY_SIZE + AEAD_SALT_SIZE; }
+};
+
+// Per-thread cipher context; seals or opens frames in place
+class frame_cipher
+{
+      private:
+        const aead_session &session;
+        std::unique_ptr<EVP_CIPHER_CTX, decltype(&EVP_CIPHER_CTX_free)> ctx{EVP_CIPHER_CTX_new(),
+                                                                           EVP_CIPHER_CTX_free};
+        bool encrypt;
+
+        void nonce(uint64_t seq, unsigned char *out) const
+        {
+                memcpy(out, session.salt, AEAD_SALT_SIZE);
+                put_be64(out + AEAD_SALT_SIZE, seq);
+        }
+
+      public:
+        frame_cipher(const aead_session &s, bool enc) : session(s), encrypt(enc)
+        {
+                if (!ctx || EVP_CipherInit_ex(ctx.get(), cipher_by_name(s.cipher), nullptr, s.key,
+                                              nullptr, encrypt) != 1)
+                        throw std::runtime_error("Failed to initialise cipher");
+        }
+
+        // frame = header + payload + room for the tag; payload is encrypted in place
+        bool seal(uint64_t seq, unsigned char *frame, size_t len)
+        {
+                unsigned char iv[12];
+                nonce(seq, iv);
+                int out_len = 0;
+                unsigned char *payload = frame + AEAD_HEADER_SIZE;
+                return EVP_CipherInit_ex(ctx.get(), nullptr, nullptr, nullptr, iv, 1) == 1 &&
+                       EVP_CipherUpdate(ctx.get(), nullptr, &out_len, frame, AEAD_HEADER_SIZE) == 1 &&
+                       (len == 0 || EVP_CipherUpdate(ctx.get(), payload, &out_len, payload, len) == 1) &&
+                       EVP_CipherFinal_ex(ctx.get(), payload + len, &out_len) == 1 &&
+                       EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_AEAD_GET_TAG, AEAD_TAG_SIZE,
+                                           payload + len) == 1;
+        }
+
+        // Returns false if the frame does not authenticate
+        bool open(uint64_t seq, unsigned char *frame, size_t len)
+        {
+                unsigned char iv[12];
+                nonce(seq, iv);
+                int out_len = 0;
+                unsigned char *payload = frame + AEAD_HEADER_SIZE;
+                return EVP_CipherInit_ex(ctx.get(), nullptr, nullptr, nullptr, iv, 0) == 1 &&
+                       EVP_CipherUpdate(ctx.get(), nullptr, &out_len, frame, AEAD_HEADER_SIZE) == 1 &&
+                       (len == 0 || EVP_CipherUpdate(ctx.get(), payload, &out_len, payload, len) == 1) &&
+                       EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_AEAD_SET_TAG, AEAD_TAG_SIZE,
+                                           payload + len) == 1 &&
+                       EVP_CipherFinal_ex(ctx.get(), payload + len, &out_len) == 1;
+        }
+};
+
+// A frame moving through the encrypt/decrypt stage
+struct aead_frame
+{
+        std::vector<unsigned char> buffer;
+        size_t len    = 0;
+        uint64_t seq  = 0;
+        bool final    = false;
+        bool ok       = true;
+
+        size_t wire_size() const { return AEAD_HEADER_SIZE + len + AEAD_TAG_SIZE; }
+};
+
+inline size_t aead_buffer_size() { return AEAD_HEADER_SIZE + AEAD_FRAME_SIZE + AEAD_TAG_SIZE; }
@@ -0,0 +1,230 @@
+#pragma once
+
+#include "content_cache.h"
+#include "dir_walker.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <memory>
+#include <openssl/evp.h>
+#include <signal.h>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// Archives the sender built before, keyed on a fingerprint of what they were
+// built from: every entry's name, source path, type, owner, size, mtime,
+// ctime and inode as dir_walker reports them. The ctime catches an edit
+// that kept its size and put the old mtime back (touch -r, cp -p, rsync -t
+// over the same inode). Sending an unchanged selection again still costs the
+// scan, but no compression and no hashing: the archive and its MD5 come
+// straight out of the cache.
+//
+// Each archive lives in its own directory next to a small "meta" file with
+// its MD5, size and mtime. Directories are built under a temporary name and
+// renamed into place when complete. The least recently used are removed
+// beyond ARCHIVE_CACHE_ENTRIES. A build that was killed leaves its temporary
+// directory behind; opening the cache removes those whose process is gone or
+// that nothing has written to for ARCHIVE_CACHE_SCRATCH_AGE seconds.
+
+#define ARCHIVE_CACHE_ENTRIES 8
+#define ARCHIVE_CACHE_SCRATCH_AGE 3600
+
+// Hex SHA-256 of the manifest, plus anything else that changes the archive
+inline std::string tree_fingerprint(const std::vector<manifest_entry> &manifest, int level)
+{
+        std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx(EVP_MD_CTX_new(),
+                                                                   EVP_MD_CTX_free);
+        if (!ctx || EVP_DigestInit_ex(ctx.get(), EVP_sha256(), nullptr) != 1)
+                throw std::runtime_error("Failed to initialise sha256");
+
+        std::string record = "tar.gz level " + std::to_string(level) + "\n";
+        EVP_DigestUpdate(ctx.get(), record.data(), record.size());
+        for (const manifest_entry &entry : manifest)
+        {
+                record = entry.path + '\0' + entry.source + '\0' + entry.link + '\0';
+                for (uint64_t value : {uint64_t(entry.mode), uint64_t(entry.uid),
+                                       uint64_t(entry.gid), uint64_t(entry.nlink), entry.size,
+                                       uint64_t(entry.mtime), uint64_t(entry.mtime_nsec),
+                                       uint64_t(entry.ctime), uint64_t(entry.ctime_nsec),
+                                       entry.ino, entry.dev})
+                {
+                        unsigned char bytes[8];
+                        put_be64(bytes, value);
+                        record.append(reinterpret_cast<char *>(bytes), 8);
+                }
+                EVP_DigestUpdate(ctx.get(), record.data(), record.size());
+        }
+
+        unsigned char out[EVP_MAX_MD_SIZE];
+        unsigned int out_len = 0;
+        EVP_DigestFinal_ex(ctx.get(), out, &out_len);
+        return to_hex(out, out_len);
+}
+
+class archive_cache
+{
+      private:
+        std::string dir;
+
+        static int64_t mtime_of(const struct stat &st)
+        {
+                return int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        }
+
+        // Drops the least recently used archives beyond the limit
+        void evict() const
+        {
+                std::vector<std::pair<int64_t, std::string>> entries;
+                DIR *list = opendir(dir.c_str());
+                if (!list)
+                        return;
+                while (struct dirent *dent = readdir(list))
+                {
+                        struct stat st;
+                        std::string path = dir + "/" + dent->d_name;
+                        if (dent->d_name[0] != '.' && stat(path.c_str(), &st) == 0 &&
+                            S_ISDIR(st.st_mode))
+                                entries.emplace_back(mtime_of(st), path);
+                }
+                closedir(list);
+                if (entries.size() <= ARCHIVE_CACHE_ENTRIES)
+                        return;
+                std::sort(entries.begin(), entries.end());
+                for (size_t i = 0; i + ARCHIVE_CACHE_ENTRIES < entries.size(); i++)
+                        remove_tree(entries[i].second);
+        }
+
+        // Removes the scratch directories of builds that will never finish:
+        // ".build-<pid>-XXXXXX" whose process is gone, or any that has not
+        // been written to for an hour (the pid may have been reused)
+        void sweep() const
+        {
+                DIR *list = opendir(dir.c_str());
+                if (!list)
+                        return;
+                std::vector<std::string> stale;
+                time_t now = time(nullptr);
+                while (struct dirent *dent = readdir(list))
+                {
+                        if (strncmp(dent->d_name, ".build-", 7) != 0)
+                                continue;
+                        std::string path = dir + "/" + dent->d_name;
+                        long pid         = 0;
+                        bool orphaned    = sscanf(dent->d_name + 7, "%ld-", &pid) != 1 ||
+                                        pid <= 0 || (kill(pid_t(pid), 0) < 0 && errno == ESRCH);
+                        if (orphaned || latest_write(path) + ARCHIVE_CACHE_SCRATCH_AGE < now)
+                                stale.push_back(path);
+                }
+                closedir(list);
+                for (const std::string &path : stale)
+                        remove_tree(path);
+        }
+
+        // Newest mtime of a directory and the files in it
+        static time_t latest_write(const std::string &path)
+        {
+                struct stat st;
+                time_t latest = stat(path.c_str(), &st) == 0 ? st.st_mtime : 0;
+                DIR *list     = opendir(path.c_str());
+                if (!list)
+                        return latest;
+                while (struct dirent *dent = readdir(list))
+                        if (dent->d_name[0] != '.' &&
+                            stat((path + "/" + dent->d_name).c_str(), &st) == 0)
+                                latest = std::max(latest, st.st_mtime);
+                closedir(list);
+                return latest;
+        }
+
+      public:
+        explicit archive_cache(const std::string &directory) : dir(directory) { sweep(); }
+
+        // Next to the receiver's cache of archives it got
+        static std::string default_dir() { return content_cache::default_dir() + "/archives"; }
+
+        static void remove_tree(const std::string &path)
+        {
+                DIR *list = opendir(path.c_str());
+                if (list)
+                {
+                        while (struct dirent *dent = readdir(list))
+                                if (strcmp(dent->d_name, ".") != 0 &&
+                                    strcmp(dent->d_name, "..") != 0)
+                                        unlink((path + "/" + dent->d_name).c_str());
+                        closedir(list);
+                }
+                rmdir(path.c_str());
+        }
+
+        // The archive built for this fingerprint and its MD5; false if there
+        // is none or it was touched since
+        bool find(const std::string &fingerprint, std::string &archive, std::string &md5) const
+        {
+                std::string entry = dir + "/" + fingerprint;
+                FILE *meta        = fopen((entry + "/meta").c_str(), "r");
+                if (!meta)
+                        return false;
+                char hash[65] = {}, name[256] = {};
+                unsigned long long size = 0;
+                long long mtime         = 0;
+                int fields = fscanf(meta, "%64s %llu %lld %255s", hash, &size, &mtime, name);
+                fclose(meta);
+
+                struct stat st;
+                std::string path = entry + "/" + name;
+                if (fields != 4 || strchr(name, '/') || stat(path.c_str(), &st) < 0 ||
+                    uint64_t(st.st_size) != size || mtime_of(st) != mtime)
+                        return false;
+                utimensat(AT_FDCWD, entry.c_str(), nullptr, 0);
+                archive = path;
+                md5     = hash;
+                return true;
+        }
+
+        // A fresh directory to build an archive in, empty on failure
+        std::string scratch() const
+        {
+                for (size_t slash = dir.find('/', 1); slash != std::string::npos;
+                     slash        = dir.find('/', slash + 1))
+                        mkdir(dir.substr(0, slash).c_str(), 0700);
+                mkdir(dir.c_str(), 0700);
+                std::string path = dir + "/.build-" + std::to_string(getpid()) + "-XXXXXX";
+                return mkdtemp(&path[0]) ? path : "";
+        }
+
+        // Records a complete archive built in a scratch() directory under the
+        // fingerprint. Returns its new path, or "" if it stays where it is.
+        std::string keep(const std::string &fingerprint, const std::string &archive,
+                         const std::string &md5)
+        {
+                std::string built = archive.substr(0, archive.find_last_of('/'));
+                std::string name  = archive.substr(archive.find_last_of('/') + 1);
+                struct stat st;
+                if (stat(archive.c_str(), &st) < 0)
+                        return "";
+                FILE *meta = fopen((built + "/meta").c_str(), "w");
+                if (!meta)
+                        return "";
+                fprintf(meta, "%s %llu %lld %s\n", md5.c_str(), (unsigned long long)st.st_size,
+                        (long long)mtime_of(st), name.c_str());
+                if (fclose(meta) != 0)
+                        return "";
+
+                // A stale entry for the same fingerprint failed find() above
+                std::string entry = dir + "/" + fingerprint;
+                remove_tree(entry);
+                if (rename(built.c_str(), entry.c_str()) < 0)
+                        return "";
+                evict();
+                return entry + "/" + name;
+        }
+};
@@ -0,0 +1,283 @@
+#!/bin/bash
+
+# Measures goodput and time-to-complete of file_send -> file_recieve through
+# impair_proxy, so transfers can be compared under Wi-Fi and hotspot-like
+# conditions on a single machine. With --check it runs a short matrix and
+# fails if any transfer does not arrive intact (used by "make test").
+
+cd "$(dirname "$0")" || exit 1
+BIN_DIR=$(pwd)
+
+SIZE_MB=32
+CHECK=0
+PROFILES=()
+MODES=()
+
+usage() {
+	echo "Usage: $0 [--check] [--size MB] [--profile NAME]... [--mode NAME]..."
+	echo "Profiles: loopback lan wifi hotspot lossy"
+	echo "Modes: $(all_modes)"
+}
+
+# impair_proxy arguments for each link profile ("" means no proxy at all)
+profile_args() {
+	case "$1" in
+	loopback) echo "" ;;
+	lan) echo "--delay 0.2 --rate 940M" ;;
+	wifi) echo "--delay 3 --jitter 2 --loss 0.2 --rate 200M" ;;
+	hotspot) echo "--delay 25 --jitter 10 --loss 0.5 --rate 30M" ;;
+	lossy) echo "--delay 5 --jitter 3 --loss 2 --rate 50M" ;;
+	*) return 1 ;;
+	esac
+}
+
+# Transfer modes and the extra flags they pass to the sender and receiver
+all_modes() {
+	echo "tcp aead aead-chacha ktls udp udp-fec mcast multipath probe daemon"
+}
+
+sender_args() {
+	case "$1" in
+	tcp) echo "" ;;
+	aead) echo "--encrypt" ;;
+	aead-chacha) echo "--encrypt=chacha20-poly1305" ;;
+	ktls) echo "--ktls" ;;
+	udp) echo "--udp" ;;
+	udp-fec) echo "--udp --fec 16" ;;
+	mcast) echo "--multicast 239.255.66.1 --fec 16" ;;
+	multipath) echo "--via 127.0.0.1 --via 127.0.0.2" ;;
+	probe) echo "--probe" ;;
+	daemon) echo "" ;;
+	*) return 1 ;;
+	esac
+}
+
+# Modes that also need UDP relayed by the proxy (--probe may pick UDP)
+mode_uses_udp() {
+	case "$1" in
+	udp* | probe) return 0 ;;
+	*) return 1 ;;
+	esac
+}
+
+# How many receivers a mode sends to at once. The proxy relays unicast only,
+# so multi-receiver modes run on loopback alone.
+mode_receivers() {
+	case "$1" in
+	mcast) echo 3 ;;
+	*) echo 1 ;;
+	esac
+}
+
+# Modes the proxy cannot stand in the middle of: several receivers, or extra
+# paths that connect to the receiver on a port of their own
+mode_loopback_only() {
+	[ "$(mode_receivers "$1")" -gt 1 ] || [ "$1" = multipath ]
+}
+
+# Modes whose sender connects twice, so the proxy has to outlive one session
+mode_probes() {
+	[ "$1" = probe ]
+}
+
+# Modes whose receiver runs as a daemon, checked and stopped over its control socket
+mode_daemon() {
+	[ "$1" = daemon ]
+}
+
+# Waits until the daemon behind control socket $1 has finished a transfer,
+# then asks it to quit
+stop_daemon() {
+	for _ in $(seq 1 200); do
+		if "$BIN_DIR/file_recieve" --control "$1" --ctl stats | grep -q "^transfers_done 1$"; then
+			"$BIN_DIR/file_recieve" --control "$1" --ctl quit
+			return
+		fi
+		sleep 0.05
+	done
+	"$BIN_DIR/file_recieve" --control "$1" --ctl quit
+	return 1
+}
+
+while [ $# -gt 0 ]; do
+	case "$1" in
+	--check) CHECK=1 ;;
+	--size)
+		SIZE_MB=$2
+		shift
+		;;
+	--profile)
+		PROFILES+=("$2")
+		shift
+		;;
+	--mode)
+		MODES+=("$2")
+		shift
+		;;
+	-h | --help)
+		usage
+		exit 0
+		;;
+	*)
+		usage
+		exit 1
+		;;
+	esac
+	shift
+done
+
+if [ ${#PROFILES[@]} -eq 0 ]; then
+	if [ $CHECK -eq 1 ]; then
+		PROFILES=(loopback wifi)
+	else
+		PROFILES=(loopback lan wifi hotspot lossy)
+	fi
+fi
+if [ ${#MODES[@]} -eq 0 ]; then
+	read -r -a MODES <<<"$(all_modes)"
+fi
+if [ $CHECK -eq 1 ] && [ "$SIZE_MB" -gt 8 ]; then
+	SIZE_MB=8
+fi
+
+for bin in file_send file_recieve impair_proxy; do
+	if [ ! -x "./$bin" ]; then
+		echo "$bin is not built, run make first"
+		exit 1
+	fi
+done
+
+WORK=$(mktemp -d)
+trap 'kill $(jobs -p) 2>/dev/null; rm -rf "$WORK"' EXIT
+
+# Incompressible payload so gzip does not hide the link
+mkdir -p "$WORK/payload/bench"
+head -c $((SIZE_MB * 1024 * 1024)) /dev/urandom >"$WORK/payload/bench/data.bin"
+tar -czf "$WORK/payload.tar.gz" -C "$WORK/payload" .
+PAYLOAD_BYTES=$(stat -c %s "$WORK/payload.tar.gz")
+
+# Both the receiver and the proxy serve a single client, so wait for their
+# log line instead of probing the port
+wait_for_log() {
+	for _ in $(seq 1 200); do
+		if grep -q "$2" "$1" 2>/dev/null; then
+			return 0
+		fi
+		sleep 0.05
+	done
+	return 1
+}
+
+elapsed() {
+	awk -v a="$1" -v b="$2" 'BEGIN { printf "%.3f", b - a }'
+}
+
+# Runs one transfer, prints "<seconds> <status>"
+run_transfer() {
+	local profile=$1 mode=$2 run=$3
+	local rx_port=$((20000 + RANDOM % 20000))
+	local px_port=$((rx_port + 1))
+	local rx="$WORK/$run"
+	local receivers targets="" rx_pids=() px_pid="" k
+	receivers=$(mode_receivers "$mode")
+
+	# Receiver k listens on rx_port + 2k and keeps its files under rx/k
+	for ((k = 0; k < receivers; k++)); do
+		local k_port=$((rx_port + 2 * k)) rx_args=() ready="Waiting for connection"
+		if mode_daemon "$mode"; then
+			rx_args=(--daemon --control "$rx/$k/control.sock")
+			ready="Serving on port"
+		fi
+		mkdir -p "$rx/$k/home"
+		(cd "$rx/$k" && exec env HOME="$rx/$k/home" XDG_CACHE_HOME="$rx/$k/home/.cache" "$BIN_DIR/file_recieve" "${rx_args[@]}" "$k_port") \
+			>"$rx/receiver$k.log" 2>&1 &
+		rx_pids+=($!)
+		targets+="${targets:+,}127.0.0.1:$k_port"
+		wait_for_log "$rx/receiver$k.log" "$ready"
+	done
+	local port=$rx_port
+	if [ "$receivers" -eq 1 ]; then
+		targets=127.0.0.1
+	fi
+
+	if [ "$profile" != loopback ]; then
+		local udp="" once=--once
+		if mode_uses_udp "$mode"; then
+			udp="--udp"
+		fi
+		if mode_probes "$mode"; then
+			once=""
+		fi
+		# shellcheck disable=SC2046
+		./impair_proxy $(profile_args "$profile") $udp $once "$px_port" 127.0.0.1 "$rx_port" \
+			>"$rx/proxy.log" 2>&1 &
+		px_pid=$!
+		port=$px_port
+		wait_for_log "$rx/proxy.log" "listening on port"
+	fi
+
+	local start end
+	start=$(date +%s.%N)
+	# shellcheck disable=SC2046
+	./file_send $(sender_args "$mode") --file "$WORK/payload.tar.gz" "$targets" "$port" \
+		>"$rx/sender.log" 2>&1
+	local tx_status=$? rx_status=0 pid
+	if mode_daemon "$mode"; then
+		for ((k = 0; k < receivers; k++)); do
+			stop_daemon "$rx/$k/control.sock" >>"$rx/control.log" 2>&1 || rx_status=1
+		done
+	fi
+	for pid in "${rx_pids[@]}"; do
+		wait "$pid" || rx_status=1
+	done
+	end=$(date +%s.%N)
+	if [ -n "$px_pid" ] && mode_probes "$mode"; then
+		kill "$px_pid" 2>/dev/null
+		wait "$px_pid" 2>/dev/null
+	fi
+
+	local status=ok
+	if [ $tx_status -ne 0 ] || [ $rx_status -ne 0 ]; then
+		status=failed
+	else
+		for ((k = 0; k < receivers; k++)); do
+			if ! cmp -s "$WORK/payload/bench/data.bin" "$rx/$k/home/Downloads/vimsicles/bench/data.bin"; then
+				status=corrupt
+			fi
+		done
+	fi
+	if [ "$status" != ok ]; then
+		echo "--- $profile/$mode logs ---" >&2
+		cat "$rx"/*.log >&2
+	fi
+	rm -rf "$rx"
+	echo "$(elapsed "$start" "$end") $status"
+}
+
+FAILED=0
+RUN=0
+printf "%-10s %-12s %10s %10s %12s  %s\n" profile mode size_MB time_s goodput_Mbps status
+for profile in "${PROFILES[@]}"; do
+	if ! profile_args "$profile" >/dev/null; then
+		echo "Unknown profile: $profile"
+		exit 1
+	fi
+	for mode in "${MODES[@]}"; do
+		if ! sender_args "$mode" >/dev/null; then
+			echo "Unknown mode: $mode"
+			exit 1
+		fi
+		if mode_loopback_only "$mode" && [ "$profile" != loopback ]; then
+			continue
+		fi
+		RUN=$((RUN + 1))
+		read -r secs status <<<"$(run_transfer "$profile" "$mode" "run$RUN")"
+		awk -v p="$profile" -v m="$mode" -v b="$PAYLOAD_BYTES" -v t="$secs" -v s="$status" \
+			'BEGIN { printf "%-10s %-12s %10.1f %10.2f %12.1f  %s\n", p, m, b / 1048576, t, b * 8 / t / 1e6, s }'
+		if [ "$status" != ok ]; then
+			FAILED=1
+		fi
+	done
+done
+
+exit $FAILED
@@ -0,0 +1,341 @@
+#pragma once
+
+#include "protocol.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <string>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+// Archives the receiver already has, so sending one again costs a handshake.
+// Every verified archive is kept in the cache directory and an index maps its
+// MD5 to the copy. The index is a fixed-size open-addressing table in a file
+// that lookups simply mmap. Writers take a lock, build the next table in a
+// temporary file and rename() it over the index, so a reader (or a crash)
+// only ever sees a whole table.
+//
+// A hit is trusted only while the cached file still has the size and mtime it
+// was recorded with. The oldest archives are evicted once the cache holds
+// more than its budget (CONTENT_CACHE_BYTES unless the receiver says
+// otherwise; a budget of 0 turns the cache off). pin() opens a hit under a
+// shared lock on the index, so an eviction cannot pull it away in between.
+
+#define CONTENT_CACHE_SLOTS 4096
+#define CONTENT_CACHE_BYTES (4ULL << 30)
+#define CONTENT_CACHE_MAGIC "vimscac1"
+
+struct cache_header
+{
+        char magic[8];
+        uint32_t slots;
+        uint32_t count;
+};
+
+struct cache_slot
+{
+        uint64_t size;
+        int64_t mtime_nsec; // of the cached copy, to notice it being replaced
+        int64_t stamp;      // when it was stored, for eviction
+        uint8_t used;
+        uint8_t md5[16];
+        char path[231];
+};
+
+class content_cache
+{
+      private:
+        std::string dir;
+        uint64_t budget;
+
+        static size_t home_slot(const uint8_t *md5) { return get_be64(md5) % CONTENT_CACHE_SLOTS; }
+
+        static int64_t mtime_of(const struct stat &st)
+        {
+                return int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        }
+
+        std::string index_path() const { return dir + "/index"; }
+
+        // index.lock held with `how` (LOCK_SH or LOCK_EX) until closed; -1 on failure
+        int lock_index(int how) const
+        {
+                int lock = open((dir + "/index.lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+                if (lock >= 0 && flock(lock, how) < 0)
+                {
+                        close(lock);
+                        return -1;
+                }
+                return lock;
+        }
+
+        static size_t index_size()
+        {
+                return sizeof(cache_header) + CONTENT_CACHE_SLOTS * sizeof(cache_slot);
+        }
+
+        // The current index mapped read-only (unmap with index_size()), or
+        // nullptr if there is no valid one yet
+        const cache_header *map_index() const
+        {
+                int fd = open(index_path().c_str(), O_RDONLY | O_CLOEXEC);
+                if (fd < 0)
+                        return nullptr;
+                struct stat st;
+                void *map = MAP_FAILED;
+                if (fstat(fd, &st) == 0 && size_t(st.st_size) == index_size())
+                        map = mmap(nullptr, index_size(), PROT_READ, MAP_SHARED, fd, 0);
+                close(fd);
+                if (map == MAP_FAILED)
+                        return nullptr;
+                auto *header = static_cast<const cache_header *>(map);
+                if (memcmp(header->magic, CONTENT_CACHE_MAGIC, 8) != 0 ||
+                    header->slots != CONTENT_CACHE_SLOTS)
+                {
+                        munmap(map, index_size());
+                        return nullptr;
+                }
+                return header;
+        }
+
+        // Every used slot of the current index
+        std::vector<cache_slot> load() const
+        {
+                std::vector<cache_slot> entries;
+                const cache_header *header = map_index();
+                if (!header)
+                        return entries;
+                auto *slots = reinterpret_cast<const cache_slot *>(header + 1);
+                for (size_t i = 0; i < CONTENT_CACHE_SLOTS; i++)
+                        if (slots[i].used)
+                                entries.push_back(slots[i]);
+                munmap((void *)header, index_size());
+                return entries;
+        }
+
+        // Writes `entries` as the new index
+        bool save(const std::vector<cache_slot> &entries) const
+        {
+                std::string temp = index_path() + ".tmp";
+                int fd = open(temp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+                if (fd < 0)
+                        return false;
+                size_t len = index_size();
+                void *map  = MAP_FAILED;
+                if (ftruncate(fd, len) == 0)
+                        map = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                if (map == MAP_FAILED)
+                {
+                        close(fd);
+                        unlink(temp.c_str());
+                        return false;
+                }
+                auto *header = static_cast<cache_header *>(map);
+                auto *slots  = reinterpret_cast<cache_slot *>(header + 1);
+                memcpy(header->magic, CONTENT_CACHE_MAGIC, 8);
+                header->slots = CONTENT_CACHE_SLOTS;
+                header->count = entries.size();
+                for (const cache_slot &entry : entries)
+                {
+                        size_t i = home_slot(entry.md5);
+                        while (slots[i].used)
+                                i = (i + 1) % CONTENT_CACHE_SLOTS;
+                        slots[i] = entry;
+                }
+                bool ok = msync(map, len, MS_SYNC) == 0;
+                munmap(map, len);
+                close(fd);
+                if (!ok || rename(temp.c_str(), index_path().c_str()) < 0)
+                {
+                        unlink(temp.c_str());
+                        return false;
+                }
+                return true;
+        }
+
+        // Moves `file` to `to`: a rename on the same filesystem, otherwise a
+        // reflink where the filesystem has them and a copy where it does not
+        static bool move_file(const std::string &file, const std::string &to)
+        {
+                if (rename(file.c_str(), to.c_str()) == 0)
+                        return true;
+                if (errno != EXDEV)
+                        return false;
+                int in  = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+                int out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+                bool ok = in >= 0 && out >= 0;
+                if (ok && ioctl(out, FICLONE, in) < 0)
+                {
+                        ssize_t copied;
+                        while ((copied = copy_file_range(in, nullptr, out, nullptr, 1 << 30, 0)) > 0)
+                                ;
+                        ok = copied == 0;
+                }
+                if (in >= 0)
+                        close(in);
+                if (out >= 0 && close(out) < 0)
+                        ok = false;
+                if (!ok)
+                        unlink(to.c_str());
+                else
+                        unlink(file.c_str());
+                return ok;
+        }
+
+        // The entry recorded for this MD5 (hex); false if there is none
+        bool find(const std::string &md5, cache_slot &out) const
+        {
+                std::string key = from_hex(md5);
+                if (budget == 0 || key.size() != 16)
+                        return false;
+                const cache_header *header = map_index();
+                if (!header)
+                        return false;
+
+                auto *slots = reinterpret_cast<const cache_slot *>(header + 1);
+                auto *want  = reinterpret_cast<const uint8_t *>(key.data());
+                bool found  = false;
+                for (size_t i = home_slot(want), probes = 0;
+                     slots[i].used && probes < CONTENT_CACHE_SLOTS;
+                     i = (i + 1) % CONTENT_CACHE_SLOTS, probes++)
+                {
+                        if (memcmp(slots[i].md5, want, 16) != 0)
+                                continue;
+                        out   = slots[i];
+                        found = true;
+                        break;
+                }
+                munmap((void *)header, index_size());
+                return found;
+        }
+
+        static bool unchanged(const struct stat &st, const cache_slot &entry)
+        {
+                return uint64_t(st.st_size) == entry.size && mtime_of(st) == entry.mtime_nsec;
+        }
+
+      public:
+        explicit content_cache(const std::string &directory,
+                               uint64_t budget_bytes = CONTENT_CACHE_BYTES)
+            : dir(directory), budget(budget_bytes)
+        {
+        }
+
+        // $XDG_CACHE_HOME/vimsicles, or ~/.cache/vimsicles
+        static std::string default_dir()
+        {
+                const char *xdg = getenv("XDG_CACHE_HOME");
+                if (xdg && *xdg)
+                        return std::string(xdg) + "/vimsicles";
+                const char *home = getenv("HOME");
+                return std::string(home ? home : ".") + "/.cache/vimsicles";
+        }
+
+        // Path of the cached archive with this MD5 (hex), empty if there is none
+        std::string lookup(const std::string &md5) const
+        {
+                cache_slot entry;
+                struct stat cached;
+                if (!find(md5, entry) || stat(entry.path, &cached) < 0 || !unchanged(cached, entry))
+                        return "";
+                return entry.path;
+        }
+
+        // The cached archive with this MD5 (hex) opened for reading, or -1.
+        // It stays readable through the descriptor even if it is evicted
+        // afterwards.
+        int pin(const std::string &md5) const
+        {
+                if (budget == 0)
+                        return -1;
+                int lock = lock_index(LOCK_SH);
+                if (lock < 0)
+                        return -1;
+                cache_slot entry;
+                int fd = -1;
+                if (find(md5, entry))
+                        fd = open(entry.path, O_RDONLY | O_CLOEXEC);
+                struct stat cached;
+                if (fd >= 0 && (fstat(fd, &cached) < 0 || !unchanged(cached, entry)))
+                {
+                        close(fd);
+                        fd = -1;
+                }
+                close(lock);
+                return fd;
+        }
+
+        // Moves a verified archive into the cache under its MD5 (hex) and
+        // evicts the oldest ones beyond the size budget. False if it was not
+        // kept; `file` is then left where it was unless it had already been
+        // moved, so the caller should remove it either way.
+        bool store(const std::string &md5, const std::string &file)
+        {
+                std::string key = from_hex(md5);
+                std::string to  = dir + "/objects/" + md5;
+                struct stat st;
+                if (budget == 0 || key.size() != 16 || to.size() >= sizeof(cache_slot::path) ||
+                    stat(file.c_str(), &st) < 0 || uint64_t(st.st_size) > budget)
+                        return false;
+                for (size_t slash = to.find('/', 1); slash != std::string::npos;
+                     slash        = to.find('/', slash + 1))
+                        mkdir(to.substr(0, slash).c_str(), 0700);
+
+                int lock = lock_index(LOCK_EX);
+                if (lock < 0)
+                        return false;
+
+                std::vector<cache_slot> entries = load();
+                entries.erase(std::remove_if(entries.begin(), entries.end(),
+                                             [&](const cache_slot &entry)
+                                             { return memcmp(entry.md5, key.data(), 16) == 0; }),
+                              entries.end());
+
+                bool ok = move_file(file, to) && stat(to.c_str(), &st) == 0;
+                if (ok)
+                {
+                        cache_slot entry = {};
+                        entry.size       = st.st_size;
+                        entry.mtime_nsec = mtime_of(st);
+                        entry.stamp      = time(nullptr);
+                        entry.used       = 1;
+                        memcpy(entry.md5, key.data(), 16);
+                        memcpy(entry.path, to.c_str(), to.size() + 1);
+                        entries.push_back(entry);
+
+                        // Oldest first out, until both the bytes and the table fit;
+                        // the new archive is last and fits on its own
+                        std::stable_sort(entries.begin(), entries.end(),
+                                         [](const cache_slot &a, const cache_slot &b)
+                                         { return a.stamp < b.stamp; });
+                        uint64_t bytes = 0;
+                        for (const cache_slot &cached : entries)
+                                bytes += cached.size;
+                        size_t evict = 0;
+                        while (evict < entries.size() &&
+                               (bytes > budget ||
+                                entries.size() - evict > CONTENT_CACHE_SLOTS * 3 / 4))
+                        {
+                                unlink(entries[evict].path);
+                                bytes -= entries[evict].size;
+                                evict++;
+                        }
+                        entries.erase(entries.begin(), entries.begin() + evict);
+                        ok = save(entries);
+                        if (!ok)
+                                unlink(to.c_str());
+                }
+                close(lock);
+                return ok;
+        }
+};
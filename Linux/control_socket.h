@@ -0,0 +1,156 @@
+#pragma once
+
+#include "protocol.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// The receiver daemon's control socket. A client connects to a unix socket,
+// sends one command line and reads the text reply until the daemon closes
+// the connection:
+//
+//   stats | list | set rate <Mbit/s> | set transfers <n> |
+//   set priority <id> <n> | quit
+//
+// Replies to commands that fail start with "error:". The daemon serves one
+// client at a time, so each gets CONTROL_TIMEOUT_MS to send its line and
+// take the answer; one that stalls cannot hold up the next.
+
+#define CONTROL_TIMEOUT_MS 1000
+#define CONTROL_LINE_MAX 4096
+
+// What the commands act on; the daemon fills in every one
+struct control_handlers
+{
+        std::function<std::string()> stats;
+        std::function<std::string()> list;
+        std::function<void(double)> set_rate; // Mbit/s, 0 for no limit
+        std::function<void(size_t)> set_transfers;
+        std::function<bool(int, int)> set_priority; // false if there is no such transfer
+        std::function<size_t()> quit;               // returns how many are still running
+};
+
+// Parses one command line and runs it; the reply ends in a newline
+inline std::string control_command(const control_handlers &handlers, const std::string &line)
+{
+        std::istringstream in(line);
+        std::string command, what;
+        in >> command >> what;
+        if (command == "stats")
+                return handlers.stats();
+        if (command == "list")
+                return handlers.list();
+        if (command == "quit")
+                return "ok, finishing " + std::to_string(handlers.quit()) + " transfers\n";
+        double value = 0;
+        if (command == "set" && what == "rate" && in >> value && value >= 0)
+        {
+                handlers.set_rate(value);
+                return "ok\n";
+        }
+        if (command == "set" && what == "transfers" && in >> value && value >= 1)
+        {
+                handlers.set_transfers(size_t(value));
+                return "ok\n";
+        }
+        int id = 0;
+        if (command == "set" && what == "priority" && in >> id >> value)
+        {
+                if (!handlers.set_priority(id, int(value)))
+                        return "error: no transfer " + std::to_string(id) + "\n";
+                return "ok\n";
+        }
+        return "error: unknown command, try stats, list, set rate <Mbit/s>, set transfers <n>, "
+               "set priority <id> <n> or quit\n";
+}
+
+// `path` as a unix socket address; false if it does not fit
+inline bool control_address(const std::string &path, sockaddr_un &address)
+{
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path))
+                return false;
+        memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        return true;
+}
+
+// A listening socket at `path` that only this user can connect to; -1 on
+// failure. It is bound in a private directory and renamed into place, so it
+// never exists with looser permissions and the process umask is left alone.
+inline int open_control_socket(const std::string &path)
+{
+        std::string parent  = path.substr(0, path.find_last_of('/') + 1);
+        std::string staging = parent + ".vimsicles-control-XXXXXX";
+        sockaddr_un address;
+        if (!control_address(staging + "/sock", address) || !mkdtemp(&staging[0]))
+                return -1;
+        control_address(staging + "/sock", address);
+
+        int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool ok  = sock >= 0 && bind(sock, (struct sockaddr *)&address, sizeof(address)) == 0 &&
+                  chmod(address.sun_path, 0600) == 0 && listen(sock, 8) == 0 &&
+                  rename(address.sun_path, path.c_str()) == 0;
+        if (!ok)
+        {
+                unlink(address.sun_path);
+                if (sock >= 0)
+                        close(sock);
+                sock = -1;
+        }
+        rmdir(staging.c_str());
+        return sock;
+}
+
+// Reads one command from `client`, answers it and closes the connection. A
+// client that does not finish its line in time gets an error instead.
+inline void serve_control_client(int client, const control_handlers &handlers)
+{
+        struct timeval wait = {CONTROL_TIMEOUT_MS / 1000, (CONTROL_TIMEOUT_MS % 1000) * 1000};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &wait, sizeof(wait));
+        std::string line;
+        char c;
+        ssize_t got = 0;
+        while (line.size() < CONTROL_LINE_MAX && (got = recv(client, &c, 1, 0)) == 1 && c != '\n')
+                line += c;
+        std::string reply =
+            got < 0 ? "error: no command received\n" : control_command(handlers, line);
+        send_all(client, reply.data(), reply.size());
+        close(client);
+}
+
+// Sends one command to the daemon at `path` and collects its reply; false
+// if no daemon listens there
+inline bool control_request(const std::string &path, const std::string &command,
+                            std::string &reply)
+{
+        sockaddr_un address;
+        if (!control_address(path, address))
+                return false;
+        int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sock < 0 || connect(sock, (struct sockaddr *)&address, sizeof(address)) < 0)
+        {
+                if (sock >= 0)
+                        close(sock);
+                return false;
+        }
+        std::string line = command + "\n";
+        send_all(sock, line.data(), line.size());
+        char buffer[4096];
+        ssize_t got;
+        reply.clear();
+        while ((got = recv(sock, buffer, sizeof(buffer), 0)) > 0)
+                reply.append(buffer, got);
+        close(sock);
+        return true;
+}
@@ -0,0 +1,282 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Parallel directory scanner that builds the manifest an archive is written
+// from. Every worker owns a deque of directories still to be read: it takes
+// the newest from its own (depth first, the dentries are still hot) and,
+// when that runs dry, steals the oldest from another worker, which is usually
+// the root of a large untouched subtree. Directories are read with
+// getdents64 into a large buffer and every entry is statx()ed relative to the
+// open directory, so no path is resolved twice and one syscall returns a
+// whole batch of names.
+//
+// Unreadable entries are reported and skipped, the way tar does.
+
+#define WALKER_DENTS_BUFFER (1 << 20)
+
+struct manifest_entry
+{
+        std::string path;   // name inside the archive
+        std::string source; // where to read it from
+        std::string link;   // symlink target
+        uint32_t mode       = 0;
+        uint32_t uid        = 0;
+        uint32_t gid        = 0;
+        uint32_t nlink      = 1;
+        uint64_t size       = 0;
+        int64_t mtime       = 0;
+        uint32_t mtime_nsec = 0;
+        int64_t ctime       = 0; // inode change, which no utimes() can set back
+        uint32_t ctime_nsec = 0;
+        uint64_t ino        = 0;
+        uint64_t dev        = 0;
+};
+
+// Directory scanning waits on the disk or metadata server far more than on
+// the CPU, so run more threads than cores
+inline size_t walker_threads()
+{
+        size_t cores = std::max(1u, std::thread::hardware_concurrency());
+        return std::min<size_t>(std::max<size_t>(2 * cores, 4), 16);
+}
+
+class dir_walker
+{
+      private:
+        struct work_queue
+        {
+                std::mutex lock;
+                std::deque<manifest_entry> dirs;
+        };
+
+        struct linux_dirent64
+        {
+                uint64_t d_ino;
+                int64_t d_off;
+                unsigned short d_reclen;
+                unsigned char d_type;
+                char d_name[];
+        };
+
+        size_t thread_count;
+        std::vector<work_queue> queues;
+        std::atomic<size_t> queued{0};  // waiting in some queue
+        std::atomic<size_t> pending{0}; // queued or being read
+        std::mutex idle_lock;
+        std::condition_variable idle;
+
+        std::mutex result_lock;
+        std::vector<manifest_entry> entries;
+        std::vector<std::string> failures;
+
+        static void fill(manifest_entry &entry, const struct statx &st)
+        {
+                entry.mode       = st.stx_mode;
+                entry.uid        = st.stx_uid;
+                entry.gid        = st.stx_gid;
+                entry.nlink      = st.stx_nlink;
+                entry.size       = S_ISREG(st.stx_mode) ? st.stx_size : 0;
+                entry.mtime      = st.stx_mtime.tv_sec;
+                entry.mtime_nsec = st.stx_mtime.tv_nsec;
+                entry.ctime      = st.stx_ctime.tv_sec;
+                entry.ctime_nsec = st.stx_ctime.tv_nsec;
+                entry.ino        = st.stx_ino;
+                entry.dev        = uint64_t(st.stx_dev_major) << 32 | st.stx_dev_minor;
+        }
+
+        static bool stat_at(int dirfd, const char *name, int flags, manifest_entry &entry)
+        {
+                struct statx st;
+                unsigned mask = STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID |
+                                STATX_MTIME | STATX_CTIME | STATX_INO | STATX_SIZE;
+                if (statx(dirfd, name, flags | AT_STATX_DONT_SYNC, mask, &st) < 0)
+                        return false;
+                fill(entry, st);
+                return true;
+        }
+
+        void fail(const std::string &path)
+        {
+                std::lock_guard<std::mutex> guard(result_lock);
+                failures.push_back(path + ": " + strerror(errno));
+        }
+
+        void push(size_t worker, manifest_entry &&dir)
+        {
+                pending++;
+                {
+                        std::lock_guard<std::mutex> guard(queues[worker].lock);
+                        queues[worker].dirs.push_back(std::move(dir));
+                }
+                queued++;
+                std::lock_guard<std::mutex> guard(idle_lock);
+                idle.notify_one();
+        }
+
+        // Own queue from the back, others from the front
+        bool take(size_t worker, manifest_entry &dir)
+        {
+                for (size_t i = 0; i < thread_count; i++)
+                {
+                        work_queue &queue = queues[(worker + i) % thread_count];
+                        std::lock_guard<std::mutex> guard(queue.lock);
+                        if (queue.dirs.empty())
+                                continue;
+                        if (i == 0)
+                        {
+                                dir = std::move(queue.dirs.back());
+                                queue.dirs.pop_back();
+                        }
+                        else
+                        {
+                                dir = std::move(queue.dirs.front());
+                                queue.dirs.pop_front();
+                        }
+                        queued--;
+                        return true;
+                }
+                return false;
+        }
+
+        void read_directory(size_t worker, const manifest_entry &dir,
+                            std::vector<manifest_entry> &found, std::vector<char> &buffer)
+        {
+                int fd = open(dir.source.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (fd < 0)
+                {
+                        fail(dir.source);
+                        return;
+                }
+                while (true)
+                {
+                        long got = syscall(SYS_getdents64, fd, buffer.data(), buffer.size());
+                        if (got < 0)
+                                fail(dir.source);
+                        if (got <= 0)
+                                break;
+                        for (long pos = 0; pos < got;)
+                        {
+                                auto *dent =
+                                    reinterpret_cast<linux_dirent64 *>(buffer.data() + pos);
+                                pos += dent->d_reclen;
+                                const char *name = dent->d_name;
+                                if (name[0] == '.' &&
+                                    (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+                                        continue;
+
+                                manifest_entry entry;
+                                entry.path   = dir.path + "/" + name;
+                                entry.source = dir.source + "/" + name;
+                                if (!stat_at(fd, name, AT_SYMLINK_NOFOLLOW, entry))
+                                {
+                                        fail(entry.source);
+                                        continue;
+                                }
+                                if (S_ISLNK(entry.mode))
+                                {
+                                        char target[4096];
+                                        ssize_t len = readlinkat(fd, name, target, sizeof(target));
+                                        if (len < 0)
+                                        {
+                                                fail(entry.source);
+                                                continue;
+                                        }
+                                        entry.link.assign(target, len);
+                                }
+                                if (S_ISDIR(entry.mode))
+                                        push(worker, manifest_entry(entry));
+                                found.push_back(std::move(entry));
+                        }
+                }
+                close(fd);
+        }
+
+        void run(size_t worker)
+        {
+                std::vector<char> buffer(WALKER_DENTS_BUFFER);
+                std::vector<manifest_entry> found;
+                while (true)
+                {
+                        manifest_entry dir;
+                        if (take(worker, dir))
+                        {
+                                read_directory(worker, dir, found, buffer);
+                                if (--pending == 0)
+                                {
+                                        std::lock_guard<std::mutex> guard(idle_lock);
+                                        idle.notify_all();
+                                }
+                                continue;
+                        }
+                        std::unique_lock<std::mutex> guard(idle_lock);
+                        idle.wait(guard, [&] { return queued > 0 || pending == 0; });
+                        if (pending == 0)
+                                break;
+                }
+                std::lock_guard<std::mutex> guard(result_lock);
+                entries.insert(entries.end(), std::make_move_iterator(found.begin()),
+                               std::make_move_iterator(found.end()));
+        }
+
+      public:
+        explicit dir_walker(size_t threads = walker_threads())
+            : thread_count(std::max<size_t>(threads, 1)), queues(thread_count)
+        {
+        }
+
+        // Each root becomes a top-level entry named after its last component,
+        // like `cp -r root dir/`. Roots are followed if they are symlinks,
+        // nothing below them is. Entries come back sorted by path, so a
+        // directory always precedes its contents.
+        std::vector<manifest_entry> scan(const std::vector<std::string> &roots)
+        {
+                entries.clear();
+                failures.clear();
+                for (std::string root : roots)
+                {
+                        while (root.size() > 1 && root.back() == '/')
+                                root.pop_back();
+                        manifest_entry entry;
+                        entry.source = root;
+                        entry.path   = root.substr(root.find_last_of('/') + 1);
+                        if (entry.path.empty() || entry.path == "." || entry.path == "..")
+                                entry.path = "root";
+                        if (!stat_at(AT_FDCWD, root.c_str(), 0, entry))
+                        {
+                                fail(root);
+                                continue;
+                        }
+                        if (S_ISDIR(entry.mode))
+                                push(0, manifest_entry(entry));
+                        entries.push_back(std::move(entry));
+                }
+
+                std::vector<std::thread> workers;
+                for (size_t i = 0; i < thread_count; i++)
+                        workers.emplace_back([this, i] { run(i); });
+                for (auto &worker : workers)
+                        worker.join();
+
+                std::sort(entries.begin(), entries.end(),
+                          [](const manifest_entry &a, const manifest_entry &b)
+                          { return a.path < b.path; });
+                return std::move(entries);
+        }
+
+        // Paths that could not be read during the last scan, with the reason
+        const std::vector<std::string> &errors() const { return failures; }
+};
@@ -1,3 +1,18 @@
+#include "aead.h"
+#include "content_cache.h"
+#include "control_socket.h"
+#include "ktls.h"
+#include "landing.h"
+#include "mapped_file.h"
+#include "multipath.h"
+#include "pipeline.h"
+#include "probe.h"
+#include "protocol.h"
+#include "shaping.h"
+#include "stream_frames.h"
+#include "tar_archive.h"
+#include "udp_transport.h"
+
 #include <arpa/inet.h>
 #include <cstring>
 #include <fstream>
@@ -5,21 +20,73 @@
 #include <netinet/in.h>
 #include <openssl/crypto.h>
 #include <openssl/evp.h>
+#include <openssl/rand.h>
 #include <string>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <filesystem>
 #include <sstream>
 #include <cstdlib>
+#include <fcntl.h>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <getopt.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <sys/stat.h>
 
 #define Chunks_size 65536
 #define DEFAULT_PORT 8080
+#define DEFAULT_SYNC_MS 200
+// run_transfer() status of a connection that only probed the link
+#define PROBED 2
 
 using namespace std;
 namespace fs = std::filesystem;
 
 class receiver {
 private:
+    // A transfer in progress, as the control socket reports it
+    struct transfer_state {
+        int id = 0;
+        int flow = -1;
+        string peer;
+        string filename;
+        string mode = "tcp";
+        uint64_t size = 0; // 0 when the sender did not say
+        atomic<uint64_t> received{0};
+        atomic<const char*> phase{"handshake"};
+        int join_listener = -1; // where the extra paths of a multipath transfer connect
+        chrono::steady_clock::time_point started = chrono::steady_clock::now();
+    };
+
+    // Shared by all transfers of the process, so a daemon keeps them warm
+    buffer_pool frames{aead_buffer_size()};
+    token_bucket bucket;
+    flow_scheduler scheduler{bucket};
+
+    mutex transfers_lock;
+    condition_variable transfers_changed;
+    map<int, shared_ptr<transfer_state>> transfers;
+    int next_transfer = 1;
+    size_t active = 0; // accepted and not finished, guarded by transfers_lock
+    size_t max_transfers = 4;
+    bool daemon_mode = false;
+    atomic<bool> stopping{false};
+    atomic<bool> udp_busy{false};
+
+    // Makes received files durable in rounds shared by concurrent
+    // transfers; null leaves it to the kernel's writeback
+    unique_ptr<group_commit> durability;
+
+    chrono::steady_clock::time_point started_at = chrono::steady_clock::now();
+    atomic<uint64_t> done_count{0}, failed_count{0}, cached_count{0}, bytes_total{0};
+
     string receive_metadata(int sock) {
         char buffer[1024] = {0};
         int bytes_received = recv(sock, buffer, sizeof(buffer) - 1, 0);
@@ -36,150 +103,852 @@ private:
         }
     }
 
+    // Hashed in process: an unpublished landing file only has a name
+    // under this process's /proc/self/fd
     bool verify_md5(const string& filename, const string& expected_md5) {
-        string cmd = "md5sum " + filename + " | awk '{print $1}'";
-        FILE* pipe = popen(cmd.c_str(), "r");
-        if (!pipe) {
-            throw runtime_error("Failed to calculate MD5 hash");
+        return file_digest(filename, "md5") == expected_md5;
+    }
+
+    // Waits for the next sync round to cover the filesystems of `fds`
+    void make_durable(const vector<int>& fds) {
+        if (durability && !durability->sync(fds)) {
+            throw runtime_error("Failed to sync received files to disk");
         }
+    }
 
-        char buffer[33] = {0};
-        if (fgets(buffer, sizeof(buffer), pipe) == NULL) {
-            pclose(pipe);
-            throw runtime_error("Failed to read MD5 hash");
+    static void write_file(int fd, const void* data, size_t len) {
+        if (!write_all(fd, data, len)) {
+            throw runtime_error("Failed to write file: " + string(strerror(errno)));
         }
-        pclose(pipe);
-        buffer[32] = '\0'; // Remove newline
+    }
 
-        return string(buffer) == expected_md5;
+    // Counts what arrived and waits for the transfer's turn under the rate
+    // limit, which holds the sender back through TCP flow control
+    void account(transfer_state& state, size_t bytes) {
+        state.received += bytes;
+        scheduler.acquire(state.flow, bytes);
     }
 
-    void extract_archive(const string& archive_path) {
-        // Create the target directory if it doesn't exist
-        string target_dir = string(getenv("HOME")) + "/Downloads/vimsicles";
-        fs::create_directories(target_dir);
+    void receive_plain(int sock, int fd, transfer_state& state) {
+        char buffer[Chunks_size];
+        while (true) {
+            int bytes_received = recv(sock, buffer, Chunks_size, 0);
+            if (bytes_received <= 0) break;
+            write_file(fd, buffer, bytes_received);
+            account(state, bytes_received);
+        }
+    }
+
+    // Mirror of sender::send_encrypted: frames are read off the socket on one
+    // thread, authenticated and decrypted on the worker pool, and written here
+    // in order. A stream without its final frame is treated as truncated.
+    void receive_encrypted(int sock, int fd, const aead_session& session, transfer_state& state) {
+        size_t threads = stage_threads();
+        buffer_pool& pool = frames;
+        vector<unique_ptr<frame_cipher>> ciphers;
+        for (size_t i = 0; i < threads; i++) {
+            ciphers.push_back(make_unique<frame_cipher>(session, false));
+        }
+
+        ordered_stage<aead_frame> stage(threads, threads * 4, [&](aead_frame& frame, size_t worker) {
+            frame.ok = ciphers[worker]->open(frame.seq, frame.buffer.data(), frame.len);
+        });
+
+        thread reader([&] {
+            for (uint64_t seq = 0;; seq++) {
+                aead_frame frame;
+                frame.buffer = pool.get();
+                frame.seq = seq;
+                if (!recv_all(sock, frame.buffer.data(), AEAD_HEADER_SIZE)) break;
+                uint32_t header = get_be32(frame.buffer.data());
+                frame.final = header & AEAD_FINAL_FLAG;
+                frame.len = header & ~AEAD_FINAL_FLAG;
+                if (frame.len > AEAD_FRAME_SIZE) break;
+                if (!recv_all(sock, frame.buffer.data() + AEAD_HEADER_SIZE, frame.len + AEAD_TAG_SIZE)) break;
+                account(state, frame.wire_size());
+                bool final = frame.final;
+                if (!stage.submit(move(frame)) || final) break;
+            }
+            stage.close();
+        });
 
-        // Extract the archive
-        string cmd = "tar -xzf " + archive_path + " -C " + target_dir;
-        if (system(cmd.c_str()) != 0) {
-            throw runtime_error("Failed to extract archive");
+        bool complete = false, forged = false, unwritten = false;
+        aead_frame frame;
+        while (stage.take(frame)) {
+            if (!frame.ok) {
+                forged = true;
+                break;
+            }
+            if (!write_all(fd, frame.buffer.data() + AEAD_HEADER_SIZE, frame.len)) {
+                unwritten = true;
+                break;
+            }
+            pool.put(move(frame.buffer));
+            if (frame.final) {
+                complete = true;
+                break;
+            }
+        }
+        stage.close();
+        shutdown(sock, SHUT_RD);
+        reader.join();
+
+        if (forged) {
+            throw runtime_error("Decryption failed: data was altered or keys differ (check VIMSICLES_PSK)");
+        }
+        if (unwritten) {
+            throw runtime_error("Failed to write file");
+        }
+        if (!complete) {
+            throw runtime_error("Encrypted stream ended early");
         }
     }
 
-public:
-    int port;
+    // Chunks go out as they arrive and are checked against the trailing hash;
+    // what was written before a mismatch cannot be taken back, so the caller
+    // has to treat a failed stream as garbage
+    void receive_stream(int sock, transfer_state& state) {
+        stream_reader stream(sock);
+        const unsigned char* data;
+        size_t len;
+        while (stream.next(data, len)) {
+            if (!write_all(stream_out, data, len)) {
+                throw runtime_error("Failed to write the stream out: " + string(strerror(errno)));
+            }
+            account(state, len);
+        }
+        cout << "Stream received and verified (" << stream.bytes() << " bytes)" << endl;
+    }
 
-    receiver(int p) : port(p) {}
+    // The handshake connection is the first path; the others join with the
+    // token, and every path's chunks are written at their offsets
+    void receive_multipath(int sock, size_t extra, const string& token, int fd, uint64_t size,
+                           transfer_state& state) {
+        vector<int> socks = accept_joins(state.join_listener, extra, token, sock);
+        close(state.join_listener);
+        state.join_listener = -1;
+        cout << "Receiving over " << socks.size() + 1 << " paths" << endl;
+        socks.insert(socks.begin(), sock);
 
-    int initialize() {
-        int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-        if (server_fd < 0) {
-            cerr << "Error creating socket" << endl;
-            return 1;
+        // The paths share the transfer's flow, so they take turns asking
+        mutex pacing;
+        multipath_receiver transport(fd, size, [&](size_t bytes) {
+            lock_guard<mutex> guard(pacing);
+            account(state, bytes);
+        });
+        string error;
+        try {
+            transport.run(socks);
+        } catch (const exception& e) {
+            error = e.what();
+        }
+        for (size_t i = 1; i < socks.size(); i++) close(socks[i]);
+        if (!error.empty()) {
+            throw runtime_error(error);
         }
+    }
 
-        int opt = 1;
-        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-            cerr << "Error setting socket options" << endl;
-            close(server_fd);
-            return 1;
+    // Kernel TLS: records are decrypted by the kernel and spliced to disk
+    void receive_spliced(int sock, int fd, transfer_state& state) {
+        bool ok = splice_all(sock, fd, [&](size_t bytes) { account(state, bytes); });
+        if (!ok) {
+            throw runtime_error(errno == EBADMSG ? "Decryption failed: TLS record does not authenticate"
+                                                 : "Failed to receive file");
         }
+    }
 
+    // Bound to the same port number as the TCP listener, so one address (and
+    // one impair_proxy port) covers both channels
+    int open_udp_socket() {
+        int sock = socket(AF_INET, SOCK_DGRAM, 0);
+        if (sock < 0) return -1;
+        int opt = 1;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
         struct sockaddr_in address;
         memset(&address, 0, sizeof(address));
         address.sin_family = AF_INET;
         address.sin_addr.s_addr = INADDR_ANY;
         address.sin_port = htons(port);
+        if (bind(sock, (struct sockaddr*)&address, sizeof(address)) < 0) {
+            close(sock);
+            return -1;
+        }
+        return sock;
+    }
 
-        if (bind(server_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
-            cerr << "Error binding socket" << endl;
-            close(server_fd);
-            return 1;
+    // Any free port for the extra paths of a multipath transfer; its number
+    // goes into `join_port`
+    static int open_join_listener(size_t paths, int& join_port) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0) return -1;
+        struct sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = INADDR_ANY;
+        socklen_t len = sizeof(address);
+        if (bind(sock, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(sock, paths) < 0 ||
+            getsockname(sock, (struct sockaddr*)&address, &len) < 0) {
+            close(sock);
+            return -1;
         }
+        join_port = ntohs(address.sin_port);
+        return sock;
+    }
 
-        if (listen(server_fd, 3) < 0) {
-            cerr << "Error listening on socket" << endl;
-            close(server_fd);
-            return 1;
+    // Multicast: bound to the group and port the sender named, joined on the
+    // interface our control connection uses. SO_REUSEADDR lets several
+    // receivers on one host share the group.
+    int open_multicast_socket(int control, const string& group_spec) {
+        size_t colon = group_spec.rfind(':');
+        struct sockaddr_in group;
+        memset(&group, 0, sizeof(group));
+        group.sin_family = AF_INET;
+        group.sin_port = htons(colon == string::npos ? port : stoi(group_spec.substr(colon + 1)));
+        if (inet_pton(AF_INET, group_spec.substr(0, colon).c_str(), &group.sin_addr) <= 0 ||
+            !IN_MULTICAST(ntohl(group.sin_addr.s_addr))) {
+            return -1;
         }
 
-        cout << "Waiting for connection on port " << port << "..." << endl;
+        struct sockaddr_in local;
+        socklen_t local_len = sizeof(local);
+        if (getsockname(control, (struct sockaddr*)&local, &local_len) < 0) return -1;
 
-        int client_socket = accept(server_fd, nullptr, nullptr);
-        if (client_socket < 0) {
-            cerr << "Error accepting connection" << endl;
-            close(server_fd);
-            return 1;
+        int sock = socket(AF_INET, SOCK_DGRAM, 0);
+        if (sock < 0) return -1;
+        int opt = 1;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        if (bind(sock, (struct sockaddr*)&group, sizeof(group)) < 0 ||
+            !udp_join_group(sock, group.sin_addr, local.sin_addr)) {
+            close(sock);
+            return -1;
+        }
+        return sock;
+    }
+
+    // Datagrams are taken from the control connection's peer only, or from
+    // `source` when the sender named the address its group traffic leaves from
+    void receive_udp(int sock, int udp_sock, int fd, uint64_t size, uint32_t fec_group, uint32_t receiver_id,
+                     const string& source) {
+        try {
+            udp_receiver transport(udp_sock, sock, fd, size, fec_group, receiver_id);
+            struct in_addr from;
+            if (!source.empty()) {
+                if (inet_pton(AF_INET, source.c_str(), &from) != 1) {
+                    throw runtime_error("Invalid sender address " + source);
+                }
+                transport.expect_source(from);
+            }
+            transport.run();
+            if (transport.chunks_recovered() > 0) {
+                cout << "Recovered " << transport.chunks_recovered() << " datagrams from parity" << endl;
+            }
+        } catch (...) {
+            close(udp_sock);
+            throw;
+        }
+        close(udp_sock);
+    }
+
+    void extract_archive(const string& archive_path) {
+        // Create the target directory if it doesn't exist
+        string target_dir = string(getenv("HOME")) + "/Downloads/vimsicles";
+        fs::create_directories(target_dir);
+
+        // Extract the archive: directories first, file contents on a pool of
+        // threads, directory metadata last
+        vector<string> errors;
+        size_t entries = unpack_archive(archive_path, target_dir, errors);
+        for (const string& error : errors) {
+            cerr << "Warning: " << error << endl;
+        }
+        if (!errors.empty()) {
+            throw runtime_error("Failed to extract " + to_string(errors.size()) + " of " +
+                                to_string(entries) + " archive entries");
         }
 
+        // Every extracted file got its name only once it was complete; one
+        // round of syncs makes the tree and its names durable
+        int target_fd = open(target_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (target_fd < 0) {
+            throw runtime_error("Failed to open " + target_dir);
+        }
+        try {
+            make_durable({target_fd});
+        } catch (...) {
+            close(target_fd);
+            throw;
+        }
+        close(target_fd);
+    }
+
+    // Handshake, transfer, verification and extraction for one connection;
+    // the socket is closed when it returns
+    int handle(int client_socket, const string& peer) {
+        auto entry = make_shared<transfer_state>();
+        transfer_state& state = *entry;
+        state.peer = peer;
+        state.flow = scheduler.add_flow();
+        {
+            lock_guard<mutex> guard(transfers_lock);
+            state.id = next_transfer++;
+            transfers[state.id] = entry;
+        }
+        bool udp_claimed = false;
+
+        int status = run_transfer(client_socket, state, udp_claimed);
+
+        if (udp_claimed) {
+            udp_busy = false;
+        }
+        if (state.join_listener >= 0) {
+            close(state.join_listener);
+        }
+        close(client_socket);
+        scheduler.remove_flow(state.flow);
+        if (status != PROBED) {
+            bytes_total += state.received;
+            (status == 0 ? done_count : failed_count)++;
+        }
+        lock_guard<mutex> guard(transfers_lock);
+        transfers.erase(state.id);
+        transfers_changed.notify_all();
+        return status;
+    }
+
+    int run_transfer(int client_socket, transfer_state& state, bool& udp_claimed) {
         try {
-            // Receive metadata (filename and MD5 hash)
+            // Receive metadata (filename, MD5 hash and optional settings)
             string metadata = receive_metadata(client_socket);
             size_t pos = metadata.find('|');
             if (pos == string::npos) {
                 throw runtime_error("Invalid metadata format");
             }
 
+            // Only the name is used, and in a daemon it gets the transfer id
+            // in front so concurrent transfers cannot collide
             string filename = metadata.substr(0, pos);
+            filename = filename.substr(filename.find_last_of('/') + 1);
+            if (filename.empty() || filename == "." || filename == "..") {
+                throw runtime_error("Invalid file name");
+            }
+            if (daemon_mode) {
+                filename = to_string(state.id) + "-" + filename;
+            }
             string expected_md5 = metadata.substr(pos + 1);
+            transfer_options offer;
+            size_t opts = expected_md5.find('|');
+            if (opts != string::npos) {
+                offer = parse_options(expected_md5.substr(opts + 1));
+                expected_md5 = expected_md5.substr(0, opts);
+            }
+            state.filename = filename;
+            state.size = stoull(option_or(offer, "size", "0"));
+            scheduler.set_priority(state.flow, stoi(option_or(offer, "prio", "0")));
+
+            // A probe only measures the link for the sender, which connects
+            // again for the transfer itself; it is paced like one
+            if (offer.count("probe")) {
+                send_response(client_socket, "hello|probe=1");
+                state.mode = "probe";
+                state.phase = "probing";
+                if (!answer_probe(client_socket, [&](size_t bytes) { account(state, bytes); })) {
+                    cerr << "Probe ended early" << endl;
+                }
+                return PROBED;
+            }
+
+            // Streams have no archive and no MD5 up front, they only go to
+            // stream_out
+            if (offer.count("stream")) {
+                send_response(client_socket, stream_out >= 0 ? "hello|stream=1" : "hello");
+                if (stream_out < 0) {
+                    throw runtime_error("Sender is streaming, start file_recieve with --stdout to take it");
+                }
+                state.mode = "stream";
+                state.phase = "receiving";
+                receive_stream(client_socket, state);
+                return 0;
+            }
+            if (stream_out >= 0) {
+                throw runtime_error("--stdout only takes streams from file_send --stdin");
+            }
+
+            // An archive that arrived before is extracted from the cache
+            // without taking any data, if the sender knows to stop there. It is
+            // read through a descriptor opened under the index lock, so another
+            // transfer evicting it meanwhile cannot take it away.
+            content_cache cache(content_cache::default_dir(), cache_bytes);
+            int cached = offer.count("cache") ? cache.pin(expected_md5) : -1;
+            if (cached >= 0) {
+                try {
+                    state.mode = "cached";
+                    send_response(client_socket, "hello|have=1");
+                    state.phase = "extracting";
+                    extract_archive("/proc/self/fd/" + to_string(cached));
+                } catch (...) {
+                    close(cached);
+                    throw;
+                }
+                close(cached);
+                cout << "Archive already received before, extracted the cached copy" << endl;
+                cached_count++;
+                return 0;
+            }
+
+            // Agree on a cipher if the sender asked for encryption. Kernel TLS
+            // wins when both ends have it; otherwise encrypt in user space.
+            transfer_options reply;
+            unique_ptr<aead_session> session;
+            bool use_ktls = false;
+            if (offer.count("ktls") && offer.count("kx") && ktls_attach(client_socket)) {
+                key_exchange kx;
+                auto material = kx.derive(offer["kx"], offer["kx"], kx.public_hex(), "ktls", KTLS_MATERIAL_SIZE);
+                if (ktls_install(client_socket, TLS_RX, material)) {
+                    use_ktls = true;
+                    state.mode = "ktls";
+                    reply["ktls"] = "1";
+                    reply["kx"] = kx.public_hex();
+                    cout << "Decrypting with kernel TLS (" CIPHER_AES_GCM ")" << endl;
+                }
+            }
+            if (!use_ktls && offer.count("enc") && offer.count("kx")) {
+                string cipher = choose_cipher(offer["enc"]);
+                if (cipher.empty()) {
+                    throw runtime_error("No common cipher with sender");
+                }
+                key_exchange kx;
+                session = make_unique<aead_session>(
+                    cipher, kx.derive(offer["kx"], offer["kx"], kx.public_hex(), "aead",
+                                      aead_session::material_size()));
+                reply["enc"] = cipher;
+                reply["kx"] = kx.public_hex();
+                state.mode = "aead";
+                cout << "Decrypting with " << cipher << endl;
+            }
+
+            // Open the datagram channel if the sender wants the UDP transport
+            int udp_sock = -1;
+            string transport = option_or(offer, "transport", "");
+            // The UDP port is shared, so a daemon takes one UDP transfer at a
+            // time and receives the others over TCP
+            if (transport == "udp" && !session && !use_ktls) {
+                if (!udp_busy.exchange(true)) {
+                    udp_claimed = true;
+                    udp_sock = open_udp_socket();
+                }
+                if (udp_sock >= 0) {
+                    reply["transport"] = "udp";
+                    state.mode = "udp";
+                } else {
+                    cout << "Cannot open UDP port " << port << ", receiving over TCP" << endl;
+                }
+            } else if (transport == "mcast" && !session && !use_ktls) {
+                // There is no unicast fallback for a group transfer
+                udp_sock = open_multicast_socket(client_socket, option_or(offer, "group", ""));
+                if (udp_sock < 0) {
+                    throw runtime_error("Cannot join multicast group " + option_or(offer, "group", ""));
+                }
+                reply["transport"] = "mcast";
+                state.mode = "mcast";
+                cout << "Joined multicast group " << offer["group"] << endl;
+            }
+
+            // Several paths from the sender's interfaces: the extra ones join on
+            // a port of their own and prove they belong with a token
+            size_t paths = stoul(option_or(offer, "paths", "1"));
+            string join_token;
+            if (paths > 1 && paths <= 16 && udp_sock < 0 && !session && !use_ktls && offer.count("size")) {
+                int join_port = 0;
+                unsigned char secret[MULTIPATH_TOKEN_SIZE / 2];
+                state.join_listener = open_join_listener(paths, join_port);
+                if (state.join_listener >= 0 && RAND_bytes(secret, sizeof(secret)) == 1) {
+                    join_token = to_hex(secret, sizeof(secret));
+                    reply["mp"] = to_string(join_port);
+                    reply["token"] = join_token;
+                    state.mode = "multipath";
+                }
+            }
 
             // Send acknowledgment
-            send_response(client_socket, "hello");
+            send_response(client_socket, reply.empty() ? "hello" : "hello|" + format_options(reply));
 
             // Receive the file
-            ofstream file(filename, ios::binary);
-            if (!file) {
-                throw runtime_error("Failed to create file");
+            // The archive lands unnamed and only gets its name once it is
+            // complete, verified and on disk, so a crash or a failed
+            // transfer never leaves a truncated archive behind
+            state.phase = "receiving";
+            landing_file archive(AT_FDCWD, filename, 0644);
+            if (!archive.ok()) {
+                if (udp_sock >= 0) close(udp_sock);
+                throw runtime_error("Failed to create file: " + string(strerror(errno)));
             }
-
-            char buffer[Chunks_size];
-            while (true) {
-                int bytes_received = recv(client_socket, buffer, Chunks_size, 0);
-                if (bytes_received <= 0) break;
-                file.write(buffer, bytes_received);
+            if (udp_sock >= 0) {
+                receive_udp(client_socket, udp_sock, archive.fd(), stoull(option_or(offer, "size", "0")),
+                            stoul(option_or(offer, "fec", "0")), stoul(option_or(offer, "id", "0")),
+                            transport == "mcast" ? option_or(offer, "src", "") : "");
+                state.received = fs::file_size(archive.path());
+            } else if (!join_token.empty()) {
+                receive_multipath(client_socket, paths - 1, join_token, archive.fd(), state.size, state);
+            } else if (use_ktls) {
+                receive_spliced(client_socket, archive.fd(), state);
+            } else if (session) {
+                receive_encrypted(client_socket, archive.fd(), *session, state);
+            } else {
+                receive_plain(client_socket, archive.fd(), state);
             }
-            file.close();
 
             // Verify MD5 hash
-            if (!verify_md5(filename, expected_md5)) {
+            state.phase = "verifying";
+            if (!verify_md5(archive.path(), expected_md5)) {
                 throw runtime_error("MD5 hash verification failed");
             }
+            make_durable({archive.fd()});
+            if (int error = archive.publish()) {
+                throw runtime_error("Failed to name " + filename + ": " + strerror(error));
+            }
 
             // Extract the archive
+            state.phase = "extracting";
             extract_archive(filename);
 
-            // Clean up the archive file
-            fs::remove(filename);
+            // Keep the archive so the same send next time is a cache hit
+            if (!cache.store(expected_md5, filename)) {
+                fs::remove(filename);
+            }
 
             cout << "File received, verified, and extracted successfully" << endl;
+            return 0;
         }
         catch (const exception& e) {
             cerr << "Error: " << e.what() << endl;
-            close(client_socket);
+            return 1;
+        }
+    }
+
+    int open_listener() {
+        int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (server_fd < 0) {
+            cerr << "Error creating socket" << endl;
+            return -1;
+        }
+
+        int opt = 1;
+        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+            cerr << "Error setting socket options" << endl;
+            close(server_fd);
+            return -1;
+        }
+
+        struct sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = INADDR_ANY;
+        address.sin_port = htons(port);
+
+        if (bind(server_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+            cerr << "Error binding socket" << endl;
+            close(server_fd);
+            return -1;
+        }
+
+        if (listen(server_fd, daemon_mode ? 64 : 3) < 0) {
+            cerr << "Error listening on socket" << endl;
             close(server_fd);
+            return -1;
+        }
+        return server_fd;
+    }
+
+    // Waits up to 200 ms for a connection so the caller can notice a quit
+    static int accept_for_a_while(int listener, string& peer) {
+        struct pollfd ready = {listener, POLLIN, 0};
+        if (poll(&ready, 1, 200) <= 0) {
+            return -1;
+        }
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        int sock = accept(listener, (struct sockaddr*)&from, &from_len);
+        if (sock >= 0) {
+            char ip[INET_ADDRSTRLEN] = "?";
+            inet_ntop(AF_INET, &from.sin_addr, ip, sizeof(ip));
+            peer = string(ip) + ":" + to_string(ntohs(from.sin_port));
+        }
+        return sock;
+    }
+
+    string stats() {
+        ostringstream out;
+        lock_guard<mutex> guard(transfers_lock);
+        out << "uptime_s " << chrono::duration<double>(chrono::steady_clock::now() - started_at).count() << "\n"
+            << "transfers_active " << transfers.size() << "\n"
+            << "transfers_done " << done_count << "\n"
+            << "transfers_failed " << failed_count << "\n"
+            << "transfers_cached " << cached_count << "\n"
+            << "bytes_received " << bytes_total << "\n"
+            << "rate_limit_mbit " << bucket.bytes_per_second() * 8 / 1e6 << "\n"
+            << "max_transfers " << max_transfers << "\n";
+        return out.str();
+    }
+
+    string list() {
+        ostringstream out;
+        out << "id peer mode phase received size seconds mbit\n";
+        lock_guard<mutex> guard(transfers_lock);
+        for (const auto& entry : transfers) {
+            const transfer_state& t = *entry.second;
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - t.started).count();
+            out << t.id << " " << t.peer << " " << t.mode << " " << t.phase.load() << " " << t.received << " "
+                << t.size << " " << seconds << " " << (seconds > 0 ? t.received * 8 / seconds / 1e6 : 0) << "\n";
+        }
+        return out.str();
+    }
+
+    // What the control socket's commands act on
+    control_handlers controls() {
+        control_handlers handlers;
+        handlers.stats = [this] { return stats(); };
+        handlers.list = [this] { return list(); };
+        handlers.set_rate = [this](double mbit) { bucket.set_rate(mbit * 1e6 / 8); };
+        handlers.set_transfers = [this](size_t count) {
+            lock_guard<mutex> guard(transfers_lock);
+            max_transfers = count;
+            transfers_changed.notify_all();
+        };
+        handlers.set_priority = [this](int id, int priority) {
+            lock_guard<mutex> guard(transfers_lock);
+            auto it = transfers.find(id);
+            if (it == transfers.end()) {
+                return false;
+            }
+            scheduler.set_priority(it->second->flow, priority);
+            return true;
+        };
+        handlers.quit = [this] {
+            lock_guard<mutex> guard(transfers_lock);
+            stopping = true;
+            transfers_changed.notify_all();
+            return transfers.size();
+        };
+        return handlers;
+    }
+
+    // One client at a time; each has CONTROL_TIMEOUT_MS to say what it wants
+    void serve_control(int control_fd) {
+        control_handlers handlers = controls();
+        while (!stopping) {
+            string peer;
+            int client = accept_for_a_while(control_fd, peer);
+            if (client >= 0) {
+                serve_control_client(client, handlers);
+            }
+        }
+    }
+
+public:
+    int port;
+    // Where streams are written (--stdout), -1 to refuse them
+    int stream_out = -1;
+    // Budget of the archive cache (--cache-size), 0 to keep nothing
+    uint64_t cache_bytes = CONTENT_CACHE_BYTES;
+
+    receiver(int p) : durability(make_unique<group_commit>(DEFAULT_SYNC_MS)), port(p) {}
+
+    // Received files are synced to disk in rounds at least this many
+    // milliseconds apart, shared by every transfer that finishes in between;
+    // -1 leaves it to the kernel's writeback
+    void set_sync_interval(int interval_ms) {
+        durability.reset(interval_ms < 0 ? nullptr : new group_commit(interval_ms));
+    }
+
+    // Receives one transfer and exits; probes before it are answered and
+    // do not count
+    int initialize() {
+        int server_fd = open_listener();
+        if (server_fd < 0) {
             return 1;
         }
 
-        close(client_socket);
+        cout << "Waiting for connection on port " << port << "..." << endl;
+
+        int status;
+        do {
+            int client_socket = accept(server_fd, nullptr, nullptr);
+            if (client_socket < 0) {
+                cerr << "Error accepting connection" << endl;
+                close(server_fd);
+                return 1;
+            }
+            status = handle(client_socket, "");
+        } while (status == PROBED);
         close(server_fd);
+        return status;
+    }
+
+    // Daemon: stays up and serves transfers concurrently (up to
+    // max_transfers at a time) until "quit" arrives on the control socket
+    int serve(const string& control_path, double rate_mbit, size_t transfers_at_once) {
+        daemon_mode = true;
+        max_transfers = max<size_t>(transfers_at_once, 1);
+        bucket.set_rate(rate_mbit * 1e6 / 8);
+
+        int server_fd = open_listener();
+        if (server_fd < 0) {
+            return 1;
+        }
+        int control_fd = open_control_socket(control_path);
+        if (control_fd < 0) {
+            cerr << "Cannot listen on control socket " << control_path << endl;
+            close(server_fd);
+            return 1;
+        }
+
+        thread control([&] { serve_control(control_fd); });
+        cout << "Serving on port " << port << ", control socket " << control_path << endl;
+
+        while (!stopping) {
+            {
+                unique_lock<mutex> guard(transfers_lock);
+                transfers_changed.wait(guard, [&] { return stopping || active < max_transfers; });
+                if (stopping) break;
+            }
+            string peer;
+            int client = accept_for_a_while(server_fd, peer);
+            if (client < 0) {
+                continue;
+            }
+            {
+                lock_guard<mutex> guard(transfers_lock);
+                active++;
+            }
+            cout << "Transfer from " << peer << endl;
+            thread([this, client, peer] {
+                handle(client, peer);
+                lock_guard<mutex> guard(transfers_lock);
+                active--;
+                transfers_changed.notify_all();
+            }).detach();
+        }
+
+        close(server_fd);
+        {
+            unique_lock<mutex> guard(transfers_lock);
+            transfers_changed.wait(guard, [&] { return active == 0; });
+        }
+        control.join();
+        close(control_fd);
+        unlink(control_path.c_str());
+        cout << "Daemon stopped" << endl;
         return 0;
     }
 };
 
+// $XDG_RUNTIME_DIR/vimsicles.sock, or one per user in /tmp
+static string default_control_path() {
+    const char* runtime = getenv("XDG_RUNTIME_DIR");
+    if (runtime && *runtime) {
+        return string(runtime) + "/vimsicles.sock";
+    }
+    return "/tmp/vimsicles-" + to_string(getuid()) + ".sock";
+}
+
+// Sends one command to a running daemon and prints its reply
+static int control_client(const string& path, const string& command) {
+    string reply;
+    if (!control_request(path, command, reply)) {
+        cerr << "No daemon listening on " << path << endl;
+        return 1;
+    }
+    cout << reply;
+    return reply.compare(0, 6, "error:") == 0 ? 1 : 0;
+}
+
+static void usage(const char* name) {
+    cout << "Usage: " << name << " [--daemon] [--control PATH] [--rate MBIT] [--max-transfers N]" << endl;
+    cout << "       " << string(strlen(name), ' ') << " [--sync-interval MS | --no-sync]"
+         << " [--cache-size MB | --no-cache] [port]" << endl;
+    cout << "       " << name << " --stdout [port]   (one stream from file_send --stdin to standard output)" << endl;
+    cout << "       " << name << " [--control PATH] --ctl \"stats|list|set rate MBIT|set transfers N|"
+         << "set priority ID N|quit\"" << endl;
+    cout << "If no port is specified, default port " << DEFAULT_PORT << " will be used." << endl;
+    cout << "Without --daemon one transfer is received and the program exits." << endl;
+    cout << "Received files are synced to disk in rounds at least --sync-interval ms apart (default "
+         << DEFAULT_SYNC_MS << ")." << endl;
+    cout << "Received archives are kept in " << content_cache::default_dir() << ", up to --cache-size MB (default "
+         << (CONTENT_CACHE_BYTES >> 20) << "), so the same archive sent again is only extracted." << endl;
+}
+
 int main(int argc, char** argv) {
     int port = DEFAULT_PORT;
-    
-    if (argc > 2) {
-        cout << "Usage: " << argv[0] << " [port]" << endl;
-        cout << "If no port is specified, default port " << DEFAULT_PORT << " will be used." << endl;
+    bool daemon = false;
+    bool to_stdout = false;
+    string control_path = default_control_path();
+    string command;
+    double rate_mbit = 0;
+    int max_transfers = 4;
+    int sync_interval = DEFAULT_SYNC_MS;
+    long long cache_mb = CONTENT_CACHE_BYTES >> 20;
+
+    static const option options[] = {{"daemon", no_argument, nullptr, 'd'},
+                                     {"control", required_argument, nullptr, 'c'},
+                                     {"ctl", required_argument, nullptr, 'C'},
+                                     {"rate", required_argument, nullptr, 'r'},
+                                     {"max-transfers", required_argument, nullptr, 't'},
+                                     {"stdout", no_argument, nullptr, 'o'},
+                                     {"sync-interval", required_argument, nullptr, 'i'},
+                                     {"no-sync", no_argument, nullptr, 'n'},
+                                     {"cache-size", required_argument, nullptr, 's'},
+                                     {"no-cache", no_argument, nullptr, 'N'},
+                                     {"help", no_argument, nullptr, 'h'},
+                                     {nullptr, 0, nullptr, 0}};
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, nullptr)) != -1) {
+        switch (opt) {
+        case 'd': daemon = true; break;
+        case 'c': control_path = optarg; break;
+        case 'C': command = optarg; break;
+        case 'r': rate_mbit = atof(optarg); break;
+        case 't': max_transfers = atoi(optarg); break;
+        case 'o': to_stdout = true; break;
+        case 'i': sync_interval = atoi(optarg); break;
+        case 'n': sync_interval = -1; break;
+        case 's': cache_mb = atoll(optarg); break;
+        case 'N': cache_mb = 0; break;
+        default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (argc - optind > 1 || rate_mbit < 0 || max_transfers < 1 || sync_interval < -1 || cache_mb < 0 ||
+        (daemon && to_stdout)) {
+        usage(argv[0]);
         return 1;
     }
-    
-    if (argc == 2) {
-        port = stoi(argv[1]);
+    if (!command.empty()) {
+        return control_client(control_path, command);
     }
-    
-    cout << "Using port: " << port << endl;
+
+    if (argc - optind == 1) {
+        port = stoi(argv[optind]);
+    }
+
+    // The stream gets the real stdout; everything printed goes to stderr
     receiver server(port);
+    if (sync_interval != DEFAULT_SYNC_MS) {
+        server.set_sync_interval(sync_interval);
+    }
+    server.cache_bytes = uint64_t(cache_mb) << 20;
+    if (to_stdout) {
+        cout.flush();
+        server.stream_out = dup(STDOUT_FILENO);
+        if (server.stream_out < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+            cerr << "Cannot redirect standard output" << endl;
+            return 1;
+        }
+        signal(SIGPIPE, SIG_IGN);
+    }
+
+    cout << "Using port: " << port << endl;
+    if (daemon) {
+        return server.serve(control_path, rate_mbit, max_transfers);
+    }
     return server.initialize();
 }
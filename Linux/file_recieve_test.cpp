@@ -1,3 +1,18 @@
+#include "aead.h"
+#include "archive_cache.h"
+#include "content_cache.h"
+#include "control_socket.h"
+#include "ktls.h"
+#include "landing.h"
+#include "mapped_file.h"
+#include "multipath.h"
+#include "probe.h"
+#include "shaping.h"
+#include "stream_frames.h"
+#include "tar_archive.h"
+#include "udp_transport.h"
+#include "zerocopy.h"
+
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
 #include <fstream>
@@ -11,6 +26,10 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
 
 using ::testing::_;
 using ::testing::Return;
@@ -73,6 +92,1057 @@ TEST_F(FileReceiveTest, VerifyMD5) {
     std::filesystem::remove(tempArchive);
 }
 
+TEST(MappedReaderTest, CrossesWindowsAndMatchesMd5sum) {
+    // Sparse file just past one mapping window, with marks at the seam
+    std::string path = "mapped_reader_test.bin";
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(ftruncate(fd, MAPPED_WINDOW + 1000), 0);
+    ASSERT_EQ(pwrite(fd, "ab", 2, MAPPED_WINDOW - 1), 2);
+    ASSERT_EQ(pwrite(fd, "z", 1, MAPPED_WINDOW + 999), 1);
+    close(fd);
+
+    mapped_reader reader(path);
+    const unsigned char* data;
+    size_t len;
+    uint64_t total = 0;
+    while (reader.next(data, len, 1 << 20)) {
+        if (total <= MAPPED_WINDOW - 1 && MAPPED_WINDOW - 1 < total + len) {
+            EXPECT_EQ(data[MAPPED_WINDOW - 1 - total], 'a');
+        }
+        if (total == MAPPED_WINDOW) {
+            EXPECT_EQ(data[0], 'b');
+        }
+        total += len;
+    }
+    EXPECT_EQ(total, MAPPED_WINDOW + 1000);
+    EXPECT_TRUE(reader.done());
+
+    std::string cmd = "md5sum " + path + " | awk '{print $1}'";
+    FILE* pipe = popen(cmd.c_str(), "r");
+    char buffer[33] = {0};
+    ASSERT_NE(fgets(buffer, sizeof(buffer), pipe), nullptr);
+    pclose(pipe);
+    EXPECT_EQ(file_digest(path, "md5"), std::string(buffer));
+
+    std::filesystem::remove(path);
+}
+
+TEST(DirWalkerTest, ScansTreeIntoExtractableArchive) {
+    namespace fs = std::filesystem;
+    fs::path root = fs::temp_directory_path() / "vimsicles_walker_test";
+    fs::remove_all(root);
+    fs::create_directories(root / "tree/a/b");
+    fs::create_directories(root / "out");
+    for (int i = 0; i < 50; i++) {
+        std::ofstream(root / "tree/a" / ("f" + std::to_string(i))) << "file " << i;
+    }
+    std::ofstream(root / "tree/a/b" / std::string(120, 'n')) << "long name";
+    fs::create_symlink("../f1", root / "tree/a/b/link");
+
+    dir_walker walker(4);
+    auto manifest = walker.scan({(root / "tree").string()});
+    EXPECT_TRUE(walker.errors().empty());
+    ASSERT_EQ(manifest.size(), 1u + 2 + 50 + 2);
+    EXPECT_EQ(manifest[0].path, "tree");
+    EXPECT_TRUE(std::is_sorted(manifest.begin(), manifest.end(),
+                               [](const manifest_entry& a, const manifest_entry& b) { return a.path < b.path; }));
+
+    std::vector<std::string> errors;
+    std::string archive = (root / "tree.tar.gz").string();
+    write_archive(archive, manifest, 1, errors);
+    EXPECT_TRUE(errors.empty());
+    std::string cmd = "tar -xzf " + archive + " -C " + (root / "out").string();
+    ASSERT_EQ(system(cmd.c_str()), 0);
+
+    std::ifstream f7(root / "out/tree/a/f7");
+    std::string text((std::istreambuf_iterator<char>(f7)), std::istreambuf_iterator<char>());
+    EXPECT_EQ(text, "file 7");
+    EXPECT_TRUE(fs::exists(root / "out/tree/a/b" / std::string(120, 'n')));
+    EXPECT_EQ(fs::read_symlink(root / "out/tree/a/b/link"), "../f1");
+
+    fs::remove_all(root);
+}
+
+TEST(DirWalkerTest, UnpacksTarArchivesInParallel) {
+    namespace fs = std::filesystem;
+    fs::path root = fs::temp_directory_path() / "vimsicles_unpack_test";
+    fs::remove_all(root);
+    fs::create_directories(root / "tree/d/" / std::string(120, 'n'));
+    fs::create_directories(root / "out");
+    for (int i = 0; i < 200; i++) {
+        std::ofstream(root / "tree/d" / ("f" + std::to_string(i))) << "file " << i;
+    }
+    std::ofstream(root / "tree/big") << std::string(3 << 20, 'b');
+    fs::create_hard_link(root / "tree/big", root / "tree/big.link");
+    fs::create_symlink("d/f1", root / "tree/sym");
+    fs::permissions(root / "tree/d" / std::string(120, 'n'), fs::perms(0555));
+    ASSERT_EQ(system(("cd " + root.string() + " && touch -d @1000000000 tree/d && "
+                      "tar --format=gnu -czf gnu.tar.gz tree").c_str()), 0);
+
+    std::vector<std::string> errors;
+    EXPECT_EQ(unpack_archive((root / "gnu.tar.gz").string(), (root / "out").string(), errors), 206u);
+    EXPECT_TRUE(errors.empty());
+    std::ifstream f7(root / "out/tree/d/f7");
+    std::string text((std::istreambuf_iterator<char>(f7)), std::istreambuf_iterator<char>());
+    EXPECT_EQ(text, "file 7");
+    EXPECT_EQ(fs::file_size(root / "out/tree/big"), 3u << 20);
+    EXPECT_TRUE(fs::equivalent(root / "out/tree/big", root / "out/tree/big.link"));
+    EXPECT_EQ(fs::read_symlink(root / "out/tree/sym"), "d/f1");
+    EXPECT_EQ(fs::status(root / "out/tree/d" / std::string(120, 'n')).permissions(), fs::perms(0555));
+    struct stat st;
+    ASSERT_EQ(stat((root / "out/tree/d").c_str(), &st), 0);
+    EXPECT_EQ(st.st_mtime, 1000000000);
+
+    manifest_entry escape;
+    escape.path = "../escape";
+    escape.mode = S_IFREG | 0644;
+    escape.size = 0;
+    tar_writer writer((root / "evil.tar.gz").string(), 1);
+    writer.add(escape, nullptr, -1);
+    writer.finish();
+    errors.clear();
+    unpack_archive((root / "evil.tar.gz").string(), (root / "out").string(), errors);
+    EXPECT_EQ(errors.size(), 1u);
+    EXPECT_FALSE(fs::exists(root / "escape"));
+
+    fs::permissions(root / "tree/d" / std::string(120, 'n'), fs::perms(0755));
+    fs::permissions(root / "out/tree/d" / std::string(120, 'n'), fs::perms(0755));
+    fs::remove_all(root);
+}
+
+TEST(ContentCacheTest, FindsStoredArchivesUntilTheyChange) {
+    namespace fs = std::filesystem;
+    fs::path root = fs::temp_directory_path() / "vimsicles_cache_test";
+    fs::remove_all(root);
+    fs::create_directories(root);
+    content_cache cache((root / "cache").string());
+
+    std::vector<std::string> hashes;
+    for (int i = 0; i < 3; i++) {
+        std::string name = (root / ("a" + std::to_string(i))).string();
+        std::ofstream(name) << "archive " << i;
+        hashes.push_back(file_digest(name));
+        EXPECT_EQ(cache.lookup(hashes[i]), "");
+        ASSERT_TRUE(cache.store(hashes[i], name));
+        EXPECT_FALSE(fs::exists(name));
+    }
+    for (int i = 0; i < 3; i++) {
+        std::string cached = cache.lookup(hashes[i]);
+        ASSERT_NE(cached, "");
+        std::ifstream in(cached);
+        std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        EXPECT_EQ(text, "archive " + std::to_string(i));
+    }
+
+    // A copy rewritten behind the index's back is not trusted any more
+    std::ofstream(cache.lookup(hashes[1])) << "something else";
+    EXPECT_EQ(cache.lookup(hashes[1]), "");
+    EXPECT_NE(cache.lookup(hashes[2]), "");
+    EXPECT_EQ(cache.lookup("not a hash"), "");
+
+    // A pinned copy stays readable after a smaller budget evicts it
+    int pinned = cache.pin(hashes[2]);
+    ASSERT_GE(pinned, 0);
+    EXPECT_LT(cache.pin(hashes[1]), 0);
+    content_cache small((root / "cache").string(), 12);
+    std::string name = (root / "newest").string();
+    std::ofstream(name) << "archive 3";
+    ASSERT_TRUE(small.store(file_digest(name), name));
+    EXPECT_EQ(cache.lookup(hashes[2]), "");
+    char text[16] = {};
+    EXPECT_EQ(pread(pinned, text, sizeof(text), 0), 9);
+    EXPECT_STREQ(text, "archive 2");
+    close(pinned);
+
+    // A budget of 0 is no cache at all
+    content_cache off((root / "cache").string(), 0);
+    std::ofstream(name) << "archive 4";
+    EXPECT_FALSE(off.store(file_digest(name), name));
+    EXPECT_LT(off.pin(hashes[2]), 0);
+
+    fs::remove_all(root);
+}
+
+TEST(ArchiveCacheTest, ReusesArchivesOfUnchangedSelections) {
+    namespace fs = std::filesystem;
+    fs::path root = fs::temp_directory_path() / "vimsicles_archive_cache_test";
+    fs::remove_all(root);
+    fs::create_directories(root / "tree");
+    std::ofstream(root / "tree/a") << "first";
+
+    dir_walker walker(2);
+    std::string before = tree_fingerprint(walker.scan({(root / "tree").string()}), 6);
+    EXPECT_EQ(before, tree_fingerprint(walker.scan({(root / "tree").string()}), 6));
+    EXPECT_NE(before, tree_fingerprint(walker.scan({(root / "tree").string()}), 1));
+
+    archive_cache cache((root / "cache").string());
+    std::string archive, md5;
+    EXPECT_FALSE(cache.find(before, archive, md5));
+    std::string scratch = cache.scratch();
+    ASSERT_NE(scratch, "");
+    std::ofstream(scratch + "/shared.tar.gz") << "archive bytes";
+    std::string kept = cache.keep(before, scratch + "/shared.tar.gz", "0123abcd");
+    ASSERT_NE(kept, "");
+    EXPECT_FALSE(fs::exists(scratch));
+    ASSERT_TRUE(cache.find(before, archive, md5));
+    EXPECT_EQ(archive, kept);
+    EXPECT_EQ(md5, "0123abcd");
+
+    // Any change to the selection, or to the kept archive, misses
+    std::ofstream(root / "tree/b") << "second";
+    std::string grown = tree_fingerprint(walker.scan({(root / "tree").string()}), 6);
+    EXPECT_NE(before, grown);
+    // ...even an edit that keeps the size and puts the old mtime back
+    struct stat a;
+    ASSERT_EQ(stat((root / "tree/a").c_str(), &a), 0);
+    std::ofstream(root / "tree/a") << "FIRST";
+    struct timespec same[2] = {a.st_atim, a.st_mtim};
+    utimensat(AT_FDCWD, (root / "tree/a").c_str(), same, 0);
+    EXPECT_NE(grown, tree_fingerprint(walker.scan({(root / "tree").string()}), 6));
+    std::ofstream(kept, std::ios::app) << "more";
+    EXPECT_FALSE(cache.find(before, archive, md5));
+
+    // Opening the cache clears out builds that were killed: one whose
+    // process is gone, and one nothing has written to for too long
+    std::string live = cache.scratch(), idle = cache.scratch();
+    std::ofstream(live + "/partial.tar.gz") << "still building";
+    std::ofstream(idle + "/partial.tar.gz") << "abandoned";
+    fs::path dead = root / "cache/.build-999999999-abcdef";
+    fs::create_directories(dead);
+    std::ofstream(dead / "partial.tar.gz") << "abandoned";
+    struct timespec old[2] = {{time(nullptr) - 2 * ARCHIVE_CACHE_SCRATCH_AGE, 0},
+                              {time(nullptr) - 2 * ARCHIVE_CACHE_SCRATCH_AGE, 0}};
+    utimensat(AT_FDCWD, (idle + "/partial.tar.gz").c_str(), old, 0);
+    utimensat(AT_FDCWD, idle.c_str(), old, 0);
+    archive_cache reopened((root / "cache").string());
+    EXPECT_TRUE(fs::exists(live + "/partial.tar.gz"));
+    EXPECT_FALSE(fs::exists(idle));
+    EXPECT_FALSE(fs::exists(dead));
+    EXPECT_TRUE(fs::exists(kept));
+
+    fs::remove_all(root);
+}
+
+TEST(AeadFrameTest, SealThenOpenRoundTrips) {
+    key_exchange sender_kx, receiver_kx;
+    auto tx = sender_kx.derive(receiver_kx.public_hex(), sender_kx.public_hex(), receiver_kx.public_hex(),
+                               "aead", aead_session::material_size());
+    auto rx = receiver_kx.derive(sender_kx.public_hex(), sender_kx.public_hex(), receiver_kx.public_hex(),
+                                 "aead", aead_session::material_size());
+    ASSERT_EQ(tx, rx);
+
+    for (const char* name : {CIPHER_AES_GCM, CIPHER_CHACHA}) {
+        aead_session session_tx(name, tx), session_rx(name, rx);
+        frame_cipher sealer(session_tx, true), opener(session_rx, false);
+
+        std::string text = "payload bytes";
+        std::vector<unsigned char> frame(AEAD_HEADER_SIZE + text.size() + AEAD_TAG_SIZE);
+        put_be32(frame.data(), text.size() | AEAD_FINAL_FLAG);
+        memcpy(frame.data() + AEAD_HEADER_SIZE, text.data(), text.size());
+
+        ASSERT_TRUE(sealer.seal(7, frame.data(), text.size()));
+        EXPECT_NE(memcmp(frame.data() + AEAD_HEADER_SIZE, text.data(), text.size()), 0);
+        ASSERT_TRUE(opener.open(7, frame.data(), text.size()));
+        EXPECT_EQ(std::string((char*)frame.data() + AEAD_HEADER_SIZE, text.size()), text);
+    }
+}
+
+TEST(AeadFrameTest, RejectsTamperedOrReorderedFrames) {
+    std::vector<unsigned char> material(aead_session::material_size(), 0x42);
+    aead_session session(CIPHER_AES_GCM, material);
+    frame_cipher sealer(session, true), opener(session, false);
+
+    std::vector<unsigned char> frame(AEAD_HEADER_SIZE + 64 + AEAD_TAG_SIZE, 0x11);
+    put_be32(frame.data(), 64);
+    ASSERT_TRUE(sealer.seal(1, frame.data(), 64));
+
+    auto flipped = frame;
+    flipped[AEAD_HEADER_SIZE + 3] ^= 1;
+    EXPECT_FALSE(opener.open(1, flipped.data(), 64));
+
+    auto final_flag = frame;
+    final_flag[0] |= 0x80;
+    EXPECT_FALSE(opener.open(1, final_flag.data(), 64));
+
+    auto reordered = frame;
+    EXPECT_FALSE(opener.open(2, reordered.data(), 64));
+}
+
+TEST(AeadFrameTest, NegotiatesCommonCipher) {
+    EXPECT_EQ(choose_cipher(CIPHER_CHACHA), CIPHER_CHACHA);
+    EXPECT_EQ(choose_cipher(CIPHER_AES_GCM), CIPHER_AES_GCM);
+    EXPECT_EQ(choose_cipher(std::string(CIPHER_CHACHA) + ":" + CIPHER_AES_GCM), CIPHER_CHACHA);
+    EXPECT_EQ(choose_cipher("rot13"), "");
+}
+
+TEST(ShapingTest, CapsRateAndSchedulesByPriorityThenWeight) {
+    // 8 MB/s with the minimum burst: 4 MB more take about half a second
+    token_bucket bucket(8 << 20);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 64; i++) {
+        bucket.take(SHAPER_QUANTUM);
+    }
+    double took = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    EXPECT_GT(took, 0.4);
+    EXPECT_LT(took, 0.8);
+
+    flow_scheduler scheduler(bucket);
+    auto share = [&](int a, int b) {
+        std::atomic<bool> stop{false};
+        std::atomic<size_t> granted[2] = {{0}, {0}};
+        std::vector<std::thread> flows;
+        for (int i = 0; i < 2; i++) {
+            int id = i == 0 ? a : b;
+            flows.emplace_back([&, i, id] {
+                while (!stop) {
+                    scheduler.acquire(id, SHAPER_QUANTUM);
+                    granted[i]++;
+                }
+            });
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(600));
+        stop = true;
+        for (auto& flow : flows) {
+            flow.join();
+        }
+        return double(granted[0]) / std::max<size_t>(granted[1], 1);
+    };
+
+    // Same class: 3:1 by weight; a higher class takes nearly everything
+    int heavy = scheduler.add_flow(0, 3), light = scheduler.add_flow(0, 1);
+    double weighted = share(heavy, light);
+    EXPECT_GT(weighted, 2.0);
+    EXPECT_LT(weighted, 4.5);
+    scheduler.remove_flow(heavy);
+    scheduler.remove_flow(light);
+
+    int urgent = scheduler.add_flow(1), bulk = scheduler.add_flow(0);
+    EXPECT_GT(share(urgent, bulk), 8.0);
+}
+
+// Handlers over real shaping objects, as the daemon wires them
+struct fake_daemon {
+    token_bucket bucket;
+    flow_scheduler scheduler{bucket};
+    std::map<int, int> flows;  // transfer id -> flow
+    size_t max_transfers = 4;
+    bool stopping = false;
+
+    control_handlers handlers() {
+        control_handlers h;
+        h.stats = [this] { return "max_transfers " + std::to_string(max_transfers) + "\n"; };
+        h.list = [this] { return "id\n" + std::to_string(flows.begin()->first) + "\n"; };
+        h.set_rate = [this](double mbit) { bucket.set_rate(mbit * 1e6 / 8); };
+        h.set_transfers = [this](size_t count) { max_transfers = count; };
+        h.set_priority = [this](int id, int priority) {
+            auto it = flows.find(id);
+            if (it == flows.end()) return false;
+            scheduler.set_priority(it->second, priority);
+            return true;
+        };
+        h.quit = [this] {
+            stopping = true;
+            return flows.size();
+        };
+        return h;
+    }
+};
+
+TEST(ControlSocketTest, RunsCommandsAndRejectsWhatItDoesNotKnow) {
+    fake_daemon daemon;
+    daemon.flows[3] = daemon.scheduler.add_flow();
+    control_handlers handlers = daemon.handlers();
+
+    EXPECT_EQ(control_command(handlers, "stats"), "max_transfers 4\n");
+    EXPECT_EQ(control_command(handlers, "list"), "id\n3\n");
+
+    EXPECT_EQ(control_command(handlers, "set rate 100"), "ok\n");
+    EXPECT_DOUBLE_EQ(daemon.bucket.bytes_per_second(), 12.5e6);
+    EXPECT_EQ(control_command(handlers, "set rate 0"), "ok\n");
+    EXPECT_DOUBLE_EQ(daemon.bucket.bytes_per_second(), 0);
+    EXPECT_EQ(control_command(handlers, "set rate -5").compare(0, 6, "error:"), 0);
+
+    EXPECT_EQ(control_command(handlers, "set transfers 8"), "ok\n");
+    EXPECT_EQ(daemon.max_transfers, 8u);
+    EXPECT_EQ(control_command(handlers, "set transfers 0").compare(0, 6, "error:"), 0);
+    EXPECT_EQ(daemon.max_transfers, 8u);
+
+    EXPECT_EQ(control_command(handlers, "set priority 3 5"), "ok\n");
+    EXPECT_EQ(control_command(handlers, "set priority 4 5"), "error: no transfer 4\n");
+    EXPECT_EQ(control_command(handlers, "reboot").compare(0, 6, "error:"), 0);
+    EXPECT_EQ(control_command(handlers, "").compare(0, 6, "error:"), 0);
+
+    EXPECT_FALSE(daemon.stopping);
+    EXPECT_EQ(control_command(handlers, "quit"), "ok, finishing 1 transfers\n");
+    EXPECT_TRUE(daemon.stopping);
+}
+
+TEST(ControlSocketTest, AnswersOverTheSocketEvenAfterASilentClient) {
+    namespace fs = std::filesystem;
+    fs::path root = fs::temp_directory_path() / "vimsicles_control_test";
+    fs::remove_all(root);
+    fs::create_directories(root);
+    std::string path = (root / "control.sock").string();
+
+    int listener = open_control_socket(path);
+    ASSERT_GE(listener, 0);
+    struct stat st;
+    ASSERT_EQ(stat(path.c_str(), &st), 0);
+    EXPECT_TRUE(S_ISSOCK(st.st_mode));
+    EXPECT_EQ(st.st_mode & 0777, 0600u);
+    EXPECT_EQ(std::distance(fs::directory_iterator(root), fs::directory_iterator()), 1);
+
+    fake_daemon daemon;
+    daemon.flows[1] = daemon.scheduler.add_flow();
+    control_handlers handlers = daemon.handlers();
+    std::thread server([&] {
+        for (int i = 0; i < 3; i++) {
+            int client = accept(listener, nullptr, nullptr);
+            if (client >= 0) serve_control_client(client, handlers);
+        }
+    });
+
+    // Connects and says nothing: it times out instead of blocking the others
+    sockaddr_un address;
+    ASSERT_TRUE(control_address(path, address));
+    int silent = socket(AF_UNIX, SOCK_STREAM, 0);
+    ASSERT_EQ(connect(silent, (sockaddr*)&address, sizeof(address)), 0);
+
+    std::string reply;
+    auto start = std::chrono::steady_clock::now();
+    ASSERT_TRUE(control_request(path, "set transfers 2", reply));
+    EXPECT_EQ(reply, "ok\n");
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(3 * CONTROL_TIMEOUT_MS));
+    char answer[64] = {};
+    EXPECT_GT(recv(silent, answer, sizeof(answer) - 1, 0), 0);
+    EXPECT_EQ(std::string(answer).compare(0, 6, "error:"), 0);
+    close(silent);
+
+    ASSERT_TRUE(control_request(path, "stats", reply));
+    EXPECT_EQ(reply, "max_transfers 2\n");
+    server.join();
+    close(listener);
+
+    EXPECT_FALSE(control_request((root / "nobody.sock").string(), "stats", reply));
+    fs::remove_all(root);
+}
+
+TEST(MultipathTest, ReassemblesByOffsetAndResendsWhatADeadPathDropped) {
+    namespace fs = std::filesystem;
+    fs::path root = fs::temp_directory_path() / "vimsicles_multipath_test";
+    fs::remove_all(root);
+    fs::create_directories(root);
+    std::string data(5 * MULTIPATH_MIN_CHUNK + 1234, '\0');
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = char(i * 2654435761u >> 24);
+    }
+    std::ofstream((root / "in").string(), std::ios::binary) << data;
+
+    // Three paths; the receiver never reads the third
+    int pairs[3][2];
+    std::vector<int> sending, receiving;
+    for (auto& pair : pairs) {
+        ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, pair), 0);
+        sending.push_back(pair[0]);
+    }
+    receiving = {pairs[0][1], pairs[1][1]};
+    close(pairs[2][1]);
+
+    int in = open((root / "in").c_str(), O_RDONLY);
+    int out = open((root / "out").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    std::atomic<size_t> written{0};
+    std::thread receiver([&] {
+        multipath_receiver transport(out, data.size(), [&](size_t bytes) { written += bytes; });
+        EXPECT_NO_THROW(transport.run(receiving));
+    });
+    std::vector<path_report> reports;
+    multipath_sender transport(in, data.size());
+    EXPECT_TRUE(transport.run(sending, reports));
+    for (int sock : sending) {
+        close(sock);
+    }
+    receiver.join();
+    close(in);
+    close(out);
+
+    ASSERT_EQ(reports.size(), 3u);
+    EXPECT_TRUE(reports[2].failed);
+    EXPECT_EQ(reports[0].bytes + reports[1].bytes, data.size());
+    EXPECT_EQ(written, data.size());
+    std::ifstream result((root / "out").string(), std::ios::binary);
+    std::string got((std::istreambuf_iterator<char>(result)), std::istreambuf_iterator<char>());
+    EXPECT_TRUE(got == data);
+    fs::remove_all(root);
+}
+
+TEST(MultipathTest, ResendsAChunkWhosePathDiedHalfwayThroughIt) {
+    namespace fs = std::filesystem;
+    fs::path root = fs::temp_directory_path() / "vimsicles_multipath_cut_test";
+    fs::remove_all(root);
+    fs::create_directories(root);
+    std::string data(4 * MULTIPATH_MIN_CHUNK + 77, '\0');
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = char(i * 40503u >> 8);
+    }
+    std::ofstream((root / "in").string(), std::ios::binary) << data;
+
+    // The second path takes in the header and half of its first chunk, then
+    // dies; what the socket had already accepted must not count as delivered
+    int good[2], cut[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, good), 0);
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, cut), 0);
+    std::thread dying([&] {
+        std::vector<char> swallowed(MULTIPATH_HEADER + MULTIPATH_MIN_CHUNK / 2);
+        recv_all(cut[1], swallowed.data(), swallowed.size());
+        close(cut[1]);
+    });
+
+    int in = open((root / "in").c_str(), O_RDONLY);
+    int out = open((root / "out").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    std::thread receiver([&] {
+        multipath_receiver transport(out, data.size());
+        EXPECT_NO_THROW(transport.run({good[1]}));
+    });
+    std::vector<path_report> reports;
+    multipath_sender transport(in, data.size());
+    EXPECT_TRUE(transport.run({good[0], cut[0]}, reports));
+    close(good[0]);
+    close(cut[0]);
+    dying.join();
+    receiver.join();
+    close(good[1]);
+    close(in);
+    close(out);
+
+    ASSERT_EQ(reports.size(), 2u);
+    EXPECT_TRUE(reports[1].failed);
+    EXPECT_EQ(reports[1].bytes, 0u);
+    EXPECT_EQ(reports[0].bytes, data.size());
+    std::ifstream result((root / "out").string(), std::ios::binary);
+    std::string got((std::istreambuf_iterator<char>(result)), std::istreambuf_iterator<char>());
+    EXPECT_TRUE(got == data);
+    fs::remove_all(root);
+}
+
+TEST(StreamFramesTest, RoundTripsAndCatchesCorruptOrCutStreams) {
+    // Writes `sizes` as chunks into one end of a socket pair, optionally
+    // flipping a payload byte or dropping the trailer, and reads the other end
+    auto transfer = [](const std::vector<size_t>& sizes, bool corrupt, bool cut, std::string& out) {
+        int fds[2];
+        EXPECT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+        std::thread writer([&] {
+            bool first = true;
+            stream_writer stream([&](const void* data, size_t len) {
+                std::string chunk(static_cast<const char*>(data), len);
+                if (corrupt && first && len > STREAM_HEADER_SIZE) {
+                    chunk[STREAM_HEADER_SIZE] ^= 1;
+                    first = false;
+                }
+                return send_all(fds[0], chunk.data(), chunk.size());
+            });
+            unsigned char next = 0;
+            for (size_t size : sizes) {
+                for (size_t i = 0; i < size; i++) {
+                    stream.data()[i] = next++;
+                }
+                stream.commit(size);
+            }
+            if (!cut) {
+                stream.finish();
+            }
+            close(fds[0]);
+        });
+        stream_reader stream(fds[1]);
+        const unsigned char* data;
+        size_t len;
+        bool ok = true;
+        try {
+            while (stream.next(data, len)) {
+                out.append(reinterpret_cast<const char*>(data), len);
+            }
+        } catch (const std::exception&) {
+            ok = false;
+        }
+        writer.join();
+        close(fds[1]);
+        return ok;
+    };
+
+    std::string out;
+    ASSERT_TRUE(transfer({1, STREAM_CHUNK_SIZE, 0, 1000}, false, false, out));
+    ASSERT_EQ(out.size(), 1 + STREAM_CHUNK_SIZE + 1000u);
+    for (size_t i = 0; i < out.size(); i++) {
+        ASSERT_EQ((unsigned char)out[i], (unsigned char)i);
+    }
+
+    out.clear();
+    EXPECT_TRUE(transfer({}, false, false, out));
+    EXPECT_TRUE(out.empty());
+
+    out.clear();
+    EXPECT_FALSE(transfer({5000, 5000}, true, false, out));
+    out.clear();
+    EXPECT_FALSE(transfer({5000, 5000}, false, true, out));
+    EXPECT_EQ(out.size(), 10000u);
+}
+
+TEST(ZerocopyTest, ReusesBuffersOnlyAfterTheKernelIsDone) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    ASSERT_EQ(bind(listener, (sockaddr*)&addr, sizeof(addr)), 0);
+    ASSERT_EQ(listen(listener, 1), 0);
+    ASSERT_EQ(getsockname(listener, (sockaddr*)&addr, &len), 0);
+
+    // Each buffer is refilled for the next frame as soon as it comes back,
+    // so one released early shows up as a corrupt frame on the other end
+    const int frames = 200;
+    const size_t size = 64 * 1024;
+    std::atomic<int> corrupt{0};
+    std::thread receiver([&] {
+        int sock = accept(listener, nullptr, nullptr);
+        std::vector<unsigned char> frame(size);
+        for (int i = 0; i < frames && recv_all(sock, frame.data(), size); i++) {
+            for (size_t j = 0; j < size; j++) {
+                if (frame[j] != (unsigned char)(i + j * 7)) {
+                    corrupt++;
+                    break;
+                }
+            }
+        }
+        close(sock);
+    });
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_EQ(connect(sock, (sockaddr*)&addr, sizeof(addr)), 0);
+    std::vector<std::vector<unsigned char>> spare;
+    size_t released = 0;
+    {
+        zerocopy_sender zc(sock, [&](std::vector<unsigned char>&& buffer) {
+            released++;
+            spare.push_back(std::move(buffer));
+        });
+        for (int i = 0; i < frames; i++) {
+            std::vector<unsigned char> buffer(size);
+            if (!spare.empty()) {
+                buffer = std::move(spare.back());
+                spare.pop_back();
+            }
+            for (size_t j = 0; j < size; j++) {
+                buffer[j] = i + j * 7;
+            }
+            ASSERT_TRUE(zc.send(buffer.data(), size / 2));
+            ASSERT_TRUE(zc.send(buffer.data() + size / 2, size - size / 2));
+            zc.hold(std::move(buffer));
+        }
+        zc.finish();
+        // Loopback always copies, which should have turned zero-copy off
+        EXPECT_FALSE(zc.zerocopy());
+    }
+    EXPECT_EQ(released, size_t(frames));
+    receiver.join();
+    close(sock);
+    close(listener);
+    EXPECT_EQ(corrupt, 0);
+}
+
+// A connected loopback TCP pair; kTLS needs TCP, so no socketpair()
+static void loopback_pair(int& client, int& server) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    ASSERT_EQ(bind(listener, (sockaddr*)&addr, sizeof(addr)), 0);
+    ASSERT_EQ(listen(listener, 1), 0);
+    ASSERT_EQ(getsockname(listener, (sockaddr*)&addr, &len), 0);
+    client = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_EQ(connect(client, (sockaddr*)&addr, sizeof(addr)), 0);
+    server = accept(listener, nullptr, nullptr);
+    ASSERT_GE(server, 0);
+    close(listener);
+}
+
+// sendfile_all() of `path` on one end, splice_all() (or copy_all()) into
+// `out` on the other; true if both ends say it all went through. The
+// receiving end closes as soon as it stops, so a sender it gave up on is
+// reset rather than left blocked.
+static bool send_through(int client, int server, const std::string& path, const std::string& out,
+                         bool splice = true) {
+    bool received = false;
+    std::thread receiver([&] {
+        int fd = open(out.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        received = splice ? splice_all(server, fd) : copy_all(server, fd);
+        close(fd);
+        close(server);
+    });
+    int fd = open(path.c_str(), O_RDONLY);
+    bool sent = sendfile_all(client, fd);
+    close(fd);
+    shutdown(client, SHUT_WR);
+    receiver.join();
+    close(client);
+    return sent && received;
+}
+
+TEST(KtlsTest, PlainTcpStillSendfilesAndSplices) {
+    std::string path = "ktls_test.bin", out = "ktls_test.out";
+    {
+        std::ofstream file(path);
+        for (int i = 0; i < (3 << 20) + 1234; i++) file.put(char(i * 31 + (i >> 12)));
+    }
+    std::vector<unsigned char> material(KTLS_MATERIAL_SIZE, 0x5a);
+
+    // Without the tls ULP no keys go in, which is what sends a transfer
+    // back to plain TCP; too little key material never gets that far
+    int client, server;
+    loopback_pair(client, server);
+    EXPECT_FALSE(ktls_install(client, TLS_TX, material));
+    EXPECT_FALSE(ktls_install(client, TLS_TX, std::vector<unsigned char>(KTLS_KEY_SIZE)));
+    EXPECT_TRUE(send_through(client, server, path, out));
+    EXPECT_EQ(file_digest(out), file_digest(path));
+
+    loopback_pair(client, server);
+    EXPECT_TRUE(send_through(client, server, path, out, false));
+    EXPECT_EQ(file_digest(out), file_digest(path));
+
+    std::filesystem::remove(path);
+    std::filesystem::remove(out);
+}
+
+TEST(KtlsTest, KernelEncryptsOnSendfileAndDecryptsOnSplice) {
+    int client, server;
+    loopback_pair(client, server);
+    if (!ktls_attach(client) || !ktls_attach(server)) {
+        close(client);
+        close(server);
+        GTEST_SKIP() << "no kernel TLS here: " << strerror(errno);
+    }
+
+    std::string path = "ktls_test.bin", out = "ktls_test.out";
+    {
+        std::ofstream file(path);
+        for (int i = 0; i < (3 << 20) + 1234; i++) file.put(char(i * 31 + (i >> 12)));
+    }
+    std::vector<unsigned char> material(KTLS_MATERIAL_SIZE);
+    for (size_t i = 0; i < material.size(); i++) material[i] = i * 13 + 1;
+    ASSERT_TRUE(ktls_install(client, TLS_TX, material));
+    ASSERT_TRUE(ktls_install(server, TLS_RX, material));
+    EXPECT_TRUE(send_through(client, server, path, out));
+    EXPECT_EQ(file_digest(out), file_digest(path));
+
+    // Records under a different key fail authentication
+    loopback_pair(client, server);
+    ASSERT_TRUE(ktls_attach(client) && ktls_attach(server));
+    ASSERT_TRUE(ktls_install(client, TLS_TX, material));
+    material[0] ^= 1;
+    ASSERT_TRUE(ktls_install(server, TLS_RX, material));
+    EXPECT_FALSE(send_through(client, server, path, out));
+
+    std::filesystem::remove(path);
+    std::filesystem::remove(out);
+}
+
+TEST(LandingTest, FilesAppearWholeOrNotAtAll) {
+    namespace fs = std::filesystem;
+    fs::path root = fs::temp_directory_path() / "vimsicles_landing_test";
+    fs::remove_all(root);
+    fs::create_directories(root);
+    auto read_file = [](const fs::path& path) {
+        std::ifstream in(path, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(in), {});
+    };
+    auto names = [&] {
+        std::vector<std::string> out;
+        for (const auto& entry : fs::directory_iterator(root)) out.push_back(entry.path().filename());
+        std::sort(out.begin(), out.end());
+        return out;
+    };
+    std::ofstream(root / "a") << "old";
+
+    // The old contents stay in place until publish() swaps in the new ones
+    {
+        landing_file file(AT_FDCWD, (root / "a").string());
+        ASSERT_TRUE(file.ok());
+        ASSERT_TRUE(write_all(file.fd(), "new contents", 12));
+        EXPECT_EQ(read_file(root / "a"), "old");
+        EXPECT_EQ(file_digest(file.path()), "eb15a6874ce265e2c3eb1b4891567bab");
+        EXPECT_EQ(file.publish(), 0);
+        EXPECT_EQ(read_file(root / "a"), "new contents");
+    }
+
+    // One that is never published leaves nothing behind
+    {
+        landing_file file(AT_FDCWD, (root / "b").string());
+        ASSERT_TRUE(file.ok());
+        ASSERT_TRUE(write_all(file.fd(), "partial", 7));
+    }
+    EXPECT_EQ(names(), std::vector<std::string>{"a"});
+
+    // Concurrent callers share rounds and all get their answer
+    group_commit commit(20);
+    int dir = open(root.c_str(), O_RDONLY | O_DIRECTORY);
+    ASSERT_GE(dir, 0);
+    std::atomic<int> synced{0};
+    std::vector<std::thread> callers;
+    for (int i = 0; i < 4; i++) {
+        callers.emplace_back([&] { synced += commit.sync({dir}); });
+    }
+    for (auto& t : callers) t.join();
+    EXPECT_EQ(synced, 4);
+    EXPECT_TRUE(commit.sync({}));
+    close(dir);
+    fs::remove_all(root);
+}
+
+TEST(LandingTest, EveryCallerOfAFailedRoundHearsOfIt) {
+    int dir = open(std::filesystem::temp_directory_path().c_str(), O_RDONLY | O_DIRECTORY);
+    ASSERT_GE(dir, 0);
+
+    // Rounds alternate between failing and not
+    std::atomic<int> calls{0};
+    {
+        group_commit flaky(0, [&](int) { return calls++ % 2 ? 0 : -1; });
+        EXPECT_FALSE(flaky.sync({dir}));
+        EXPECT_TRUE(flaky.sync({dir}));
+        EXPECT_FALSE(flaky.sync({dir}));
+        EXPECT_TRUE(flaky.sync({dir}));
+    }
+
+    // When every round fails, so does every caller, however late it wakes
+    // up to look
+    group_commit failing(0, [](int) {
+        errno = EIO;
+        return -1;
+    });
+    std::atomic<int> synced{0};
+    std::vector<std::thread> callers;
+    for (int i = 0; i < 8; i++) {
+        callers.emplace_back([&] {
+            for (int j = 0; j < 50; j++) synced += failing.sync({dir});
+        });
+    }
+    for (auto& t : callers) t.join();
+    EXPECT_EQ(synced, 0);
+    close(dir);
+}
+
+TEST(ProbeTest, MeasuresTheLinkAndPlansAroundTheBottleneck) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    ASSERT_EQ(bind(listener, (sockaddr*)&addr, sizeof(addr)), 0);
+    ASSERT_EQ(listen(listener, 1), 0);
+    ASSERT_EQ(getsockname(listener, (sockaddr*)&addr, &len), 0);
+
+    std::atomic<uint64_t> counted{0};
+    bool answered = false;
+    std::thread receiver([&] {
+        int sock = accept(listener, nullptr, nullptr);
+        answered = answer_probe(sock, [&](size_t bytes) { counted += bytes; });
+        close(sock);
+    });
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_EQ(connect(sock, (sockaddr*)&addr, sizeof(addr)), 0);
+    link_report link;
+    EXPECT_TRUE(probe_link(sock, link));
+    receiver.join();
+    close(sock);
+    close(listener);
+    EXPECT_TRUE(answered);
+    EXPECT_GT(counted, 0u);
+    EXPECT_GT(link.rtt_ms, 0);
+    EXPECT_GT(link.mbit, 0);
+    EXPECT_GE(link.loss, 0);
+
+    // Fast disk and CPU: a slow link is worth compressing hard for, a fast
+    // one is not worth compressing at all
+    local_report local;
+    local.disk_mbit = 4000;
+    local.md5_mbit = 4000;
+    local.levels = {0, 1, 6};
+    local.deflate_mbit = {8000, 800, 200};
+    local.deflate_ratio = {1.0, 0.5, 0.4};
+    link_report slow{20, 10, 0}, fast{0.1, 10000, 0};
+    transfer_plan plan = plan_transfer(slow, local, false, true, true);
+    EXPECT_EQ(plan.level, 6);
+    EXPECT_EQ(plan.bottleneck, "network");
+    EXPECT_EQ(plan.streams, 1u);
+    plan = plan_transfer(fast, local, false, true, true);
+    EXPECT_EQ(plan.level, 0);
+    EXPECT_NE(plan.bottleneck, "network");
+
+    // Loss splits the transfer over several streams, heavy loss moves it to
+    // UDP, and neither happens where the caller cannot do it
+    link_report lossy{20, 50, 0.005}, very_lossy{20, 50, 0.05};
+    EXPECT_EQ(plan_transfer(lossy, local, false, true, true).streams, 4u);
+    EXPECT_EQ(plan_transfer(lossy, local, false, false, true).streams, 1u);
+    EXPECT_TRUE(plan_transfer(very_lossy, local, false, true, true).udp);
+    EXPECT_FALSE(plan_transfer(very_lossy, local, false, true, false).udp);
+
+    // The faster cipher goes first in the offer
+    local.aes_mbit = 1000;
+    local.chacha_mbit = 3000;
+    EXPECT_EQ(plan_transfer(slow, local, true, false, false).cipher_offer,
+              std::string(CIPHER_CHACHA) + ":" + CIPHER_AES_GCM);
+}
+
+TEST(UdpTransportTest, DeliversFileWithParity) {
+    std::vector<unsigned char> data(UDP_PAYLOAD * 50 + 123);
+    for (size_t i = 0; i < data.size(); i++) data[i] = (unsigned char)(i * 7 + 3);
+
+    int in = memfd_create("udp_in", 0), out = memfd_create("udp_out", 0);
+    ASSERT_EQ(write(in, data.data(), data.size()), (ssize_t)data.size());
+
+    int control[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, control), 0);
+    int rx_sock = socket(AF_INET, SOCK_DGRAM, 0), tx_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ASSERT_EQ(bind(rx_sock, (sockaddr*)&addr, sizeof(addr)), 0);
+    socklen_t len = sizeof(addr);
+    getsockname(rx_sock, (sockaddr*)&addr, &len);
+
+    udp_receiver receiver(rx_sock, control[0], out, data.size(), 8);
+    std::thread rx([&] { receiver.run(); });
+    udp_sender sender(tx_sock, addr, {control[1]}, in, data.size(), 8);
+    sender.run();
+    rx.join();
+
+    std::vector<unsigned char> got(data.size());
+    ASSERT_EQ(pread(out, got.data(), got.size(), 0), (ssize_t)got.size());
+    EXPECT_EQ(got, data);
+    EXPECT_EQ(sender.packets_retransmitted(), 0u);
+
+    for (int fd : {in, out, control[0], control[1], rx_sock, tx_sock}) close(fd);
+}
+
+TEST(UdpTransportTest, TakesDatagramsOnlyFromTheControlPeer) {
+    std::vector<unsigned char> data(UDP_PAYLOAD * 200 + 9);
+    for (size_t i = 0; i < data.size(); i++) data[i] = (unsigned char)(i * 5 + 1);
+    int in = memfd_create("udp_in", 0), out = memfd_create("udp_out", 0);
+    ASSERT_EQ(write(in, data.data(), data.size()), (ssize_t)data.size());
+
+    // The control connection runs over 127.0.0.1
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_EQ(bind(listener, (sockaddr*)&addr, sizeof(addr)), 0);
+    ASSERT_EQ(listen(listener, 1), 0);
+    getsockname(listener, (sockaddr*)&addr, &len);
+    int control_tx = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_EQ(connect(control_tx, (sockaddr*)&addr, sizeof(addr)), 0);
+    int control_rx = accept(listener, nullptr, nullptr);
+
+    addr.sin_port = 0;
+    int rx_sock = socket(AF_INET, SOCK_DGRAM, 0), tx_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    ASSERT_EQ(bind(rx_sock, (sockaddr*)&addr, sizeof(addr)), 0);
+    ASSERT_EQ(bind(tx_sock, (sockaddr*)&addr, sizeof(addr)), 0);
+    len = sizeof(addr);
+    getsockname(rx_sock, (sockaddr*)&addr, &len);
+
+    // Someone on 127.0.0.2 gets in first with a forged first chunk
+    int stranger = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in other{};
+    other.sin_family = AF_INET;
+    other.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1);
+    ASSERT_EQ(bind(stranger, (sockaddr*)&other, sizeof(other)), 0);
+    unsigned char forged[UDP_HEADER + UDP_PAYLOAD] = {};
+    put_udp_header(forged, UDP_DATA, UDP_PAYLOAD, 0, 0);
+    ASSERT_GT(sendto(stranger, forged, sizeof(forged), 0, (sockaddr*)&addr, sizeof(addr)), 0);
+
+    // and keeps claiming to be receiver 0, asking for the first chunks again
+    sockaddr_in sender_addr{};
+    len = sizeof(sender_addr);
+    getsockname(tx_sock, (sockaddr*)&sender_addr, &len);
+    unsigned char ack[UDP_ACK_HEADER + 8] = {UDP_ACK, 1};
+    put_be16(ack + 2, 1);
+    put_be32(ack + UDP_ACK_HEADER + 4, 4);
+    std::atomic<bool> done{false};
+    std::thread spoofer([&] {
+        while (!done) {
+            sendto(stranger, ack, sizeof(ack), 0, (sockaddr*)&sender_addr, sizeof(sender_addr));
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    });
+
+    udp_receiver receiver(rx_sock, control_rx, out, data.size(), 0);
+    std::thread rx([&] { receiver.run(); });
+    udp_sender sender(tx_sock, addr, {control_tx}, in, data.size(), 0);
+    sender.run();
+    rx.join();
+    done = true;
+    spoofer.join();
+    EXPECT_EQ(sender.packets_retransmitted(), 0u);
+
+    std::vector<unsigned char> got(data.size());
+    ASSERT_EQ(pread(out, got.data(), got.size(), 0), (ssize_t)got.size());
+    EXPECT_EQ(got, data);
+    for (int fd : {in, out, listener, control_tx, control_rx, rx_sock, tx_sock, stranger}) close(fd);
+}
+
+TEST(UdpTransportTest, MulticastsToEveryReceiver) {
+    std::vector<unsigned char> data(UDP_PAYLOAD * 40 + 7);
+    for (size_t i = 0; i < data.size(); i++) data[i] = (unsigned char)(i * 13 + 1);
+    int in = memfd_create("mcast_in", 0);
+    ASSERT_EQ(write(in, data.data(), data.size()), (ssize_t)data.size());
+
+    in_addr local{htonl(INADDR_LOOPBACK)};
+    sockaddr_in group{};
+    group.sin_family = AF_INET;
+    inet_pton(AF_INET, "239.255.66.77", &group.sin_addr);
+
+    // Two receivers sharing the group port, as on one host
+    const int receivers = 2;
+    int out[receivers], rx_sock[receivers], control[receivers][2];
+    for (int i = 0; i < receivers; i++) {
+        out[i] = memfd_create("mcast_out", 0);
+        ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, control[i]), 0);
+        rx_sock[i] = socket(AF_INET, SOCK_DGRAM, 0);
+        int opt = 1;
+        setsockopt(rx_sock[i], SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        ASSERT_EQ(bind(rx_sock[i], (sockaddr*)&group, sizeof(group)), 0);
+        if (i == 0) {
+            socklen_t len = sizeof(group);
+            getsockname(rx_sock[0], (sockaddr*)&group, &len);
+        }
+        ASSERT_TRUE(udp_join_group(rx_sock[i], group.sin_addr, local));
+    }
+    int tx_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    ASSERT_TRUE(udp_multicast_source(tx_sock, local));
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < receivers; i++) {
+        threads.emplace_back([&, i] {
+            udp_receiver receiver(rx_sock[i], control[i][0], out[i], data.size(), 0, i);
+            receiver.run();
+        });
+    }
+    udp_sender sender(tx_sock, group, {control[0][1], control[1][1]}, in, data.size(), 0);
+    sender.run();
+    for (auto& t : threads) t.join();
+
+    // Each chunk went out once no matter how many receivers
+    EXPECT_EQ(sender.receivers_dropped(), 0u);
+    EXPECT_EQ(sender.packets_retransmitted(), 0u);
+    for (int i = 0; i < receivers; i++) {
+        std::vector<unsigned char> got(data.size());
+        ASSERT_EQ(pread(out[i], got.data(), got.size(), 0), (ssize_t)got.size());
+        EXPECT_EQ(got, data);
+        for (int fd : {out[i], rx_sock[i], control[i][0], control[i][1]}) close(fd);
+    }
+    close(in);
+    close(tx_sock);
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
@@ -1,7 +1,30 @@
+#include "aead.h"
+#include "archive_cache.h"
+#include "dir_walker.h"
+#include "ktls.h"
+#include "mapped_file.h"
+#include "multipath.h"
+#include "pipeline.h"
+#include "probe.h"
+#include "protocol.h"
+#include "shaping.h"
+#include "stream_frames.h"
+#include "tar_archive.h"
+#include "udp_transport.h"
+#include "zerocopy.h"
+
 #include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <csignal>
 #include <cstring>
-#include <fstream>
+#include <ctime>
+#include <filesystem>
+#include <functional>
+#include <getopt.h>
 #include <iostream>
+#include <mutex>
 #include <netinet/in.h>
 #include <openssl/crypto.h>
 #include <openssl/evp.h>
@@ -10,10 +33,23 @@
 #include <unistd.h>
 #include <sstream>
 #include <cstdlib>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <thread>
 
 #define Chunks_size 65536
 
 using namespace std;
+namespace fs = std::filesystem;
+
+// "ip" or "ip:port" from the receiver list
+static void split_receiver(const string& receiver, int default_port, string& ip, int& port)
+{
+        size_t sep = receiver.find(':');
+        ip         = receiver.substr(0, sep);
+        port       = sep == string::npos ? default_port : stoi(receiver.substr(sep + 1));
+}
+
 // The person send the file acts as a client who sends data
 // while the reciever acts as a server to recieve those files
 // Generate md5 hashes for reliability
@@ -22,10 +58,13 @@ class sender
 {
 
       private:
-        int handshake(int sock, const string& filename, const string& md5hash)
+        int handshake(int sock, const string& filename, const string& md5hash,
+                      const transfer_options& offer, transfer_options& reply)
         {
-                // Send filename and MD5 hash
+                // Send filename and MD5 hash, plus any options we want to negotiate
                 string metadata = filename + "|" + md5hash;
+                if (!offer.empty())
+                        metadata += "|" + format_options(offer);
                 if (send(sock, metadata.c_str(), metadata.length(), 0) < 0)
                 {
                         cerr << "Failed to send metadata" << endl;
@@ -34,7 +73,7 @@ class sender
                 }
 
                 // Wait for server response
-                char response[10] = {0};
+                char response[1024] = {0};
                 int bytes_received = recv(sock, response, sizeof(response) - 1, 0);
                 if (bytes_received <= 0)
                 {
@@ -44,167 +83,1202 @@ class sender
                 }
 
                 response[bytes_received] = '\0';
-                if (string(response) != "hello")
+                string answer = response;
+                size_t sep    = answer.find('|');
+                if (sep != string::npos)
+                {
+                        reply  = parse_options(answer.substr(sep + 1));
+                        answer = answer.substr(0, sep);
+                }
+                if (answer != "hello")
                 {
                         cerr << "Server rejected the transfer" << endl;
                         close(sock);
                         return 1;
                 }
 
+                if (reply.count("have"))
+                {
+                        cout << "Receiver already has this archive, nothing to send" << endl;
+                        return 0;
+                }
                 cout << "Server accepted the transfer. Starting file transfer..." << endl;
                 return 0;
         }
 
+        // Returns the connected socket, or -1 after printing why not. With
+        // `via` the connection leaves through that interface or local address.
+        int connect_to(const string& ip, int to_port, sockaddr_in& server_addr,
+                       const string& via = "")
+        {
+                memset(&server_addr, 0, sizeof(server_addr));
+                server_addr.sin_family = AF_INET;
+                server_addr.sin_port   = htons(to_port);
+
+                if (inet_pton(AF_INET, ip.c_str(), &server_addr.sin_addr) <= 0)
+                {
+                        cerr << "Invalid address" << endl;
+                        return -1;
+                }
+
+                int sock = connect_via(via, server_addr);
+                if (sock < 0)
+                        cerr << "Connection failed" << (via.empty() ? "" : " via " + via) << endl;
+                return sock;
+        }
+
+        // send_all() in SHAPER_QUANTUM pieces, each waiting for its turn in the
+        // shaper when there is one. With `zc` the data goes out through it and
+        // must stay put until zc hands its buffer back.
+        bool paced_send(int sock, const void *data, size_t len, zerocopy_sender *zc = nullptr)
+        {
+                if (!shaper)
+                        return zc ? zc->send(data, len) : send_all(sock, data, len);
+                const char *pos = static_cast<const char *>(data);
+                while (len > 0)
+                {
+                        size_t piece = min<size_t>(len, SHAPER_QUANTUM);
+                        shaper->acquire(flow, piece);
+                        if (!(zc ? zc->send(pos, piece) : send_all(sock, pos, piece)))
+                                return false;
+                        pos += piece;
+                        len -= piece;
+                }
+                return true;
+        }
+
+        // MD5 of the archive as hex, empty on failure. Read through the same
+        // mapping as the send, which then finds the pages still cached.
+        string file_md5()
+        {
+                if (!archive_md5.empty())
+                        return archive_md5;
+                try
+                {
+                        return file_digest(archive_path, "md5");
+                }
+                catch (const exception& e)
+                {
+                        cerr << "Failed to calculate MD5 hash: " << e.what() << endl;
+                        return "";
+                }
+        }
+
       public:
         string client_ip;
         int port;
         string archive_path;
+        // MD5 of the archive when it is already known, e.g. from the archive cache
+        string archive_md5;
+        // Ciphers to offer, in preference order; empty sends plaintext
+        string cipher_offer;
+        // Ask for kernel TLS, falling back to cipher_offer if either end lacks it
+        bool kernel_tls = false;
+        // Send the payload as paced UDP datagrams instead of the TCP stream
+        bool udp = false;
+        // One XOR parity datagram per this many data datagrams, 0 for none
+        int fec_group = 0;
+        // "address[:port]" to multicast to; the port defaults to `port`
+        string multicast_group;
+        // Let a receiver that already has the archive skip the transfer
+        bool use_cache = true;
+        // Asks a receiver daemon to serve this transfer ahead of lower ones
+        int priority = 0;
+        // Local interfaces or addresses to spread a plain TCP transfer over;
+        // the first also carries the handshake
+        vector<string> vias;
+        // Bandwidth shared with the other transfers of this process, and the
+        // flow this one is scheduled as; null sends as fast as the link allows
+        flow_scheduler *shaper = nullptr;
+        int flow               = -1;
 
         sender(string ip, int p, string path) : client_ip(ip), port(p), archive_path(path) {}
+
+        // Measures the path to the receiver on a connection of its own, which
+        // a one-shot receiver answers before it waits for the transfer. False
+        // if it cannot be reached or does not know probes.
+        bool probe(link_report& report)
+        {
+                struct sockaddr_in server_addr;
+                int sock = connect_to(client_ip, port, server_addr, vias.empty() ? "" : vias[0]);
+                if (sock < 0)
+                        return false;
+                string metadata = "probe||" + format_options({{"probe", "1"}});
+                char response[1024];
+                int got = -1;
+                if (send_all(sock, metadata.data(), metadata.size()))
+                        got = recv(sock, response, sizeof(response) - 1, 0);
+                string answer = got > 0 ? string(response, got) : "";
+                size_t sep    = answer.find('|');
+                bool ok       = sep != string::npos && answer.compare(0, sep, "hello") == 0 &&
+                          parse_options(answer.substr(sep + 1)).count("probe") &&
+                          probe_link(sock, report);
+                close(sock);
+                if (!ok)
+                        cerr << "Receiver " << client_ip << " did not answer the probe" << endl;
+                return ok;
+        }
         int initialize()
         {
-                const char *sender_ip = client_ip.c_str();
-                int sock = socket(AF_INET, SOCK_STREAM, 0);
+                struct sockaddr_in server_addr;
+                int sock = connect_to(client_ip, port, server_addr, vias.empty() ? "" : vias[0]);
                 if (sock < 0)
+                        return 1;
+
+                // Calculate MD5 hash of the file
+                string md5hash = file_md5();
+                if (md5hash.empty())
                 {
-                        cerr << "Error creating socket" << endl;
+                        close(sock);
                         return 1;
                 }
 
-                struct sockaddr_in server_addr;
-                memset(&server_addr, 0, sizeof(server_addr));
-                server_addr.sin_family = AF_INET;
-                server_addr.sin_port   = htons(port);
+                // Get filename from path
+                string filename = archive_path.substr(archive_path.find_last_of("/\\") + 1);
 
-                if (inet_pton(AF_INET, sender_ip, &server_addr.sin_addr) <= 0)
+                transfer_options offer, reply;
+                if (udp)
                 {
-                        cerr << "Invalid address" << endl;
-                        close(sock);
+                        struct stat st;
+                        if (stat(archive_path.c_str(), &st) < 0)
+                        {
+                                cerr << "Error opening file" << endl;
+                                close(sock);
+                                return 1;
+                        }
+                        offer["transport"] = "udp";
+                        offer["size"]      = to_string(st.st_size);
+                        offer["fec"]       = to_string(fec_group);
+                }
+
+                unique_ptr<key_exchange> kx;
+                if (!cipher_offer.empty())
+                {
+                        kx           = make_unique<key_exchange>();
+                        offer["enc"] = cipher_offer;
+                        offer["kx"]  = kx->public_hex();
+                        if (kernel_tls && ktls_attach(sock))
+                                offer["ktls"] = "1";
+                        else if (kernel_tls)
+                                cout << "Kernel TLS unavailable here, using user-space encryption"
+                                     << endl;
+                }
+
+                bool multipath = vias.size() > 1 && !udp && cipher_offer.empty();
+                if (multipath)
+                {
+                        struct stat st;
+                        if (stat(archive_path.c_str(), &st) < 0)
+                        {
+                                cerr << "Error opening file" << endl;
+                                close(sock);
+                                return 1;
+                        }
+                        offer["paths"] = to_string(vias.size());
+                        offer["size"]  = to_string(st.st_size);
+                }
+
+                if (use_cache)
+                        offer["cache"] = "1";
+                if (priority != 0)
+                        offer["prio"] = to_string(priority);
+
+                int status = handshake(sock, filename, md5hash, offer, reply);
+                if (status == 1)
+                {
+                        cerr << "Handshake failed" << endl;
                         return 1;
                 }
+                if (reply.count("have"))
+                {
+                        close(sock);
+                        return 0;
+                }
 
-                if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+                if (udp && option_or(reply, "transport", "") == "udp")
                 {
-                        cerr << "Connection failed" << endl;
+                        status = send_udp({sock}, server_addr, nullptr);
                         close(sock);
-                        return 1;
+                        return status;
                 }
+                if (udp)
+                        cout << "Receiver has no UDP transport, using TCP" << endl;
 
-                // Calculate MD5 hash of the file
-                string cmd = "md5sum " + archive_path + " | awk '{print $1}'";
-                FILE *pipe = popen(cmd.c_str(), "r");
-                if (!pipe)
+                if (multipath && reply.count("mp") && reply.count("token"))
                 {
-                        cerr << "Failed to calculate MD5 hash" << endl;
+                        status = send_multipath(sock, server_addr, stoi(reply["mp"]), reply["token"]);
                         close(sock);
-                        return 1;
+                        return status;
+                }
+                if (multipath)
+                        cout << "Receiver cannot take several paths, using " << vias[0] << " only"
+                             << endl;
+
+                if (!kx)
+                {
+                        status = send_data(sock);
+                        close(sock);
+                        return status;
+                }
+
+                if (offer.count("ktls") && reply.count("ktls") && reply.count("kx"))
+                {
+                        try
+                        {
+                                status = send_ktls(sock, kx->derive(reply["kx"], kx->public_hex(),
+                                                                    reply["kx"], "ktls",
+                                                                    KTLS_MATERIAL_SIZE));
+                        }
+                        catch (const exception& e)
+                        {
+                                cerr << "Error: " << e.what() << endl;
+                                status = 1;
+                        }
+                        close(sock);
+                        return status;
                 }
+                if (offer.count("ktls"))
+                        cout << "Receiver has no kernel TLS, using user-space encryption" << endl;
 
-                char md5hash[33] = {0};
-                if (fgets(md5hash, sizeof(md5hash), pipe) == NULL)
+                string cipher = option_or(reply, "enc", "");
+                if (cipher.empty() || !reply.count("kx"))
                 {
-                        cerr << "Failed to read MD5 hash" << endl;
-                        pclose(pipe);
+                        cerr << "Receiver does not support encryption" << endl;
                         close(sock);
                         return 1;
                 }
-                pclose(pipe);
-                md5hash[32] = '\0'; // Remove newline
+                try
+                {
+                        aead_session session(cipher, kx->derive(reply["kx"], kx->public_hex(),
+                                                                reply["kx"], "aead",
+                                                                aead_session::material_size()));
+                        cout << "Encrypting with " << cipher << endl;
+                        status = send_encrypted(sock, session);
+                }
+                catch (const exception& e)
+                {
+                        cerr << "Error: " << e.what() << endl;
+                        status = 1;
+                }
+                close(sock);
+                return status;
+        }
 
-                // Get filename from path
-                string filename = archive_path.substr(archive_path.find_last_of("/\\") + 1);
+        // Sends standard input as a framed stream under `name`: no archive, no
+        // size up front, and the MD5 goes last. Plain TCP only.
+        int initialize_stream(const string& name)
+        {
+                struct sockaddr_in server_addr;
+                int sock = connect_to(client_ip, port, server_addr, vias.empty() ? "" : vias[0]);
+                if (sock < 0)
+                        return 1;
 
-                int status = handshake(sock, filename, md5hash);
-                if (status == 1)
+                transfer_options offer, reply;
+                offer["stream"] = "1";
+                if (priority != 0)
+                        offer["prio"] = to_string(priority);
+                if (handshake(sock, name, "-", offer, reply) != 0)
                 {
                         cerr << "Handshake failed" << endl;
                         return 1;
                 }
+                if (!reply.count("stream"))
+                {
+                        cerr << "Receiver does not take streams (run file_recieve --stdout)" << endl;
+                        close(sock);
+                        return 1;
+                }
 
-                send_data(sock);
+                stream_writer stream([&](const void *data, size_t len)
+                                     { return paced_send(sock, data, len); });
+                bool ok = true;
+                while (ok)
+                {
+                        ssize_t got = read(STDIN_FILENO, stream.data(), STREAM_CHUNK_SIZE);
+                        if (got < 0 && errno == EINTR)
+                                continue;
+                        if (got < 0)
+                        {
+                                cerr << "Error reading standard input" << endl;
+                                close(sock);
+                                return 1;
+                        }
+                        if (got == 0)
+                                break;
+                        ok = stream.commit(got);
+                }
+                ok = ok && stream.finish();
                 close(sock);
+                if (!ok)
+                {
+                        cerr << "Error sending data" << endl;
+                        return 1;
+                }
+                cout << "Stream sent successfully (" << stream.bytes() << " bytes)" << endl;
                 return 0;
         }
 
-        int send_data(int sock)
+        // Reads the archive once for any number of receivers: every receiver
+        // ("ip" or "ip:port") gets its own handshake and control connection,
+        // then the datagrams go to the group. Receivers that cannot be
+        // reached or do not speak multicast are skipped.
+        int initialize_multicast(const vector<string>& receivers)
         {
-                ifstream file(archive_path, ios::binary);
-                if (!file)
+                string group_ip = multicast_group;
+                int group_port  = port;
+                size_t colon    = group_ip.find(':');
+                if (colon != string::npos)
+                {
+                        group_port = stoi(group_ip.substr(colon + 1));
+                        group_ip   = group_ip.substr(0, colon);
+                }
+                struct sockaddr_in group;
+                memset(&group, 0, sizeof(group));
+                group.sin_family = AF_INET;
+                group.sin_port   = htons(group_port);
+                if (inet_pton(AF_INET, group_ip.c_str(), &group.sin_addr) <= 0 ||
+                    !IN_MULTICAST(ntohl(group.sin_addr.s_addr)))
+                {
+                        cerr << "Invalid multicast group " << multicast_group << endl;
+                        return 1;
+                }
+
+                struct stat st;
+                if (stat(archive_path.c_str(), &st) < 0)
                 {
                         cerr << "Error opening file" << endl;
-                        close(sock);
                         return 1;
                 }
+                string md5hash = file_md5();
+                if (md5hash.empty())
+                        return 1;
+                string filename = archive_path.substr(archive_path.find_last_of("/\\") + 1);
+
+                // Every receiver is told which address the group traffic comes
+                // from: the one our first connection left from
+                vector<int> control;
+                size_t had_it = 0;
+                string source;
+                struct in_addr source_addr;
+                for (const string& receiver : receivers)
+                {
+                        string ip;
+                        int to_port;
+                        split_receiver(receiver, port, ip, to_port);
+
+                        struct sockaddr_in server_addr;
+                        int sock = connect_to(ip, to_port, server_addr);
+                        if (sock < 0)
+                        {
+                                cerr << "Skipping " << receiver << endl;
+                                continue;
+                        }
+                        if (source.empty())
+                        {
+                                struct sockaddr_in local;
+                                socklen_t local_len = sizeof(local);
+                                char text[INET_ADDRSTRLEN];
+                                if (getsockname(sock, (struct sockaddr *)&local, &local_len) < 0 ||
+                                    !inet_ntop(AF_INET, &local.sin_addr, text, sizeof(text)))
+                                {
+                                        cerr << "Skipping " << receiver << endl;
+                                        close(sock);
+                                        continue;
+                                }
+                                source      = text;
+                                source_addr = local.sin_addr;
+                        }
+
+                        transfer_options offer, reply;
+                        offer["transport"] = "mcast";
+                        offer["group"]     = group_ip + ":" + to_string(group_port);
+                        offer["src"]       = source;
+                        offer["size"]      = to_string(st.st_size);
+                        offer["fec"]       = to_string(fec_group);
+                        offer["id"]        = to_string(control.size());
+                        if (use_cache)
+                                offer["cache"] = "1";
+                        if (handshake(sock, filename, md5hash, offer, reply) != 0)
+                        {
+                                cerr << "Skipping " << receiver << endl;
+                                continue;
+                        }
+                        if (reply.count("have"))
+                        {
+                                had_it++;
+                                close(sock);
+                                continue;
+                        }
+                        if (option_or(reply, "transport", "") != "mcast")
+                        {
+                                cerr << receiver << " cannot receive multicast, skipping" << endl;
+                                close(sock);
+                                continue;
+                        }
+                        control.push_back(sock);
+                }
+
+                if (control.empty() && had_it > 0)
+                        return 0;
+                if (control.empty())
+                {
+                        cerr << "No receiver accepted the transfer" << endl;
+                        return 1;
+                }
+                cout << "Multicasting to " << control.size() << " receivers on " << group_ip << ":"
+                     << group_port << endl;
+                int status = send_udp(control, group, &source_addr);
+                for (int sock : control)
+                        close(sock);
+                return status;
+        }
 
-                char buffer[Chunks_size];
-                while (file)
+        // Straight from the mapping into the socket, no intermediate buffer.
+        // The kernel may pin the mapped pages instead of copying them; they
+        // stay valid after the window moves on, so nothing has to be held.
+        int send_data(int sock)
+        {
+                try
                 {
-                        file.read(buffer, Chunks_size);
-                        streamsize bytes_read = file.gcount();
-                        if (bytes_read > 0)
+                        mapped_reader file(archive_path);
+                        zerocopy_sender zc(sock, [](vector<unsigned char>&&) {});
+                        const unsigned char *data;
+                        size_t len;
+                        while (file.next(data, len, Chunks_size * 16))
                         {
-                                ssize_t bytes_sent = send(sock, buffer, bytes_read, 0);
-                                if (bytes_sent < 0)
+                                if (!paced_send(sock, data, len, &zc))
                                 {
                                         cerr << "Error sending data" << endl;
-                                        break;
+                                        return 1;
                                 }
+                                zc.hold({});
                         }
                 }
+                catch (const exception& e)
+                {
+                        cerr << e.what() << endl;
+                        return 1;
+                }
 
-                file.close();
                 cout << "File sent successfully" << endl;
                 return 0;
         }
-};
 
-void creating_archive(char **files) {}
+        // The first path is the handshake connection; the others connect to
+        // the receiver's join port from their own interface and present the
+        // token. Paths that cannot connect are left out.
+        int send_multipath(int sock, sockaddr_in to, int join_port, const string& token)
+        {
+                vector<int> socks = {sock};
+                vector<path_report> reports;
+                vector<string> used = {vias[0]};
+                to.sin_port = htons(join_port);
+                for (size_t i = 1; i < vias.size(); i++)
+                {
+                        int path = connect_via(vias[i], to);
+                        if (path >= 0 && send_all(path, token.data(), token.size()))
+                        {
+                                socks.push_back(path);
+                                used.push_back(vias[i]);
+                        }
+                        else
+                        {
+                                cerr << "Cannot open a path via " << vias[i] << ", leaving it out"
+                                     << endl;
+                                if (path >= 0)
+                                        close(path);
+                        }
+                }
 
-int main(int argc, char **argv)
-{
-        if (argc != 3)
+                int fd = open(archive_path.c_str(), O_RDONLY);
+                if (fd < 0)
+                {
+                        cerr << "Error opening file" << endl;
+                        for (size_t i = 1; i < socks.size(); i++)
+                                close(socks[i]);
+                        return 1;
+                }
+                struct stat st;
+                fstat(fd, &st);
+
+                // The paths share one flow, so take turns asking for it
+                mutex pacing;
+                function<void(size_t)> pace;
+                if (shaper)
+                        pace = [&](size_t bytes)
+                        {
+                                lock_guard<mutex> guard(pacing);
+                                shaper->acquire(flow, bytes);
+                        };
+                multipath_sender transport(fd, st.st_size, pace);
+                bool ok = transport.run(socks, reports);
+                close(fd);
+                for (size_t i = 1; i < socks.size(); i++)
+                        close(socks[i]);
+
+                for (size_t i = 0; i < reports.size(); i++)
+                        cout << "  via " << (used[i].empty() ? "default route" : used[i]) << ": "
+                             << reports[i].bytes / 1e6 << " MB at "
+                             << reports[i].mbit_per_second() << " Mbit/s"
+                             << (reports[i].failed ? " (failed)" : "") << endl;
+                if (!ok)
+                {
+                        cerr << "Error sending data" << endl;
+                        return 1;
+                }
+                cout << "File sent successfully over " << socks.size() << " paths" << endl;
+                return 0;
+        }
+
+        // Paced datagrams to the receiver's address and port, or to a group
+        // from `multicast_source`; the TCP sockets stay open as control
+        // channels until every receiver reports done
+        int send_udp(const vector<int>& control, const sockaddr_in& destination,
+                     const struct in_addr *multicast_source)
         {
-                cout << "Usage: " << argv[0] << " <ip_address> <port>" << endl;
-                return 1;
+                int fd = open(archive_path.c_str(), O_RDONLY);
+                if (fd < 0)
+                {
+                        cerr << "Error opening file" << endl;
+                        return 1;
+                }
+                int usock = socket(AF_INET, SOCK_DGRAM, 0);
+                if (usock < 0)
+                {
+                        cerr << "Error creating socket" << endl;
+                        close(fd);
+                        return 1;
+                }
+
+                // Receivers drop datagrams from any address but the one they
+                // expect, so leave from exactly that one
+                struct sockaddr_in local;
+                socklen_t local_len = sizeof(local);
+                bool bound = getsockname(control[0], (struct sockaddr *)&local, &local_len) == 0;
+                if (bound)
+                {
+                        if (multicast_source)
+                                local.sin_addr = *multicast_source;
+                        local.sin_port = 0;
+                        bound = bind(usock, (struct sockaddr *)&local, sizeof(local)) == 0 &&
+                                (!multicast_source || udp_multicast_source(usock, local.sin_addr));
+                }
+                if (!bound)
+                {
+                        cerr << (multicast_source ? "Cannot send to multicast group"
+                                                  : "Cannot open the datagram socket")
+                             << endl;
+                        close(usock);
+                        close(fd);
+                        return 1;
+                }
+
+                struct stat st;
+                fstat(fd, &st);
+                int status = 0;
+                try
+                {
+                        udp_sender transport(usock, destination, control, fd, st.st_size,
+                                             fec_group);
+                        if (shaper)
+                                transport.limit_rate(&shaper->limiter());
+                        transport.run();
+                        cout << "File sent successfully (" << transport.packets_sent()
+                             << " datagrams, " << transport.packets_retransmitted()
+                             << " retransmitted)" << endl;
+                        if (transport.receivers_dropped() > 0)
+                        {
+                                cerr << transport.receivers_dropped() << " of " << control.size()
+                                     << " receivers dropped out" << endl;
+                                status = 1;
+                        }
+                }
+                catch (const exception& e)
+                {
+                        cerr << "Error: " << e.what() << endl;
+                        status = 1;
+                }
+                close(usock);
+                close(fd);
+                return status;
         }
 
-        string ip = argv[1];
-        int port = stoi(argv[2]);
+        // The kernel encrypts TLS records, so the file can go out with sendfile()
+        int send_ktls(int sock, const vector<unsigned char>& material)
+        {
+                // The receiver is already expecting records, there is no way back
+                if (!ktls_install(sock, TLS_TX, material))
+                {
+                        cerr << "Failed to install kernel TLS keys" << endl;
+                        return 1;
+                }
+                cout << "Encrypting with kernel TLS (" CIPHER_AES_GCM ")" << endl;
 
-        // Run the archive creation script
+                int fd = open(archive_path.c_str(), O_RDONLY);
+                if (fd < 0)
+                {
+                        cerr << "Error opening file" << endl;
+                        return 1;
+                }
+                bool ok = shaper ? sendfile_all(sock, fd, SHAPER_QUANTUM,
+                                                [&](size_t piece) { shaper->acquire(flow, piece); })
+                                 : sendfile_all(sock, fd);
+                close(fd);
+                if (!ok)
+                {
+                        cerr << "Error sending data" << endl;
+                        return 1;
+                }
+                cout << "File sent successfully" << endl;
+                return 0;
+        }
+
+        // Reads, encrypts and sends on separate threads so the cipher never
+        // waits for the disk or the socket, and runs on several cores if needed
+        int send_encrypted(int sock, const aead_session& session)
+        {
+                unique_ptr<mapped_reader> file;
+                try
+                {
+                        file = make_unique<mapped_reader>(archive_path);
+                }
+                catch (const exception& e)
+                {
+                        cerr << e.what() << endl;
+                        return 1;
+                }
+
+                size_t threads = stage_threads();
+                buffer_pool pool(aead_buffer_size());
+                vector<unique_ptr<frame_cipher>> ciphers;
+                for (size_t i = 0; i < threads; i++)
+                        ciphers.push_back(make_unique<frame_cipher>(session, true));
+
+                ordered_stage<aead_frame> stage(
+                    threads, threads * 4, [&](aead_frame& frame, size_t worker)
+                    { frame.ok = ciphers[worker]->seal(frame.seq, frame.buffer.data(), frame.len); });
+
+                bool read_failed = false;
+                thread reader(
+                    [&]
+                    {
+                            try
+                            {
+                                    for (uint64_t seq = 0;; seq++)
+                                    {
+                                            aead_frame frame;
+                                            frame.buffer = pool.get();
+                                            frame.seq    = seq;
+                                            const unsigned char *data;
+                                            if (file->next(data, frame.len, AEAD_FRAME_SIZE))
+                                                    memcpy(frame.buffer.data() + AEAD_HEADER_SIZE,
+                                                           data, frame.len);
+                                            frame.final = file->done();
+                                            bool final  = frame.final;
+                                            put_be32(frame.buffer.data(),
+                                                     frame.len | (final ? AEAD_FINAL_FLAG : 0));
+                                            if (!stage.submit(move(frame)) || final)
+                                                    break;
+                                    }
+                            }
+                            catch (const exception&)
+                            {
+                                    read_failed = true;
+                            }
+                            stage.close();
+                    });
+
+                // Sealed frames go out without another copy where the kernel
+                // can do that; their buffers return to the pool once sent
+                zerocopy_sender zc(sock, [&](vector<unsigned char>&& buffer)
+                                   { pool.put(move(buffer)); });
+                bool sent_final = false;
+                aead_frame frame;
+                while (stage.take(frame))
+                {
+                        if (!frame.ok ||
+                            !paced_send(sock, frame.buffer.data(), frame.wire_size(), &zc))
+                        {
+                                stage.close();
+                                break;
+                        }
+                        sent_final = frame.final;
+                        zc.hold(move(frame.buffer));
+                }
+                reader.join();
+                zc.finish();
+
+                if (read_failed || !sent_final)
+                {
+                        cerr << "Error sending encrypted data" << endl;
+                        return 1;
+                }
+                cout << "File sent successfully" << endl;
+                return 0;
+        }
+};
+
+// Runs the file picker script, which prints one selected path per line
+static vector<string> pick_files()
+{
+        vector<string> paths;
         FILE *pipe = popen("./creating_archive.sh", "r");
         if (!pipe)
         {
                 cerr << "Failed to run archive creation script" << endl;
-                return 1;
+                return paths;
         }
 
-        char buffer[256];
-        string result = "";
+        char buffer[4096];
         while (fgets(buffer, sizeof(buffer), pipe) != NULL)
         {
-                result += buffer;
+                string line = buffer;
+                if (!line.empty() && line.back() == '\n')
+                        line.pop_back();
+                if (!line.empty())
+                        paths.push_back(line);
         }
         pclose(pipe);
+        return paths;
+}
 
-        if (result.empty())
+// Scans the selection in parallel and writes it straight into a tar.gz,
+// named like the archives the script used to make. With use_cache an
+// unchanged selection reuses the archive built last time and its MD5, and a
+// new archive is kept for next time; otherwise it goes to a fresh temporary
+// directory. `level` is the gzip level. Returns the archive path, or "" on
+// failure; `cached` tells whether it belongs to the cache and must be left
+// alone.
+static string build_archive(const vector<string>& paths, bool use_cache, int level, string& md5,
+                            bool& cached)
+{
+        auto started = chrono::steady_clock::now();
+        dir_walker walker;
+        vector<manifest_entry> manifest = walker.scan(paths);
+        for (const string& error : walker.errors())
+                cerr << "Skipping " << error << endl;
+        if (manifest.empty())
+        {
+                cerr << "Nothing to send" << endl;
+                return "";
+        }
+        chrono::duration<double> scanned = chrono::steady_clock::now() - started;
+        cout << "Scanned " << manifest.size() << " entries in " << scanned.count() << " s" << endl;
+
+        archive_cache cache(archive_cache::default_dir());
+        string fingerprint, archive;
+        cached = false;
+        if (use_cache)
         {
-                cerr << "No archive was created" << endl;
+                fingerprint = tree_fingerprint(manifest, level);
+                if (cache.find(fingerprint, archive, md5))
+                {
+                        cout << "Selection unchanged, reusing " << archive << endl;
+                        cached = true;
+                        return archive;
+                }
+        }
+
+        string dir = use_cache ? cache.scratch() : "";
+        if (dir.empty())
+        {
+                const char *tmp = getenv("TMPDIR");
+                dir             = string(tmp ? tmp : "/tmp") + "/vimsicles-XXXXXX";
+                if (!mkdtemp(&dir[0]))
+                {
+                        cerr << "Failed to create a temporary directory" << endl;
+                        return "";
+                }
+        }
+        char stamp[32];
+        time_t now = time(nullptr);
+        strftime(stamp, sizeof(stamp), "%Y%m%d_%H%M%S", localtime(&now));
+        archive = dir + "/shared_files_" + stamp + ".tar.gz";
+
+        bool complete = walker.errors().empty();
+        try
+        {
+                vector<string> errors;
+                uint64_t bytes = write_archive(archive, manifest, level, errors);
+                for (const string& error : errors)
+                        cerr << "Skipping " << error << endl;
+                complete = complete && errors.empty();
+                chrono::duration<double> took = chrono::steady_clock::now() - started;
+                cout << "Archived " << bytes / (1024 * 1024) << " MB in " << took.count() << " s"
+                     << endl;
+
+                // Only an archive of the whole selection is worth keeping. It
+                // was just written, so hashing it now reads from the page cache.
+                if (use_cache && complete)
+                {
+                        md5         = file_digest(archive, "md5");
+                        string kept = cache.keep(fingerprint, archive, md5);
+                        cached      = !kept.empty();
+                        if (cached)
+                                archive = kept;
+                }
+        }
+        catch (const exception& e)
+        {
+                cerr << "Error: " << e.what() << endl;
+                error_code ignored;
+                fs::remove_all(dir, ignored);
+                return "";
+        }
+        return archive;
+}
+
+// --probe: measures the link to every receiver (keeping the worst of each
+// number) and this machine on `sample`, prints both and what they suggest
+static transfer_plan probe_and_plan(const vector<string>& receivers, int port,
+                                    const vector<string>& vias, const vector<string>& sample,
+                                    bool compress, bool encrypted, bool pick_cipher,
+                                    bool can_stripe, bool can_udp)
+{
+        link_report link;
+        bool measured = false;
+        for (const string& receiver : receivers)
+        {
+                string to_ip;
+                int to_port;
+                split_receiver(receiver, port, to_ip, to_port);
+                sender client(to_ip, to_port, "");
+                client.vias = vias;
+                link_report one;
+                if (!client.probe(one))
+                        continue;
+                cout << "Probe " << receiver << ": " << describe(one) << endl;
+                link.mbit   = measured ? min(link.mbit, one.mbit) : one.mbit;
+                link.rtt_ms = max(link.rtt_ms, one.rtt_ms);
+                link.loss   = max(link.loss, one.loss);
+                measured    = true;
+        }
+
+        local_report local = measure_local(sample, compress, encrypted && pick_cipher);
+        cout << "Local: " << describe(local) << endl;
+
+        transfer_plan plan = plan_transfer(link, local, encrypted, can_stripe, can_udp);
+        if (!measured)
+                cout << "No receiver answered the probe, leaving the network settings alone"
+                     << endl;
+        cout << "Plan: " << describe(plan, compress) << endl;
+        return plan;
+}
+
+static void usage(const char *prog)
+{
+        cout << "Usage: " << prog << " [options] <ip_address>[,<ip_address>[:port]...] <port>"
+             << endl
+             << "  --file <archive>    send an existing archive instead of picking files" << endl
+             << "  --path <path>       archive this file or directory (repeatable) instead of"
+                " picking files" << endl
+             << "  --encrypt[=CIPHER]  encrypt the payload (" CIPHER_AES_GCM " or " CIPHER_CHACHA
+                ", default picks by CPU)" << endl
+             << "  --ktls              encrypt in the kernel and keep sendfile(); falls back to"
+                " --encrypt" << endl
+             << "  --udp               send over paced UDP with NACK repair (lossy Wi-Fi)" << endl
+             << "  --fec <K>           with --udp, add one parity datagram per K" << endl
+             << "  --multicast <G[:P]> send once to group G (port P, default <port>) for all the"
+                " listed receivers" << endl
+             << "  --no-cache          rebuild the archive and send it even if the receiver"
+                " already has it" << endl
+             << "  --rate <Mbit/s>     cap the total sending rate; SIGUSR1 doubles it, SIGUSR2"
+                " halves it" << endl
+             << "  --burst <KB>        how far a capped transfer may run ahead (default 50 ms"
+                " worth)" << endl
+             << "  --stdin[=NAME]      stream standard input of any length instead of an archive"
+                " (to file_recieve --stdout)" << endl
+             << "  --via <IF|ADDR>     send through this local interface or address; repeat"
+                " to use several links at once" << endl
+             << "  --priority <N>      ask a receiver daemon to serve this before transfers of"
+                " lower priority" << endl
+             << "  --probe             measure the links, disk, hashing and compression first and"
+                " pick compression," << endl
+             << "                      streams, UDP and cipher for what was not given" << endl
+             << "Several receivers without --multicast are sent to in parallel over TCP, sharing"
+                " --rate fairly." << endl;
+}
+
+// Rate changes requested by signal, applied by shape_by_signals()
+static atomic<int> rate_steps{0};
+
+static void on_rate_signal(int sig)
+{
+        rate_steps += sig == SIGUSR1 ? 1 : -1;
+}
+
+// Applies SIGUSR1/SIGUSR2 to the bucket until `done`
+static void shape_by_signals(token_bucket& bucket, double base, double burst,
+                             const atomic<bool>& done)
+{
+        signal(SIGUSR1, on_rate_signal);
+        signal(SIGUSR2, on_rate_signal);
+        int applied = 0;
+        while (!done)
+        {
+                this_thread::sleep_for(chrono::milliseconds(100));
+                int steps = rate_steps;
+                if (steps == applied)
+                        continue;
+                applied     = steps;
+                double rate = base * pow(2.0, steps);
+                bucket.set_rate(rate, burst);
+                cout << "Rate limit now " << rate * 8 / 1e6 << " Mbit/s" << endl;
+        }
+}
+
+int main(int argc, char **argv)
+{
+        string archive_name;
+        vector<string> paths;
+        string cipher_offer;
+        bool kernel_tls = false;
+        bool udp        = false;
+        int fec_group   = 0;
+        string multicast_group;
+        bool use_cache   = true;
+        double rate_mbit = 0;
+        double burst_kb  = 0;
+        int priority     = 0;
+        bool from_stdin  = false;
+        bool probe       = false;
+        vector<string> vias;
+        string stream_name;
+
+        static const option options[] = {{"file", required_argument, nullptr, 'f'},
+                                          {"path", required_argument, nullptr, 'p'},
+                                          {"encrypt", optional_argument, nullptr, 'e'},
+                                          {"ktls", no_argument, nullptr, 'k'},
+                                          {"udp", no_argument, nullptr, 'u'},
+                                          {"fec", required_argument, nullptr, 'F'},
+                                          {"multicast", required_argument, nullptr, 'm'},
+                                          {"no-cache", no_argument, nullptr, 'n'},
+                                          {"rate", required_argument, nullptr, 'r'},
+                                          {"burst", required_argument, nullptr, 'b'},
+                                          {"priority", required_argument, nullptr, 'P'},
+                                          {"stdin", optional_argument, nullptr, 's'},
+                                          {"via", required_argument, nullptr, 'V'},
+                                          {"probe", no_argument, nullptr, 'O'},
+                                          {"help", no_argument, nullptr, 'h'},
+                                          {nullptr, 0, nullptr, 0}};
+        int opt;
+        while ((opt = getopt_long(argc, argv, "f:", options, nullptr)) != -1)
+        {
+                switch (opt)
+                {
+                case 'f': archive_name = optarg; break;
+                case 'p': paths.push_back(optarg); break;
+                case 'e': cipher_offer = optarg ? optarg : cipher_preference(); break;
+                case 'k': kernel_tls = true; break;
+                case 'u': udp = true; break;
+                case 'F': fec_group = atoi(optarg); break;
+                case 'm': multicast_group = optarg; break;
+                case 'n': use_cache = false; break;
+                case 'r': rate_mbit = atof(optarg); break;
+                case 'b': burst_kb = atof(optarg); break;
+                case 'P': priority = atoi(optarg); break;
+                case 'V': vias.push_back(optarg); break;
+                case 'O': probe = true; break;
+                case 's':
+                        from_stdin  = true;
+                        stream_name = optarg ? optarg : "stdin";
+                        break;
+                default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+                }
+        }
+
+        if (argc - optind != 2)
+        {
+                usage(argv[0]);
                 return 1;
         }
 
-        // Parse the archive name and MD5 hash
-        size_t pos = result.find('|');
-        if (pos == string::npos)
+        if ((udp || !multicast_group.empty()) && (kernel_tls || !cipher_offer.empty()))
+        {
+                cerr << "--udp and --multicast cannot be combined with encryption yet" << endl;
+                return 1;
+        }
+        if (fec_group < 0 || fec_group > 255)
+        {
+                cerr << "--fec must be between 0 and 255" << endl;
+                return 1;
+        }
+
+        // Only a cipher named on the command line is kept over what --probe finds
+        bool pick_cipher = cipher_offer.empty() || cipher_offer == cipher_preference();
+        if (kernel_tls && cipher_offer.empty())
+                cipher_offer = cipher_preference();
+        if (!cipher_offer.empty() && cipher_offer != cipher_preference())
+        {
+                try
+                {
+                        cipher_by_name(cipher_offer);
+                }
+                catch (const exception& e)
+                {
+                        cerr << e.what() << endl;
+                        return 1;
+                }
+        }
+
+        string ip = argv[optind];
+        int port  = stoi(argv[optind + 1]);
+
+        vector<string> receivers;
+        stringstream list(ip);
+        for (string receiver; getline(list, receiver, ',');)
+                if (!receiver.empty())
+                        receivers.push_back(receiver);
+        if (receivers.empty() || (receivers.size() > 1 && multicast_group.empty() && udp))
+        {
+                cerr << "Sending to several receivers over UDP needs --multicast" << endl;
+                return 1;
+        }
+        if (rate_mbit < 0 || burst_kb < 0)
         {
-                cerr << "Invalid output from archive script" << endl;
+                cerr << "--rate and --burst must not be negative" << endl;
                 return 1;
         }
+        if (from_stdin && (udp || kernel_tls || !cipher_offer.empty() || !multicast_group.empty() ||
+                           !archive_name.empty() || !paths.empty() || receivers.size() > 1))
+        {
+                cerr << "--stdin streams to one receiver over plain TCP and takes no --file or --path"
+                     << endl;
+                return 1;
+        }
+        if (from_stdin && probe)
+        {
+                cerr << "--probe needs a file or selection to measure, not --stdin" << endl;
+                return 1;
+        }
+
+        // Without --file, archive the --path selection (or what the file picker
+        // returns) ourselves, and clean up after sending
+        bool built  = archive_name.empty() && !from_stdin;
+        bool cached = false;
+        string archive_md5;
+        if (built && paths.empty())
+        {
+                paths = pick_files();
+                if (paths.empty())
+                {
+                        cerr << "No files selected" << endl;
+                        return 1;
+                }
+        }
+
+        // Measured choices fill in only what the command line left open
+        int level = Z_DEFAULT_COMPRESSION;
+        if (probe)
+        {
+                bool single    = receivers.size() == 1 && multicast_group.empty();
+                bool plain_tcp = !udp && cipher_offer.empty() && single;
+                vector<string> sample = built ? paths : vector<string>{archive_name};
+                transfer_plan plan    = probe_and_plan(receivers, port, vias, sample, built,
+                                                       !cipher_offer.empty(), pick_cipher,
+                                                       plain_tcp && vias.size() <= 1, plain_tcp);
+                level = plan.level;
+                if (plan.udp)
+                {
+                        udp = true;
+                        if (fec_group == 0)
+                                fec_group = plan.fec_group;
+                }
+                if (plan.streams > 1)
+                        vias.resize(plan.streams, vias.empty() ? "" : vias[0]);
+                if (pick_cipher && !plan.cipher_offer.empty())
+                        cipher_offer = plan.cipher_offer;
+        }
+
+        if (built)
+        {
+                archive_name = build_archive(paths, use_cache, level, archive_md5, cached);
+                if (archive_name.empty())
+                        return 1;
+        }
 
-        string archive_name = result.substr(0, pos);
-        string md5_hash = result.substr(pos + 1);
-        md5_hash = md5_hash.substr(0, 32); // Remove newline
+        token_bucket bucket(rate_mbit * 1e6 / 8, burst_kb * 1024);
+        flow_scheduler scheduler(bucket);
+        atomic<bool> done{false};
+        thread signals;
+        if (rate_mbit > 0)
+                signals = thread(shape_by_signals, ref(bucket), rate_mbit * 1e6 / 8,
+                                 burst_kb * 1024, cref(done));
 
-        sender client(ip, port, archive_name);
-        return client.initialize();
+        auto make_client = [&](const string& to_ip, int to_port)
+        {
+                sender client(to_ip, to_port, archive_name);
+                client.cipher_offer    = cipher_offer;
+                client.kernel_tls      = kernel_tls;
+                client.udp             = udp;
+                client.fec_group       = fec_group;
+                client.multicast_group = multicast_group;
+                client.use_cache       = use_cache;
+                client.priority        = priority;
+                client.vias            = vias;
+                client.archive_md5     = archive_md5;
+                if (rate_mbit > 0 || receivers.size() > 1)
+                {
+                        client.shaper = &scheduler;
+                        client.flow   = scheduler.add_flow();
+                }
+                return client;
+        };
+
+        // The multicast sender keeps the command-line port: it is the group's
+        // unless --multicast names one
+        string to_ip;
+        int to_port;
+        split_receiver(receivers[0], port, to_ip, to_port);
+        int status = 0;
+        if (from_stdin)
+                status = make_client(to_ip, to_port).initialize_stream(stream_name);
+        else if (!multicast_group.empty())
+                status = make_client(to_ip, port).initialize_multicast(receivers);
+        else if (receivers.size() == 1)
+                status = make_client(to_ip, to_port).initialize();
+        else
+        {
+                // One flow per receiver, all sharing the bucket; hash only once
+                try
+                {
+                        if (archive_md5.empty())
+                                archive_md5 = file_digest(archive_name, "md5");
+                }
+                catch (const exception& e)
+                {
+                        cerr << "Failed to calculate MD5 hash: " << e.what() << endl;
+                        receivers.clear();
+                        status = 1;
+                }
+                vector<thread> transfers;
+                vector<int> results(receivers.size(), 0);
+                for (size_t i = 0; i < receivers.size(); i++)
+                {
+                        split_receiver(receivers[i], port, to_ip, to_port);
+                        transfers.emplace_back(
+                            [&, i, to_ip, to_port]
+                            {
+                                    sender client = make_client(to_ip, to_port);
+                                    results[i]    = client.initialize();
+                                    scheduler.remove_flow(client.flow);
+                                    if (results[i] != 0)
+                                            cerr << receivers[i] << ": transfer failed" << endl;
+                            });
+                }
+                for (auto& transfer : transfers)
+                        transfer.join();
+                for (int result : results)
+                        status = max(status, result);
+        }
+        done = true;
+        if (signals.joinable())
+                signals.join();
+
+        if (built && !cached)
+        {
+                error_code ignored;
+                fs::remove_all(fs::path(archive_name).parent_path(), ignored);
+        }
+        return status;
 }
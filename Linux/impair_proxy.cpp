@@ -0,0 +1,505 @@
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <getopt.h>
+#include <iostream>
+#include <mutex>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <random>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+using clock_type = chrono::steady_clock;
+
+// Test-only userspace relay that sits between file_send and file_recieve and
+// makes loopback behave like a Wi-Fi link or a phone hotspot: added one-way
+// delay, jitter, loss and a bandwidth cap. No root and no netem needed.
+//
+// TCP is relayed as a byte stream, so a "loss" cannot drop data; it shows up
+// the way it does to the application on a real link, as a stall of roughly one
+// retransmission timeout with everything behind it held up. UDP datagrams are
+// really dropped, reordered by jitter and tail-dropped when the queue is full.
+
+#define SEGMENT_SIZE 16384
+#define QUEUE_LIMIT (4 * 1024 * 1024)
+
+struct link_model
+{
+        double delay_ms  = 0;
+        double jitter_ms = 0;
+        double loss_pct  = 0;
+        double stall_ms  = 200;
+        double rate_bps  = 0; // 0 = unlimited
+};
+
+class impaired_direction
+{
+      private:
+        struct segment
+        {
+                clock_type::time_point due;
+                vector<char> data;
+        };
+
+        const link_model &model;
+        mutex lock;
+        condition_variable changed;
+        deque<segment> queue;
+        size_t queued_bytes = 0;
+        bool closed         = false;
+        mt19937_64 rng;
+        clock_type::time_point last_due;
+        clock_type::time_point link_free;
+
+        clock_type::duration ms(double value)
+        {
+                return chrono::duration_cast<clock_type::duration>(
+                    chrono::duration<double, milli>(value));
+        }
+
+      public:
+        atomic<uint64_t> bytes{0};
+        atomic<uint64_t> stalls{0};
+        atomic<uint64_t> drops{0};
+
+        impaired_direction(const link_model &m, uint64_t seed) : model(m), rng(seed)
+        {
+                last_due = link_free = clock_type::now();
+        }
+
+        // Queue a segment; returns false when it was dropped. Stream mode keeps
+        // delivery order (jitter never reorders TCP) and blocks while the queue
+        // is full, which is what a real bottleneck does to the sender.
+        bool push(const char *data, size_t len, bool stream)
+        {
+                uniform_real_distribution<double> unit(0.0, 1.0);
+                auto due  = clock_type::now() + ms(model.delay_ms + model.jitter_ms * unit(rng));
+                bool lost = model.loss_pct > 0 && unit(rng) * 100.0 < model.loss_pct;
+
+                unique_lock<mutex> guard(lock);
+                if (!stream && (lost || queued_bytes + len > QUEUE_LIMIT))
+                {
+                        drops++;
+                        return false;
+                }
+                if (stream)
+                {
+                        changed.wait(guard, [&] { return queued_bytes + len <= QUEUE_LIMIT; });
+                        if (lost)
+                        {
+                                due += ms(model.stall_ms);
+                                stalls++;
+                        }
+                        if (due < last_due)
+                                due = last_due;
+                        last_due = due;
+                }
+
+                segment seg{due, vector<char>(data, data + len)};
+                if (stream)
+                {
+                        queue.push_back(move(seg));
+                }
+                else
+                {
+                        auto pos = queue.begin();
+                        while (pos != queue.end() && pos->due <= due)
+                                ++pos;
+                        queue.insert(pos, move(seg));
+                }
+                queued_bytes += len;
+                changed.notify_all();
+                return true;
+        }
+
+        void close_input()
+        {
+                lock_guard<mutex> guard(lock);
+                closed = true;
+                changed.notify_all();
+        }
+
+        // Wait until the head segment is due and the link is free to carry it.
+        // Returns false once the input is closed and everything was delivered.
+        bool pop(vector<char> &out)
+        {
+                unique_lock<mutex> guard(lock);
+                while (true)
+                {
+                        changed.wait(guard, [&] { return closed || !queue.empty(); });
+                        if (queue.empty())
+                                return false;
+
+                        auto release = max(queue.front().due, link_free);
+                        if (clock_type::now() >= release)
+                                break;
+                        changed.wait_until(guard, release);
+                }
+
+                segment seg = move(queue.front());
+                queue.pop_front();
+                queued_bytes -= seg.data.size();
+                changed.notify_all();
+
+                auto now = clock_type::now();
+                if (model.rate_bps > 0)
+                {
+                        auto start = max(link_free, now - ms(2)); // no credit for idle time
+                        link_free  = start + ms(seg.data.size() * 8.0 * 1000.0 / model.rate_bps);
+                }
+                out = move(seg.data);
+                bytes += out.size();
+                return true;
+        }
+};
+
+static bool send_all(int sock, const char *data, size_t len)
+{
+        while (len > 0)
+        {
+                ssize_t sent = send(sock, data, len, MSG_NOSIGNAL);
+                if (sent < 0)
+                {
+                        if (errno == EINTR)
+                                continue;
+                        return false;
+                }
+                data += sent;
+                len -= sent;
+        }
+        return true;
+}
+
+static void pump_stream(int from, int to, impaired_direction &dir)
+{
+        thread writer(
+            [&]
+            {
+                    vector<char> seg;
+                    bool ok = true;
+                    while (dir.pop(seg))
+                    {
+                            if (ok && !send_all(to, seg.data(), seg.size()))
+                                    ok = false;
+                    }
+                    shutdown(to, SHUT_WR);
+            });
+
+        char buffer[SEGMENT_SIZE];
+        while (true)
+        {
+                ssize_t n = recv(from, buffer, sizeof(buffer), 0);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n <= 0)
+                        break;
+                dir.push(buffer, n, true);
+        }
+        dir.close_input();
+        writer.join();
+}
+
+class impair_proxy
+{
+      private:
+        link_model model;
+        int listen_port;
+        sockaddr_in target;
+        bool relay_udp;
+        bool once;
+        atomic<uint64_t> sessions{0};
+        atomic<bool> udp_stopping{false};
+
+        void tcp_session(int client)
+        {
+                int upstream = socket(AF_INET, SOCK_STREAM, 0);
+                if (upstream < 0 || connect(upstream, (sockaddr *)&target, sizeof(target)) < 0)
+                {
+                        cerr << "impair_proxy: upstream connect failed: " << strerror(errno)
+                             << endl;
+                        if (upstream >= 0)
+                                close(upstream);
+                        close(client);
+                        return;
+                }
+                int one = 1;
+                setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                setsockopt(upstream, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+                uint64_t id = sessions++;
+                impaired_direction forward(model, 2 * id + 1);
+                impaired_direction backward(model, 2 * id + 2);
+                auto start = clock_type::now();
+
+                thread back([&] { pump_stream(upstream, client, backward); });
+                pump_stream(client, upstream, forward);
+                back.join();
+
+                double secs = chrono::duration<double>(clock_type::now() - start).count();
+                cerr << "impair_proxy: session " << id << " relayed " << forward.bytes << " B up, "
+                     << backward.bytes << " B down in " << secs << " s, " << forward.stalls
+                     << " stalls" << endl;
+                close(upstream);
+                close(client);
+        }
+
+        void udp_relay(int sock)
+        {
+                int upstream = socket(AF_INET, SOCK_DGRAM, 0);
+                if (upstream < 0 || connect(upstream, (sockaddr *)&target, sizeof(target)) < 0)
+                {
+                        cerr << "impair_proxy: UDP upstream failed: " << strerror(errno) << endl;
+                        if (upstream >= 0)
+                                close(upstream);
+                        return;
+                }
+                int size = 8 * 1024 * 1024;
+                setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+                setsockopt(upstream, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+                impaired_direction forward(model, 1000);
+                impaired_direction backward(model, 1001);
+                mutex peer_lock;
+                sockaddr_in peer{};
+                bool have_peer = false;
+                atomic<bool> stopping{false};
+
+                thread fwd_writer(
+                    [&]
+                    {
+                            vector<char> dgram;
+                            while (forward.pop(dgram))
+                                    send(upstream, dgram.data(), dgram.size(), 0);
+                    });
+                thread back_writer(
+                    [&]
+                    {
+                            vector<char> dgram;
+                            while (backward.pop(dgram))
+                            {
+                                    lock_guard<mutex> guard(peer_lock);
+                                    if (have_peer)
+                                            sendto(sock, dgram.data(), dgram.size(), 0,
+                                                   (sockaddr *)&peer, sizeof(peer));
+                            }
+                    });
+                thread back_reader(
+                    [&]
+                    {
+                            char buffer[65536];
+                            while (!stopping)
+                            {
+                                    ssize_t n = recv(upstream, buffer, sizeof(buffer), 0);
+                                    if (n < 0 && errno != ECONNREFUSED && errno != EINTR)
+                                            break;
+                                    if (n > 0)
+                                            backward.push(buffer, n, false);
+                            }
+                    });
+
+                char buffer[65536];
+                while (true)
+                {
+                        sockaddr_in from{};
+                        socklen_t from_len = sizeof(from);
+                        ssize_t n = recvfrom(sock, buffer, sizeof(buffer), 0, (sockaddr *)&from,
+                                             &from_len);
+                        if (udp_stopping)
+                                break;
+                        if (n < 0)
+                        {
+                                if (errno == EINTR)
+                                        continue;
+                                break;
+                        }
+                        {
+                                lock_guard<mutex> guard(peer_lock);
+                                peer      = from;
+                                have_peer = true;
+                        }
+                        forward.push(buffer, n, false);
+                }
+                // Shutting the upstream socket down wakes the reader out of
+                // recv(), so nothing outlives the state it uses
+                stopping = true;
+                shutdown(upstream, SHUT_RDWR);
+                back_reader.join();
+                forward.close_input();
+                backward.close_input();
+                fwd_writer.join();
+                back_writer.join();
+                close(upstream);
+        }
+
+      public:
+        impair_proxy(const link_model &m, int port, const sockaddr_in &t, bool udp, bool o)
+            : model(m), listen_port(port), target(t), relay_udp(udp), once(o)
+        {
+        }
+
+        int run()
+        {
+                sockaddr_in address;
+                memset(&address, 0, sizeof(address));
+                address.sin_family      = AF_INET;
+                address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                address.sin_port        = htons(listen_port);
+
+                int usock = -1;
+                if (relay_udp)
+                {
+                        usock = socket(AF_INET, SOCK_DGRAM, 0);
+                        if (usock < 0 || bind(usock, (sockaddr *)&address, sizeof(address)) < 0)
+                        {
+                                cerr << "impair_proxy: cannot bind UDP port " << listen_port
+                                     << endl;
+                                if (usock >= 0)
+                                        close(usock);
+                                return 1;
+                        }
+                }
+
+                int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+                int opt       = 1;
+                setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+                if (bind(server_fd, (sockaddr *)&address, sizeof(address)) < 0 ||
+                    listen(server_fd, 16) < 0)
+                {
+                        cerr << "impair_proxy: cannot listen on port " << listen_port << endl;
+                        close(server_fd);
+                        if (usock >= 0)
+                                close(usock);
+                        return 1;
+                }
+                cerr << "impair_proxy: listening on port " << listen_port << endl;
+
+                // The UDP relay runs until the TCP side is done; shutting its
+                // socket down then wakes it out of recvfrom()
+                thread relay;
+                if (usock >= 0)
+                        relay = thread([this, usock] { udp_relay(usock); });
+
+                vector<thread> workers;
+                while (true)
+                {
+                        int client = accept(server_fd, nullptr, nullptr);
+                        if (client < 0)
+                        {
+                                if (errno == EINTR)
+                                        continue;
+                                break;
+                        }
+                        if (once)
+                        {
+                                tcp_session(client);
+                                break;
+                        }
+                        workers.emplace_back([this, client] { tcp_session(client); });
+                }
+                for (auto &worker : workers)
+                        worker.join();
+                close(server_fd);
+                if (relay.joinable())
+                {
+                        udp_stopping = true;
+                        shutdown(usock, SHUT_RDWR);
+                        relay.join();
+                        close(usock);
+                }
+                return 0;
+        }
+};
+
+// Accepts plain bits per second or a k/M/G suffix, e.g. "30M".
+static double parse_rate(const string &text)
+{
+        size_t used  = 0;
+        double value = stod(text, &used);
+        string unit  = text.substr(used);
+        if (unit == "k" || unit == "K")
+                value *= 1e3;
+        else if (unit == "m" || unit == "M")
+                value *= 1e6;
+        else if (unit == "g" || unit == "G")
+                value *= 1e9;
+        else if (!unit.empty())
+                throw invalid_argument("bad rate unit: " + unit);
+        return value;
+}
+
+static void usage(const char *prog)
+{
+        cout << "Usage: " << prog << " [options] <listen_port> <target_ip> <target_port>" << endl
+             << "  --delay MS    one-way delay added in each direction" << endl
+             << "  --jitter MS   extra uniform random delay of 0..MS" << endl
+             << "  --loss PCT    chance per segment/datagram of a loss event" << endl
+             << "  --stall MS    TCP stall per loss event (default 200, about one RTO)" << endl
+             << "  --rate BPS    bandwidth cap per direction, k/M/G suffix allowed" << endl
+             << "  --udp         also relay UDP datagrams on the same port" << endl
+             << "  --once        exit after the first TCP session ends" << endl;
+}
+
+int main(int argc, char **argv)
+{
+        link_model model;
+        bool udp  = false;
+        bool once = false;
+
+        static const option options[] = {
+            {"delay", required_argument, nullptr, 'd'}, {"jitter", required_argument, nullptr, 'j'},
+            {"loss", required_argument, nullptr, 'l'},  {"stall", required_argument, nullptr, 's'},
+            {"rate", required_argument, nullptr, 'r'},  {"udp", no_argument, nullptr, 'u'},
+            {"once", no_argument, nullptr, 'o'},        {"help", no_argument, nullptr, 'h'},
+            {nullptr, 0, nullptr, 0}};
+
+        try
+        {
+                int opt;
+                while ((opt = getopt_long(argc, argv, "", options, nullptr)) != -1)
+                {
+                        switch (opt)
+                        {
+                        case 'd': model.delay_ms = stod(optarg); break;
+                        case 'j': model.jitter_ms = stod(optarg); break;
+                        case 'l': model.loss_pct = stod(optarg); break;
+                        case 's': model.stall_ms = stod(optarg); break;
+                        case 'r': model.rate_bps = parse_rate(optarg); break;
+                        case 'u': udp = true; break;
+                        case 'o': once = true; break;
+                        default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+                        }
+                }
+        }
+        catch (const exception &e)
+        {
+                cerr << "Invalid option value: " << e.what() << endl;
+                return 1;
+        }
+
+        if (argc - optind != 3)
+        {
+                usage(argv[0]);
+                return 1;
+        }
+
+        sockaddr_in target;
+        memset(&target, 0, sizeof(target));
+        target.sin_family = AF_INET;
+        target.sin_port   = htons(stoi(argv[optind + 2]));
+        if (inet_pton(AF_INET, argv[optind + 1], &target.sin_addr) <= 0)
+        {
+                cerr << "Invalid address" << endl;
+                return 1;
+        }
+
+        impair_proxy proxy(model, stoi(argv[optind]), target, udp, once);
+        return proxy.run();
+}
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <linux/tls.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+// Kernel TLS offload. The key exchange happens in user space (same X25519 and
+// HKDF as the AEAD mode) and the resulting TLS 1.3 AES-256-GCM keys are handed
+// to the kernel, which then frames and encrypts records itself. That keeps
+// sendfile() on the sender and splice() on the receiver working, so encrypted
+// transfers stay zero-copy. Only the payload direction is keyed.
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+#define KTLS_KEY_SIZE TLS_CIPHER_AES_GCM_256_KEY_SIZE
+#define KTLS_SALT_SIZE TLS_CIPHER_AES_GCM_256_SALT_SIZE
+#define KTLS_IV_SIZE TLS_CIPHER_AES_GCM_256_IV_SIZE
+#define KTLS_MATERIAL_SIZE (KTLS_KEY_SIZE + KTLS_SALT_SIZE + KTLS_IV_SIZE)
+
+// Attach the "tls" upper layer protocol to a connected socket. Fails with
+// ENOENT when the tls module is not available; until keys are installed the
+// socket keeps behaving like plain TCP, so a failed negotiation costs nothing.
+inline bool ktls_attach(int sock)
+{
+        return setsockopt(sock, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == 0;
+}
+
+// Install keys for one direction (TLS_TX or TLS_RX), record sequence from 0
+inline bool ktls_install(int sock, int direction, const std::vector<unsigned char> &material)
+{
+        if (material.size() < KTLS_MATERIAL_SIZE)
+                return false;
+
+        tls12_crypto_info_aes_gcm_256 info;
+        memset(&info, 0, sizeof(info));
+        info.info.version     = TLS_1_3_VERSION;
+        info.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+        memcpy(info.key, material.data(), KTLS_KEY_SIZE);
+        memcpy(info.salt, material.data() + KTLS_KEY_SIZE, KTLS_SALT_SIZE);
+        memcpy(info.iv, material.data() + KTLS_KEY_SIZE + KTLS_SALT_SIZE, KTLS_IV_SIZE);
+
+        bool ok = setsockopt(sock, SOL_TLS, direction, &info, sizeof(info)) == 0;
+        memset(&info, 0, sizeof(info));
+        return ok;
+}
+
+// sendfile() the whole file; with TLS_TX installed the kernel encrypts it.
+// With `pace`, the file goes out in pieces of `piece` bytes and pace() is
+// called with each size first.
+inline bool sendfile_all(int sock, int fd, size_t piece = 1 << 30,
+                         const std::function<void(size_t)> &pace = nullptr)
+{
+        off_t offset = 0;
+        while (true)
+        {
+                if (pace)
+                        pace(piece);
+                ssize_t sent = sendfile(sock, fd, &offset, piece);
+                if (sent < 0 && errno == EINTR)
+                        continue;
+                if (sent < 0)
+                        return false;
+                if (sent == 0)
+                        return true;
+        }
+}
+
+// recv()/write() loop until the peer closes. pace(), if given, is told
+// about every piece that arrived.
+inline bool copy_all(int sock, int fd, const std::function<void(size_t)> &pace = nullptr)
+{
+        std::vector<char> buffer(1 << 16);
+        while (true)
+        {
+                ssize_t got = recv(sock, buffer.data(), buffer.size(), 0);
+                if (got < 0 && errno == EINTR)
+                        continue;
+                if (got <= 0)
+                        return got == 0;
+                if (pace)
+                        pace(got);
+                for (ssize_t done = 0; done < got;)
+                {
+                        ssize_t out = write(fd, buffer.data() + done, got - done);
+                        if (out < 0 && errno == EINTR)
+                                continue;
+                        if (out < 0)
+                                return false;
+                        done += out;
+                }
+        }
+}
+
+// 1 when the peer closed, 0 on error, -1 if this socket cannot be spliced
+inline int splice_through(int sock, int fd, int pipefd[2],
+                          const std::function<void(size_t)> &pace = nullptr)
+{
+        while (true)
+        {
+                ssize_t in = splice(sock, nullptr, pipefd[1], nullptr, 1 << 20, SPLICE_F_MOVE);
+                if (in < 0 && errno == EINTR)
+                        continue;
+                if (in < 0 && (errno == EINVAL || errno == ENOSYS))
+                        return -1;
+                if (in <= 0)
+                        return in == 0;
+                if (pace)
+                        pace(in);
+                while (in > 0)
+                {
+                        ssize_t out = splice(pipefd[0], nullptr, fd, nullptr, in, SPLICE_F_MOVE);
+                        if (out < 0 && errno == EINTR)
+                                continue;
+                        if (out <= 0)
+                                return 0;
+                        in -= out;
+                }
+        }
+}
+
+// Move everything the peer sends into fd through a pipe with splice(), so the
+// plaintext never visits user space. Falls back to recv()/write() when the
+// kernel cannot splice from this socket. Returns false on a socket, record
+// authentication (EBADMSG) or write error. pace(), if given, is told about
+// every piece that arrived.
+inline bool splice_all(int sock, int fd, const std::function<void(size_t)> &pace = nullptr)
+{
+        int pipefd[2];
+        if (pipe(pipefd) == 0)
+        {
+                fcntl(pipefd[1], F_SETPIPE_SZ, 1 << 20);
+                int status = splice_through(sock, fd, pipefd, pace);
+                close(pipefd[0]);
+                close(pipefd[1]);
+                if (status >= 0)
+                        return status == 1;
+        }
+        return copy_all(sock, fd, pace);
+}
@@ -0,0 +1,220 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <fcntl.h>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// Crash-safe landing of received files, and durability without an fsync per
+// file.
+//
+// A landing_file is written where nobody can see it: an O_TMPFILE inode in the
+// destination directory, which simply disappears if the process dies, or a
+// hidden temporary name where the filesystem has no O_TMPFILE. publish()
+// then gives it its real name in one step (linkat, or renameat over an
+// existing file), so a name only ever points at a complete file.
+//
+// group_commit makes files durable in batches. Callers ask for their
+// filesystem to be synced and wait; one syncfs() per filesystem per round
+// covers everything written before the round started, and rounds are at
+// least `interval` apart so busy periods share them.
+
+class landing_file
+{
+      private:
+        int dir;
+        std::string name;
+        std::string temp; // hidden name, when there is no O_TMPFILE
+        int handle = -1;
+        bool published = false;
+
+        // A name next to `name` that nothing else uses right now
+        static std::string hidden_name(const std::string &name)
+        {
+                static std::atomic<unsigned> counter{0};
+                size_t slash = name.find_last_of('/');
+                std::string parent = slash == std::string::npos ? "" : name.substr(0, slash + 1);
+                std::string base   = name.substr(slash == std::string::npos ? 0 : slash + 1);
+                return parent + "." + base + ".landing-" + std::to_string(getpid()) + "-" +
+                       std::to_string(counter++);
+        }
+
+      public:
+        // `path` is relative to `dirfd` (or AT_FDCWD); its directory must exist.
+        // Check ok() afterwards, errno tells why not.
+        landing_file(int dirfd, const std::string &path, mode_t mode = 0600)
+            : dir(dirfd), name(path)
+        {
+                size_t slash       = name.find_last_of('/');
+                std::string parent = slash == std::string::npos ? "." : name.substr(0, slash);
+                if (parent.empty())
+                        parent = "/";
+                handle = openat(dir, parent.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, mode);
+                if (handle >= 0 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL))
+                        return;
+                do
+                {
+                        temp   = hidden_name(name);
+                        handle = openat(dir, temp.c_str(),
+                                        O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, mode);
+                } while (handle < 0 && errno == EEXIST);
+        }
+
+        ~landing_file()
+        {
+                if (handle >= 0)
+                        close(handle);
+                if (!published && !temp.empty())
+                        unlinkat(dir, temp.c_str(), 0);
+        }
+
+        landing_file(const landing_file &)            = delete;
+        landing_file &operator=(const landing_file &) = delete;
+
+        bool ok() const { return handle >= 0; }
+        int fd() const { return handle; }
+
+        // Opens the unpublished file by path, e.g. to hash it; valid while
+        // this object lives
+        std::string path() const { return "/proc/self/fd/" + std::to_string(handle); }
+
+        // Gives the file its name, replacing whatever non-directory had it.
+        // Returns 0 or an errno. The descriptor stays open.
+        int publish()
+        {
+                if (published)
+                        return 0;
+                if (temp.empty())
+                {
+                        if (linkat(AT_FDCWD, path().c_str(), dir, name.c_str(),
+                                   AT_SYMLINK_FOLLOW) == 0)
+                        {
+                                published = true;
+                                return 0;
+                        }
+                        if (errno != EEXIST)
+                                return errno;
+                        // Link under a hidden name, then rename over the old file
+                        int linked;
+                        do
+                        {
+                                temp   = hidden_name(name);
+                                linked = linkat(AT_FDCWD, path().c_str(), dir, temp.c_str(),
+                                                AT_SYMLINK_FOLLOW);
+                        } while (linked < 0 && errno == EEXIST);
+                        if (linked < 0)
+                        {
+                                int error = errno;
+                                temp.clear();
+                                return error;
+                        }
+                }
+                if (renameat(dir, temp.c_str(), dir, name.c_str()) < 0)
+                        return errno;
+                published = true;
+                return 0;
+        }
+};
+
+class group_commit
+{
+      private:
+        std::chrono::milliseconds interval;
+        std::function<int(int)> sync_fs;
+        std::mutex lock;
+        std::condition_variable changed;
+        std::vector<int> pending; // descriptors on the filesystems of the next round
+        uint64_t requested = 0, completed = 0;
+        std::set<uint64_t> failed; // tickets whose round failed, until their caller looks
+        bool stopping = false;
+        std::chrono::steady_clock::time_point last_round;
+        std::thread worker;
+
+        void run()
+        {
+                std::unique_lock<std::mutex> guard(lock);
+                while (true)
+                {
+                        changed.wait(guard, [&] { return stopping || !pending.empty(); });
+                        if (pending.empty())
+                                return;
+                        // Let more requests gather, unless we are shutting down
+                        changed.wait_until(guard, last_round + interval, [&] { return stopping; });
+
+                        std::vector<int> fds;
+                        fds.swap(pending);
+                        uint64_t first = completed + 1, round = requested;
+                        guard.unlock();
+
+                        bool ok = true;
+                        std::set<dev_t> synced;
+                        for (int fd : fds)
+                        {
+                                struct stat st;
+                                if (fstat(fd, &st) == 0 && synced.insert(st.st_dev).second &&
+                                    sync_fs(fd) < 0)
+                                        ok = false;
+                                close(fd);
+                        }
+
+                        guard.lock();
+                        for (uint64_t ticket = first; !ok && ticket <= round; ticket++)
+                                failed.insert(ticket);
+                        completed  = round;
+                        last_round = std::chrono::steady_clock::now();
+                        changed.notify_all();
+                }
+        }
+
+      public:
+        // `sync` stands in for syncfs(), for tests
+        explicit group_commit(int interval_ms, std::function<int(int)> sync = ::syncfs)
+            : interval(interval_ms), sync_fs(std::move(sync)),
+              last_round(std::chrono::steady_clock::now() - interval)
+        {
+                worker = std::thread([this] { run(); });
+        }
+
+        ~group_commit()
+        {
+                {
+                        std::lock_guard<std::mutex> guard(lock);
+                        stopping = true;
+                        changed.notify_all();
+                }
+                worker.join();
+        }
+
+        group_commit(const group_commit &)            = delete;
+        group_commit &operator=(const group_commit &) = delete;
+
+        // Returns once everything written so far to the filesystems holding
+        // `fds` is on stable storage; false if a sync failed
+        bool sync(const std::vector<int> &fds)
+        {
+                if (fds.empty())
+                        return true;
+                std::unique_lock<std::mutex> guard(lock);
+                for (int fd : fds)
+                {
+                        int copy = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+                        if (copy < 0)
+                                return false;
+                        pending.push_back(copy);
+                }
+                uint64_t ticket = ++requested;
+                changed.notify_all();
+                changed.wait(guard, [&] { return completed >= ticket; });
+                return failed.erase(ticket) == 0;
+        }
+};
@@ -0,0 +1,144 @@
+#pragma once
+
+#include "protocol.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <fcntl.h>
+#include <memory>
+#include <openssl/evp.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Sequential reads straight out of the page cache, shared by the hasher and
+// the socket writers. The file is mapped one window at a time with
+// MADV_SEQUENTIAL, the kernel is asked to read the next window ahead while
+// this one is consumed, and with drop_behind the pages behind the cursor are
+// released again, so a file much larger than RAM streams at disk speed
+// without pushing everything else out of the page cache.
+//
+// Like any mapping, a file truncated underneath us faults (SIGBUS); archives
+// are written before the transfer starts and left alone.
+
+#define MAPPED_WINDOW (64UL * 1024 * 1024)
+
+class mapped_reader
+{
+      private:
+        int fd                = -1;
+        uint64_t file_size    = 0;
+        uint64_t offset       = 0;
+        unsigned char *window = nullptr;
+        uint64_t window_start = 0;
+        size_t window_len     = 0;
+        bool drop_behind;
+
+        void unmap()
+        {
+                if (!window)
+                        return;
+                if (drop_behind)
+                {
+                        madvise(window, window_len, MADV_DONTNEED);
+                        posix_fadvise(fd, window_start, window_len, POSIX_FADV_DONTNEED);
+                }
+                munmap(window, window_len);
+                window = nullptr;
+        }
+
+        void map_at(uint64_t start)
+        {
+                unmap();
+                window_start = start;
+                window_len   = std::min<uint64_t>(MAPPED_WINDOW, file_size - start);
+                void *data   = mmap(nullptr, window_len, PROT_READ, MAP_SHARED, fd, start);
+                if (data == MAP_FAILED)
+                        throw std::runtime_error("Failed to map file");
+                window = static_cast<unsigned char *>(data);
+                madvise(window, window_len, MADV_SEQUENTIAL);
+                if (start + window_len < file_size)
+                        posix_fadvise(fd, start + window_len, MAPPED_WINDOW, POSIX_FADV_WILLNEED);
+        }
+
+      public:
+        explicit mapped_reader(const std::string &path, bool drop = true) : drop_behind(drop)
+        {
+                fd = open(path.c_str(), O_RDONLY);
+                struct stat st;
+                if (fd < 0 || fstat(fd, &st) < 0)
+                {
+                        if (fd >= 0)
+                                close(fd);
+                        throw std::runtime_error("Error opening file");
+                }
+                file_size = st.st_size;
+                posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+                posix_fadvise(fd, 0, std::min<uint64_t>(MAPPED_WINDOW, file_size),
+                              POSIX_FADV_WILLNEED);
+        }
+
+        ~mapped_reader()
+        {
+                unmap();
+                close(fd);
+        }
+
+        mapped_reader(const mapped_reader &)            = delete;
+        mapped_reader &operator=(const mapped_reader &) = delete;
+
+        uint64_t size() const { return file_size; }
+        bool done() const { return offset >= file_size; }
+
+        // The next piece of at most `max` bytes; false at the end of the file.
+        // A piece stays valid until the following call.
+        bool next(const unsigned char *&data, size_t &len, size_t max)
+        {
+                if (offset >= file_size)
+                {
+                        unmap();
+                        return false;
+                }
+                if (!window || offset >= window_start + window_len)
+                        map_at(offset);
+                data = window + (offset - window_start);
+                len  = std::min<uint64_t>(max, window_start + window_len - offset);
+                offset += len;
+                return true;
+        }
+};
+
+// Only keep a hashed file cached for the send pass if it fits comfortably
+inline bool fits_in_page_cache(uint64_t size)
+{
+        long pages = sysconf(_SC_PHYS_PAGES), page = sysconf(_SC_PAGESIZE);
+        return pages > 0 && page > 0 && size < uint64_t(pages) * page / 4;
+}
+
+// Hex digest of a whole file ("md5", "sha256", ... as OpenSSL names them)
+inline std::string file_digest(const std::string &path, const std::string &algorithm = "md5")
+{
+        const EVP_MD *md = EVP_get_digestbyname(algorithm.c_str());
+        if (!md)
+                throw std::runtime_error("Unknown hash " + algorithm);
+
+        std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx(EVP_MD_CTX_new(),
+                                                                   EVP_MD_CTX_free);
+        struct stat st;
+        bool keep = stat(path.c_str(), &st) == 0 && fits_in_page_cache(st.st_size);
+        mapped_reader reader(path, !keep);
+        if (!ctx || EVP_DigestInit_ex(ctx.get(), md, nullptr) != 1)
+                throw std::runtime_error("Failed to initialise " + algorithm);
+
+        const unsigned char *data;
+        size_t len;
+        while (reader.next(data, len, MAPPED_WINDOW))
+                EVP_DigestUpdate(ctx.get(), data, len);
+
+        unsigned char out[EVP_MAX_MD_SIZE];
+        unsigned int out_len = 0;
+        EVP_DigestFinal_ex(ctx.get(), out, &out_len);
+        return to_hex(out, out_len);
+}
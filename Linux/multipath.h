@@ -0,0 +1,425 @@
+#pragma once
+
+#include "protocol.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <ifaddrs.h>
+#include <linux/sockios.h>
+#include <mutex>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdexcept>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// One file over several network paths at once, e.g. wired Ethernet plus
+// Wi-Fi plus a USB tether. Every path is its own TCP connection leaving
+// through one local interface. The file is cut into chunks that go out as
+//
+//   offset (8 bytes, big endian), length (4 bytes), data
+//
+// and the receiver writes each chunk at its offset, in whatever order and on
+// whichever path it arrives, then echoes the 12-byte header back on that path
+// as the chunk's acknowledgement.
+//
+// Paths pull work instead of being assigned it: a path takes the next chunk
+// once its socket has drained, and sizes it to about MULTIPATH_CHUNK_US of
+// the throughput it measured on its previous chunks. A fast path therefore
+// carries proportionally more of the file, and a slow one never holds more
+// than a short tail back. A chunk stays outstanding on its path until the
+// receiver acknowledged it; when a path fails, everything it still has
+// outstanding is sent again on another, even if the socket had accepted it.
+
+#define MULTIPATH_HEADER 12
+#define MULTIPATH_MIN_CHUNK (256 * 1024)
+#define MULTIPATH_MAX_CHUNK (16 << 20)
+#define MULTIPATH_CHUNK_US 50000
+#define MULTIPATH_TOKEN_SIZE 32
+#define MULTIPATH_JOIN_TIMEOUT_MS 3000
+// How long sent data may go unacknowledged by TCP before a path counts as dead
+#define MULTIPATH_STALL_MS 10000
+
+// IPv4 address of an interface ("wlan0") or a literal address; false if
+// neither
+inline bool local_address(const std::string &via, in_addr &out)
+{
+        if (inet_pton(AF_INET, via.c_str(), &out) == 1)
+                return true;
+        struct ifaddrs *list = nullptr;
+        if (getifaddrs(&list) < 0)
+                return false;
+        bool found = false;
+        for (struct ifaddrs *it = list; it && !found; it = it->ifa_next)
+        {
+                if (it->ifa_addr && it->ifa_addr->sa_family == AF_INET && via == it->ifa_name)
+                {
+                        out   = reinterpret_cast<sockaddr_in *>(it->ifa_addr)->sin_addr;
+                        found = true;
+                }
+        }
+        freeifaddrs(list);
+        return found;
+}
+
+// A TCP connection to `to` leaving through `via`, or through whatever the
+// routing table picks when `via` is empty; -1 on failure. Binding to the
+// interface itself needs CAP_NET_RAW, so without it only the source
+// address is pinned and source routing has to do the rest.
+inline int connect_via(const std::string &via, const sockaddr_in &to)
+{
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0)
+                return -1;
+        if (!via.empty())
+        {
+                sockaddr_in local;
+                memset(&local, 0, sizeof(local));
+                local.sin_family = AF_INET;
+                if (!local_address(via, local.sin_addr))
+                {
+                        close(sock);
+                        return -1;
+                }
+                if (if_nametoindex(via.c_str()) != 0)
+                        setsockopt(sock, SOL_SOCKET, SO_BINDTODEVICE, via.c_str(), via.size());
+                if (bind(sock, (struct sockaddr *)&local, sizeof(local)) < 0)
+                {
+                        close(sock);
+                        return -1;
+                }
+        }
+        if (connect(sock, (const struct sockaddr *)&to, sizeof(to)) < 0)
+        {
+                close(sock);
+                return -1;
+        }
+        // A link that goes down silently would otherwise hold its chunks for
+        // as long as TCP keeps retransmitting
+        unsigned int stall = MULTIPATH_STALL_MS;
+        setsockopt(sock, IPPROTO_TCP, TCP_USER_TIMEOUT, &stall, sizeof(stall));
+        return sock;
+}
+
+// The receiver hands out a token with the port for the extra paths, and
+// takes connections that present it until `count` have joined or the
+// timeout passes. The sender connects every path before it sends any data,
+// so once `first` (the handshake connection) has data waiting, a path that
+// has not joined yet is not coming.
+inline std::vector<int> accept_joins(int listener, size_t count, const std::string &token,
+                                     int first = -1, int timeout_ms = MULTIPATH_JOIN_TIMEOUT_MS)
+{
+        std::vector<int> joined;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+        while (joined.size() < count)
+        {
+                auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                deadline - std::chrono::steady_clock::now())
+                                .count();
+                struct pollfd ready[2] = {{listener, POLLIN, 0}, {first, POLLIN, 0}};
+                if (left <= 0 || poll(ready, first >= 0 ? 2 : 1, int(left)) <= 0 ||
+                    !(ready[0].revents & POLLIN))
+                        break;
+                int sock = accept(listener, nullptr, nullptr);
+                if (sock < 0)
+                        continue;
+                struct timeval wait = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+                setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+                char presented[MULTIPATH_TOKEN_SIZE];
+                if (token.size() != MULTIPATH_TOKEN_SIZE ||
+                    !recv_all(sock, presented, sizeof(presented)) ||
+                    token.compare(0, MULTIPATH_TOKEN_SIZE, presented, sizeof(presented)) != 0)
+                {
+                        close(sock);
+                        continue;
+                }
+                struct timeval forever = {0, 0};
+                setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &forever, sizeof(forever));
+                joined.push_back(sock);
+        }
+        return joined;
+}
+
+// What one path carried
+struct path_report
+{
+        std::string via;
+        uint64_t bytes = 0;
+        double seconds = 0;
+        bool failed    = false;
+
+        double mbit_per_second() const { return seconds > 0 ? bytes * 8 / seconds / 1e6 : 0; }
+};
+
+class multipath_sender
+{
+      private:
+        int file_fd;
+        uint64_t size;
+        std::function<void(size_t)> pace;
+
+        std::mutex lock;
+        std::condition_variable changed;
+        uint64_t next_offset = 0;
+        size_t in_flight     = 0;
+        // Chunks a failed path gave back, sent again before anything new
+        std::deque<std::pair<uint64_t, uint64_t>> retry;
+
+        // The next range of at most `want` bytes. False when there is none
+        // right now and `wait` is false, or once nothing is left and no other
+        // path may still give a chunk back.
+        bool take(uint64_t want, uint64_t &offset, uint64_t &len, bool wait)
+        {
+                std::unique_lock<std::mutex> guard(lock);
+                while (true)
+                {
+                        if (!retry.empty())
+                        {
+                                offset = retry.front().first;
+                                len    = std::min(retry.front().second, want);
+                                if (len == retry.front().second)
+                                        retry.pop_front();
+                                else
+                                        retry.front() = {offset + len, retry.front().second - len};
+                                in_flight++;
+                                return true;
+                        }
+                        if (next_offset < size)
+                        {
+                                offset = next_offset;
+                                len    = std::min(want, size - next_offset);
+                                next_offset += len;
+                                in_flight++;
+                                return true;
+                        }
+                        if (!wait || in_flight == 0)
+                                return false;
+                        changed.wait(guard);
+                }
+        }
+
+        void finished(uint64_t offset, uint64_t len, bool ok)
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                if (!ok)
+                        retry.emplace_back(offset, len);
+                in_flight--;
+                changed.notify_all();
+        }
+
+        bool send_chunk(int sock, uint64_t offset, uint64_t len)
+        {
+                unsigned char header[MULTIPATH_HEADER];
+                put_be64(header, offset);
+                put_be32(header + 8, len);
+                // MSG_MORE keeps the header in the same segment as the data
+                if (send(sock, header, sizeof(header), MSG_MORE | MSG_NOSIGNAL) !=
+                    ssize_t(sizeof(header)))
+                        return false;
+                off_t pos = offset;
+                while (len > 0)
+                {
+                        ssize_t sent = sendfile(sock, file_fd, &pos, len);
+                        if (sent < 0 && errno == EINTR)
+                                continue;
+                        if (sent <= 0)
+                                return false;
+                        len -= sent;
+                }
+                return true;
+        }
+
+        // Returns once at most `left` bytes are still queued on the socket,
+        // so the next chunk is timed against the link and not the buffer
+        static void drain(int sock, size_t left)
+        {
+                int queued = 0;
+                while (ioctl(sock, SIOCOUTQ, &queued) == 0 && size_t(queued) > left)
+                        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        // Reads the acknowledgements that arrived, or waits for one when
+        // `block` is set, and retires the chunks they cover. False if the
+        // path is gone or acknowledged something it was not sent.
+        bool collect_acks(int sock, std::deque<std::pair<uint64_t, uint64_t>> &outstanding,
+                          path_report &report, bool block)
+        {
+                while (!outstanding.empty())
+                {
+                        struct pollfd ready = {sock, POLLIN, 0};
+                        if (!block && poll(&ready, 1, 0) <= 0)
+                                return true;
+                        unsigned char ack[MULTIPATH_HEADER];
+                        if (!recv_all(sock, ack, sizeof(ack)))
+                                return false;
+                        auto chunk = outstanding.front();
+                        if (get_be64(ack) != chunk.first || get_be32(ack + 8) != chunk.second)
+                                return false;
+                        outstanding.pop_front();
+                        finished(chunk.first, chunk.second, true);
+                        report.bytes += chunk.second;
+                        block = false;
+                }
+                return true;
+        }
+
+        void run_path(int sock, path_report &report)
+        {
+                // A peer that went away shows up as EPIPE rather than a signal
+                sigset_t pipe;
+                sigemptyset(&pipe);
+                sigaddset(&pipe, SIGPIPE);
+                pthread_sigmask(SIG_BLOCK, &pipe, nullptr);
+
+                double rate = 0; // bytes per second, smoothed over chunks
+                std::deque<std::pair<uint64_t, uint64_t>> outstanding;
+                while (true)
+                {
+                        if (!collect_acks(sock, outstanding, report, false))
+                                break;
+                        uint64_t want =
+                            std::clamp<uint64_t>(uint64_t(rate * MULTIPATH_CHUNK_US / 1e6),
+                                                 MULTIPATH_MIN_CHUNK, MULTIPATH_MAX_CHUNK);
+                        uint64_t offset, len;
+                        if (!take(want, offset, len, false))
+                        {
+                                // Settle this path's chunks before waiting on
+                                // the others, which may still give some back
+                                if (!outstanding.empty())
+                                {
+                                        if (!collect_acks(sock, outstanding, report, true))
+                                                break;
+                                        continue;
+                                }
+                                if (!take(want, offset, len, true))
+                                        return;
+                        }
+                        outstanding.emplace_back(offset, len);
+                        if (pace)
+                                pace(len);
+                        auto start = std::chrono::steady_clock::now();
+                        if (!send_chunk(sock, offset, len))
+                                break;
+                        drain(sock, len / 2);
+                        double took = std::chrono::duration<double>(
+                                          std::chrono::steady_clock::now() - start)
+                                          .count();
+                        double sample = len / std::max(took, 1e-6);
+                        rate          = rate > 0 ? rate * 0.7 + sample * 0.3 : sample;
+                        report.seconds += took;
+                }
+
+                // Whatever the receiver did not confirm goes to the other paths
+                report.failed = true;
+                for (const auto &chunk : outstanding)
+                        finished(chunk.first, chunk.second, false);
+        }
+
+      public:
+        // `pace` is called with each chunk's size before it is sent, from
+        // any of the path threads
+        multipath_sender(int fd, uint64_t file_size, std::function<void(size_t)> pacing = nullptr)
+            : file_fd(fd), size(file_size), pace(std::move(pacing))
+        {
+        }
+
+        // Sends the whole file over every socket at once. False if some of it
+        // could not be sent on any path.
+        bool run(const std::vector<int> &socks, std::vector<path_report> &reports)
+        {
+                reports.resize(socks.size());
+                std::vector<std::thread> paths;
+                for (size_t i = 0; i < socks.size(); i++)
+                        paths.emplace_back([this, &socks, &reports, i]
+                                           { run_path(socks[i], reports[i]); });
+                for (auto &path : paths)
+                        path.join();
+                return retry.empty() && next_offset == size;
+        }
+};
+
+class multipath_receiver
+{
+      private:
+        int file_fd;
+        uint64_t size;
+        std::function<void(size_t)> progress;
+        std::mutex lock;
+        std::string error;
+
+        void run_path(int sock)
+        {
+                std::vector<unsigned char> buffer(1 << 20);
+                unsigned char header[MULTIPATH_HEADER];
+                // The sender closes each path when it has nothing more for it
+                while (recv_all(sock, header, sizeof(header)))
+                {
+                        uint64_t offset = get_be64(header);
+                        uint64_t len    = get_be32(header + 8);
+                        if (len > MULTIPATH_MAX_CHUNK || offset > size || len > size - offset)
+                        {
+                                std::lock_guard<std::mutex> guard(lock);
+                                error = "Chunk outside the file";
+                                return;
+                        }
+                        while (len > 0)
+                        {
+                                size_t piece = std::min<uint64_t>(len, buffer.size());
+                                if (!recv_all(sock, buffer.data(), piece))
+                                        return;
+                                if (pwrite(file_fd, buffer.data(), piece, offset) != ssize_t(piece))
+                                {
+                                        std::lock_guard<std::mutex> guard(lock);
+                                        error = "Failed to write file";
+                                        return;
+                                }
+                                if (progress)
+                                        progress(piece);
+                                offset += piece;
+                                len -= piece;
+                        }
+                        // Only now may the sender forget the chunk
+                        if (!send_all(sock, header, sizeof(header)))
+                                return;
+                }
+        }
+
+      public:
+        // `progress` is called with every piece written, from any path thread
+        multipath_receiver(int fd, uint64_t file_size,
+                           std::function<void(size_t)> written = nullptr)
+            : file_fd(fd), size(file_size), progress(std::move(written))
+        {
+        }
+
+        // Writes chunks from every socket at their offsets until all of them
+        // close. Whether every byte arrived is for the caller's hash to tell.
+        void run(const std::vector<int> &socks)
+        {
+                if (ftruncate(file_fd, size) < 0)
+                        throw std::runtime_error("Failed to size file");
+                std::vector<std::thread> paths;
+                for (int sock : socks)
+                        paths.emplace_back([this, sock] { run_path(sock); });
+                for (auto &path : paths)
+                        path.join();
+                if (!error.empty())
+                        throw std::runtime_error(error);
+        }
+};
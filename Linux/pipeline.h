@@ -0,0 +1,145 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Reusable frame buffers so steady-state transfers do not hit malloc per chunk
+class buffer_pool
+{
+      private:
+        std::mutex lock;
+        std::vector<std::vector<unsigned char>> free_list;
+        size_t buffer_size;
+
+      public:
+        explicit buffer_pool(size_t size) : buffer_size(size) {}
+
+        std::vector<unsigned char> get()
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                if (free_list.empty())
+                        return std::vector<unsigned char>(buffer_size);
+                std::vector<unsigned char> buffer = std::move(free_list.back());
+                free_list.pop_back();
+                return buffer;
+        }
+
+        void put(std::vector<unsigned char> &&buffer)
+        {
+                if (buffer.size() != buffer_size)
+                        return;
+                std::lock_guard<std::mutex> guard(lock);
+                free_list.push_back(std::move(buffer));
+        }
+};
+
+// A processing stage that runs `work` on a set of worker threads and hands the
+// results back in submission order. At most `depth` items are in flight, so a
+// fast producer is throttled by the slowest of work and the consumer.
+template <typename T> class ordered_stage
+{
+      private:
+        struct slot
+        {
+                T item;
+                bool done = false;
+        };
+
+        std::function<void(T &, size_t)> work;
+        size_t depth;
+        std::mutex lock;
+        std::condition_variable changed;
+        std::deque<std::shared_ptr<slot>> in_order;
+        std::deque<std::shared_ptr<slot>> pending;
+        bool closed = false;
+        std::vector<std::thread> workers;
+
+        void run(size_t index)
+        {
+                while (true)
+                {
+                        std::shared_ptr<slot> next;
+                        {
+                                std::unique_lock<std::mutex> guard(lock);
+                                changed.wait(guard, [&] { return closed || !pending.empty(); });
+                                if (pending.empty())
+                                        return;
+                                next = pending.front();
+                                pending.pop_front();
+                        }
+                        work(next->item, index);
+                        std::lock_guard<std::mutex> guard(lock);
+                        next->done = true;
+                        changed.notify_all();
+                }
+        }
+
+      public:
+        ordered_stage(size_t threads, size_t max_in_flight, std::function<void(T &, size_t)> fn)
+            : work(std::move(fn)), depth(max_in_flight)
+        {
+                for (size_t i = 0; i < threads; i++)
+                        workers.emplace_back([this, i] { run(i); });
+        }
+
+        ~ordered_stage()
+        {
+                close();
+                for (auto &worker : workers)
+                        worker.join();
+        }
+
+        // Returns false if the stage was closed, e.g. because the consumer gave up
+        bool submit(T item)
+        {
+                auto entry  = std::make_shared<slot>();
+                entry->item = std::move(item);
+                std::unique_lock<std::mutex> guard(lock);
+                changed.wait(guard, [&] { return closed || in_order.size() < depth; });
+                if (closed)
+                        return false;
+                in_order.push_back(entry);
+                pending.push_back(entry);
+                changed.notify_all();
+                return true;
+        }
+
+        // No more submissions; take() drains what is left and then returns false
+        void close()
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                closed = true;
+                changed.notify_all();
+        }
+
+        bool take(T &out)
+        {
+                std::unique_lock<std::mutex> guard(lock);
+                changed.wait(guard,
+                             [&]
+                             {
+                                     return (!in_order.empty() && in_order.front()->done) ||
+                                            (closed && in_order.empty());
+                             });
+                if (in_order.empty())
+                        return false;
+                out = std::move(in_order.front()->item);
+                in_order.pop_front();
+                changed.notify_all();
+                return true;
+        }
+};
+
+// Worker count for CPU-bound stages: leave one core for the socket and disk
+inline size_t stage_threads()
+{
+        unsigned cores = std::thread::hardware_concurrency();
+        if (cores <= 2)
+                return 1;
+        return cores - 1 < 4 ? cores - 1 : 4;
+}
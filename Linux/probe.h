@@ -0,0 +1,477 @@
+#pragma once
+
+#include "aead.h"
+#include "protocol.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <functional>
+#include <iomanip>
+#include <memory>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/evp.h>
+#include <sstream>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+#include <zlib.h>
+
+// A quick look at where a transfer will spend its time, taken before it
+// starts (file_send --probe).
+//
+// Over the network the sender opens a probe connection, offered as
+// "probe|" with probe=1, and runs two phases on it:
+//
+//   ping   'p' and 8 bytes, echoed back; PROBE_PINGS times, the median is
+//          the round trip time
+//   burst  'b', then data for PROBE_BURST_MS until the sender shuts its side
+//          down; the receiver answers with the bytes it got and the
+//          microseconds between the first and the last (8 bytes each, big
+//          endian), which is the goodput, and the sender reads its own
+//          retransmissions from TCP_INFO as the loss rate
+//
+// Locally it reads a sample of the payload straight from the disk, and times
+// MD5, gzip at several levels and the ciphers on it. plan_transfer() puts the
+// numbers into a simple model of the pipeline (build the archive, hash it,
+// send it, hash it again on the other side) and picks what makes the whole
+// thing shortest.
+
+#define PROBE_PINGS 10
+#define PROBE_BURST_MS 1000
+#define PROBE_MAX_BYTES (1ull << 30)
+#define PROBE_DISK_BYTES (64 << 20)
+#define PROBE_CPU_BYTES (4 << 20)
+// Loss at which one TCP stream gives way to several, and to paced UDP
+#define PROBE_LOSSY 0.001
+#define PROBE_VERY_LOSSY 0.02
+
+struct link_report
+{
+        double rtt_ms = 0;
+        double mbit   = 0; // goodput the receiver saw
+        double loss   = 0; // retransmitted share of the segments sent
+};
+
+struct local_report
+{
+        double disk_mbit = 0; // 0 when there was nothing to read
+        double md5_mbit  = 0;
+        // gzip level -> speed (uncompressed Mbit/s) and compressed/original
+        std::vector<int> levels;
+        std::vector<double> deflate_mbit, deflate_ratio;
+        double aes_mbit = 0, chacha_mbit = 0; // 0 when not measured
+};
+
+struct transfer_plan
+{
+        int level          = Z_DEFAULT_COMPRESSION;
+        size_t streams     = 1;
+        bool udp           = false;
+        int fec_group      = 0;
+        std::string cipher_offer; // empty: leave it to cipher_preference()
+        std::string bottleneck;
+        double seconds_per_gb = 0; // model estimate, per GB of payload
+};
+
+// The kernel's tcp_info goes on past the part glibc declares; this is as far
+// as the probe needs. getsockopt() fills what the kernel has, so before
+// Linux 4.6 the counters stay zero.
+struct tcp_info_counters
+{
+        struct tcp_info known;
+        uint64_t pacing_rate, max_pacing_rate, bytes_acked, bytes_received;
+        uint32_t segs_out, segs_in, notsent_bytes, min_rtt, data_segs_in, data_segs_out;
+};
+
+// Sender side, on a connection whose handshake asked for probe=1. False if
+// the receiver stopped answering.
+inline bool probe_link(int sock, link_report &report)
+{
+        std::vector<double> rtts;
+        for (int i = 0; i < PROBE_PINGS; i++)
+        {
+                unsigned char ping[9] = {'p'}, pong[9];
+                auto sent = std::chrono::steady_clock::now();
+                put_be64(ping + 1, i);
+                if (!send_all(sock, ping, sizeof(ping)) || !recv_all(sock, pong, sizeof(pong)) ||
+                    memcmp(ping, pong, sizeof(ping)) != 0)
+                        return false;
+                rtts.push_back(std::chrono::duration<double, std::milli>(
+                                   std::chrono::steady_clock::now() - sent)
+                                   .count());
+        }
+        std::sort(rtts.begin(), rtts.end());
+        report.rtt_ms = rtts[rtts.size() / 2];
+
+        tcp_info_counters before = {};
+        socklen_t info_len       = sizeof(before);
+        getsockopt(sock, IPPROTO_TCP, TCP_INFO, &before, &info_len);
+
+        std::vector<unsigned char> chunk(256 * 1024, 0x5a);
+        chunk[0]       = 'b';
+        uint64_t total = 0;
+        auto deadline  = std::chrono::steady_clock::now() +
+                        std::chrono::milliseconds(PROBE_BURST_MS);
+        while (std::chrono::steady_clock::now() < deadline && total < PROBE_MAX_BYTES)
+        {
+                if (!send_all(sock, chunk.data(), chunk.size()))
+                        return false;
+                total += chunk.size();
+        }
+        shutdown(sock, SHUT_WR);
+
+        unsigned char result[16];
+        if (!recv_all(sock, result, sizeof(result)))
+                return false;
+        uint64_t bytes = get_be64(result), micros = get_be64(result + 8);
+        report.mbit    = micros > 0 ? bytes * 8.0 / micros : 0;
+
+        tcp_info_counters after = {};
+        info_len                = sizeof(after);
+        if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &after, &info_len) == 0)
+        {
+                double segments = after.data_segs_out - before.data_segs_out;
+                // Without the segment counter, count full-sized segments
+                if (segments <= 0 && after.known.tcpi_snd_mss)
+                        segments = double(total) / after.known.tcpi_snd_mss;
+                double resent = after.known.tcpi_total_retrans - before.known.tcpi_total_retrans;
+                report.loss = segments > 0 ? std::min(resent / segments, 1.0) : 0;
+        }
+        return true;
+}
+
+// Receiver side: answers pings and counts the burst. `progress` sees every
+// piece of the burst, so a rate limit applies to the probe too.
+inline bool answer_probe(int sock, const std::function<void(size_t)> &progress = nullptr)
+{
+        unsigned char command;
+        while (recv_all(sock, &command, 1))
+        {
+                if (command == 'p')
+                {
+                        unsigned char ping[9] = {'p'};
+                        if (!recv_all(sock, ping + 1, 8) || !send_all(sock, ping, sizeof(ping)))
+                                return false;
+                        continue;
+                }
+                if (command != 'b')
+                        return false;
+
+                std::vector<char> buffer(256 * 1024);
+                uint64_t bytes = 1;
+                auto first     = std::chrono::steady_clock::now();
+                ssize_t got;
+                while ((got = recv(sock, buffer.data(), buffer.size(), 0)) > 0)
+                {
+                        bytes += got;
+                        if (progress)
+                                progress(got);
+                }
+                if (got < 0)
+                        return false;
+                auto micros = std::chrono::duration_cast<std::chrono::microseconds>(
+                                  std::chrono::steady_clock::now() - first)
+                                  .count();
+                unsigned char result[16];
+                put_be64(result, bytes);
+                put_be64(result + 8, std::max<int64_t>(micros, 1));
+                return send_all(sock, result, sizeof(result));
+        }
+        return false;
+}
+
+// Regular files under `roots`, in walk order, until about `want` bytes
+inline std::vector<std::string> sample_files(const std::vector<std::string> &roots, uint64_t want)
+{
+        namespace fs = std::filesystem;
+        std::vector<std::string> files;
+        uint64_t found = 0;
+        for (const std::string &root : roots)
+        {
+                std::error_code ec;
+                if (fs::is_regular_file(root, ec))
+                {
+                        files.push_back(root);
+                        found += fs::file_size(root, ec);
+                }
+                for (fs::recursive_directory_iterator it(root, ec), end;
+                     !ec && it != end && found < want; it.increment(ec))
+                {
+                        if (it->is_regular_file(ec))
+                        {
+                                files.push_back(it->path());
+                                found += it->file_size(ec);
+                        }
+                }
+                if (found >= want)
+                        break;
+        }
+        return files;
+}
+
+// Reads up to PROBE_DISK_BYTES of `files` with O_DIRECT, so the page cache
+// does not flatter the disk (where O_DIRECT is refused, e.g. tmpfs, it
+// does), and keeps up to PROBE_CPU_BYTES for the CPU measurements, taken
+// from several files so one odd file does not decide the compression.
+// Returns Mbit/s, 0 if nothing could be read.
+inline double measure_disk(const std::vector<std::string> &files,
+                           std::vector<unsigned char> &sample)
+{
+        const size_t block = 1 << 20;
+        void *raw          = nullptr;
+        if (posix_memalign(&raw, 4096, block) != 0)
+                return 0;
+        std::unique_ptr<void, decltype(&free)> buffer(raw, free);
+
+        uint64_t total = 0;
+        auto started   = std::chrono::steady_clock::now();
+        for (const std::string &path : files)
+        {
+                int fd = open(path.c_str(), O_RDONLY | O_DIRECT | O_CLOEXEC);
+                if (fd < 0 && errno == EINVAL)
+                        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+                if (fd < 0)
+                        continue;
+                ssize_t got = read(fd, buffer.get(), block);
+                if (got < 0 && errno == EINVAL)
+                {
+                        // Some filesystems only refuse O_DIRECT on the read
+                        close(fd);
+                        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+                        if (fd < 0)
+                                continue;
+                        got = read(fd, buffer.get(), block);
+                }
+                size_t kept = 0;
+                for (; got > 0 && total < PROBE_DISK_BYTES; got = read(fd, buffer.get(), block))
+                {
+                        total += got;
+                        size_t room = std::min<size_t>(PROBE_CPU_BYTES - sample.size(),
+                                                       PROBE_CPU_BYTES / 8 - kept);
+                        size_t keep = std::min<size_t>(got, room);
+                        kept += keep;
+                        const unsigned char *data = static_cast<unsigned char *>(buffer.get());
+                        sample.insert(sample.end(), data, data + keep);
+                }
+                close(fd);
+                if (total >= PROBE_DISK_BYTES)
+                        break;
+        }
+        double seconds =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        return total > 0 && seconds > 0 ? total * 8 / seconds / 1e6 : 0;
+}
+
+// Runs `work` over `data` until at least `min_bytes` went through; Mbit/s
+template <typename F>
+double throughput(const std::vector<unsigned char> &data, size_t min_bytes, F work)
+{
+        if (data.empty())
+                return 0;
+        uint64_t done = 0;
+        auto started  = std::chrono::steady_clock::now();
+        while (done < min_bytes)
+        {
+                work();
+                done += data.size();
+        }
+        double seconds =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        return done * 8 / std::max(seconds, 1e-9) / 1e6;
+}
+
+// Compressed size of `data` as the archive writer would make it; the time
+// is what the caller measures
+inline size_t gzip_size(const std::vector<unsigned char> &data, int level)
+{
+        z_stream z = {};
+        if (deflateInit2(&z, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+                return data.size();
+        std::vector<unsigned char> out(deflateBound(&z, data.size()));
+        z.next_in   = const_cast<unsigned char *>(data.data());
+        z.avail_in  = data.size();
+        z.next_out  = out.data();
+        z.avail_out = out.size();
+        deflate(&z, Z_FINISH);
+        size_t size = z.total_out;
+        deflateEnd(&z);
+        return size;
+}
+
+// Seals `data` in AEAD_FRAME_SIZE frames with a throwaway key; Mbit/s
+inline double measure_cipher(const std::string &cipher, const std::vector<unsigned char> &data)
+{
+        std::vector<unsigned char> material(aead_session::material_size(), 0x42);
+        aead_session session(cipher, material);
+        frame_cipher sealer(session, true);
+        std::vector<unsigned char> frame(aead_buffer_size());
+        uint64_t seq = 0;
+        return throughput(data, PROBE_CPU_BYTES * 4,
+                          [&]
+                          {
+                                  for (size_t at = 0; at < data.size(); at += AEAD_FRAME_SIZE)
+                                  {
+                                          size_t len = std::min<size_t>(AEAD_FRAME_SIZE,
+                                                                        data.size() - at);
+                                          memcpy(frame.data() + AEAD_HEADER_SIZE,
+                                                 data.data() + at, len);
+                                          sealer.seal(seq++, frame.data(), len);
+                                  }
+                          });
+}
+
+// Disk, hash and compression speeds on a sample of `roots` (the selection,
+// or the archive itself with compress = false); ciphers with `ciphers`
+inline local_report measure_local(const std::vector<std::string> &roots, bool compress,
+                                  bool ciphers)
+{
+        local_report report;
+        std::vector<unsigned char> sample;
+        report.disk_mbit = measure_disk(sample_files(roots, PROBE_DISK_BYTES), sample);
+        if (sample.empty())
+                return report;
+
+        std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx(EVP_MD_CTX_new(),
+                                                                   EVP_MD_CTX_free);
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        report.md5_mbit = throughput(sample, PROBE_CPU_BYTES * 4,
+                                     [&]
+                                     {
+                                             EVP_DigestInit_ex(ctx.get(), EVP_md5(), nullptr);
+                                             EVP_DigestUpdate(ctx.get(), sample.data(),
+                                                              sample.size());
+                                             EVP_DigestFinal_ex(ctx.get(), digest, nullptr);
+                                     });
+
+        if (compress)
+        {
+                for (int level : {0, 1, 6, 9})
+                {
+                        size_t size = 0;
+                        report.levels.push_back(level);
+                        report.deflate_mbit.push_back(
+                            throughput(sample, 1, [&] { size = gzip_size(sample, level); }));
+                        report.deflate_ratio.push_back(double(size) / sample.size());
+                }
+        }
+        if (ciphers)
+        {
+                report.aes_mbit    = measure_cipher(CIPHER_AES_GCM, sample);
+                report.chacha_mbit = measure_cipher(CIPHER_CHACHA, sample);
+        }
+        return report;
+}
+
+// Seconds per GB of payload for each stage; the sender builds, hashes and
+// sends one after the other and the receiver hashes what it got, so the
+// stages add up (encryption overlaps the send, so only the slower counts)
+inline transfer_plan plan_transfer(const link_report &link, const local_report &local,
+                                   bool encrypted, bool can_stripe, bool can_udp)
+{
+        transfer_plan plan;
+        auto per_gb = [](double mbit) { return mbit > 0 ? 8000.0 / mbit : 0; };
+
+        double cipher = std::max(local.aes_mbit, local.chacha_mbit);
+        if (encrypted && local.aes_mbit > 0 && local.chacha_mbit > 0)
+                plan.cipher_offer = local.aes_mbit >= local.chacha_mbit
+                                        ? std::string(CIPHER_AES_GCM) + ":" + CIPHER_CHACHA
+                                        : std::string(CIPHER_CHACHA) + ":" + CIPHER_AES_GCM;
+        double wire = encrypted && cipher > 0 ? std::min(link.mbit, cipher) : link.mbit;
+
+        // Compression trades building time for bytes on the wire and in
+        // both hashes
+        std::vector<int> levels = local.levels;
+        std::vector<double> speeds = local.deflate_mbit, ratios = local.deflate_ratio;
+        if (levels.empty())
+        {
+                levels = {Z_DEFAULT_COMPRESSION};
+                speeds = {0};
+                ratios = {1};
+        }
+        double best = -1, build_time = 0, hash_time = 0, send_time = 0;
+        for (size_t i = 0; i < levels.size(); i++)
+        {
+                // Without a link measurement there is nothing to trade against
+                if (link.mbit <= 0 && levels.size() > 1 && levels[i] != 6)
+                        continue;
+                double build = std::max(per_gb(local.disk_mbit), per_gb(speeds[i]));
+                double hash  = 2 * ratios[i] * per_gb(local.md5_mbit);
+                double send  = ratios[i] * per_gb(wire);
+                if (best < 0 || build + hash + send < best)
+                {
+                        best       = build + hash + send;
+                        plan.level = levels[i];
+                        build_time = build;
+                        hash_time  = hash;
+                        send_time  = send;
+                }
+        }
+        plan.seconds_per_gb = best;
+        if (send_time >= build_time && send_time >= hash_time)
+                plan.bottleneck =
+                    encrypted && cipher > 0 && cipher < link.mbit ? "encryption" : "network";
+        else if (build_time >= hash_time)
+                plan.bottleneck = local.disk_mbit > 0 && per_gb(local.disk_mbit) >= build_time
+                                      ? "disk"
+                                      : "compression";
+        else
+                plan.bottleneck = "hashing";
+
+        // A lossy path holds one TCP stream to a fraction of the link; only
+        // worth fighting when the network is what we wait for
+        if (plan.bottleneck == "network" && link.loss >= PROBE_VERY_LOSSY && can_udp)
+        {
+                plan.udp       = true;
+                plan.fec_group = 16;
+        }
+        else if (plan.bottleneck == "network" && link.loss >= PROBE_LOSSY && can_stripe)
+                plan.streams = link.loss >= PROBE_LOSSY * 5 ? 4 : 2;
+        return plan;
+}
+
+inline std::string describe(const link_report &link)
+{
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(2) << "rtt " << link.rtt_ms << " ms, " << link.mbit
+            << " Mbit/s, loss " << link.loss * 100 << "%";
+        return out.str();
+}
+
+inline std::string describe(const local_report &local)
+{
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(0) << "disk " << local.disk_mbit << " Mbit/s, md5 "
+            << local.md5_mbit << " Mbit/s";
+        for (size_t i = 0; i < local.levels.size(); i++)
+                out << ", gzip -" << local.levels[i] << " " << local.deflate_mbit[i] << " Mbit/s ("
+                    << int(local.deflate_ratio[i] * 100 + 0.5) << "%)";
+        if (local.aes_mbit > 0)
+                out << ", " CIPHER_AES_GCM " " << local.aes_mbit << " Mbit/s, " CIPHER_CHACHA " "
+                    << local.chacha_mbit << " Mbit/s";
+        return out.str();
+}
+
+inline std::string describe(const transfer_plan &plan, bool compressed)
+{
+        std::ostringstream out;
+        if (compressed)
+                out << "gzip level " << (plan.level < 0 ? 6 : plan.level) << ", ";
+        if (plan.udp)
+                out << "paced UDP with one parity datagram per " << plan.fec_group;
+        else
+                out << plan.streams << " TCP stream" << (plan.streams > 1 ? "s" : "");
+        if (!plan.cipher_offer.empty())
+                out << ", " << plan.cipher_offer.substr(0, plan.cipher_offer.find(':'));
+        if (!plan.bottleneck.empty())
+                out << "; limited by " << plan.bottleneck << ", about " << std::fixed
+                    << std::setprecision(1) << plan.seconds_per_gb << " s per GB";
+        return out.str();
+}
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Wire helpers shared by file_send and file_recieve.
+//
+// The handshake is a single message each way. The sender sends
+// "filename|md5[|key=value,...]" and the receiver answers "hello[|key=value,...]".
+// Options a side does not know are ignored, so a plain transfer still looks
+// exactly like it always did.
+
+using transfer_options = std::map<std::string, std::string>;
+
+inline std::string format_options(const transfer_options &options)
+{
+        std::string out;
+        for (const auto &option : options)
+        {
+                if (!out.empty())
+                        out += ",";
+                out += option.first + "=" + option.second;
+        }
+        return out;
+}
+
+inline transfer_options parse_options(const std::string &text)
+{
+        transfer_options options;
+        size_t start = 0;
+        while (start < text.size())
+        {
+                size_t end = text.find(',', start);
+                if (end == std::string::npos)
+                        end = text.size();
+                std::string item = text.substr(start, end - start);
+                size_t eq        = item.find('=');
+                if (eq == std::string::npos)
+                        options[item] = "";
+                else
+                        options[item.substr(0, eq)] = item.substr(eq + 1);
+                start = end + 1;
+        }
+        return options;
+}
+
+inline std::string option_or(const transfer_options &options, const std::string &key,
+                             const std::string &fallback)
+{
+        auto it = options.find(key);
+        return it == options.end() ? fallback : it->second;
+}
+
+inline bool send_all(int sock, const void *data, size_t len)
+{
+        const char *pos = static_cast<const char *>(data);
+        while (len > 0)
+        {
+                ssize_t sent = send(sock, pos, len, MSG_NOSIGNAL);
+                if (sent < 0)
+                {
+                        if (errno == EINTR)
+                                continue;
+                        return false;
+                }
+                pos += sent;
+                len -= sent;
+        }
+        return true;
+}
+
+// Returns false on error or if the peer closed before len bytes arrived
+inline bool recv_all(int sock, void *data, size_t len)
+{
+        char *pos = static_cast<char *>(data);
+        while (len > 0)
+        {
+                ssize_t got = recv(sock, pos, len, 0);
+                if (got < 0 && errno == EINTR)
+                        continue;
+                if (got <= 0)
+                        return false;
+                pos += got;
+                len -= got;
+        }
+        return true;
+}
+
+// write() until everything is out; false on error (EPIPE when the reader of
+// a pipe went away)
+inline bool write_all(int fd, const void *data, size_t len)
+{
+        const char *pos = static_cast<const char *>(data);
+        while (len > 0)
+        {
+                ssize_t wrote = write(fd, pos, len);
+                if (wrote < 0)
+                {
+                        if (errno == EINTR)
+                                continue;
+                        return false;
+                }
+                pos += wrote;
+                len -= wrote;
+        }
+        return true;
+}
+
+inline void put_be32(unsigned char *out, uint32_t value)
+{
+        for (int i = 3; i >= 0; i--, value >>= 8)
+                out[i] = value & 0xff;
+}
+
+inline uint32_t get_be32(const unsigned char *in)
+{
+        return (uint32_t(in[0]) << 24) | (uint32_t(in[1]) << 16) | (uint32_t(in[2]) << 8) | in[3];
+}
+
+inline void put_be64(unsigned char *out, uint64_t value)
+{
+        for (int i = 7; i >= 0; i--, value >>= 8)
+                out[i] = value & 0xff;
+}
+
+inline uint64_t get_be64(const unsigned char *in)
+{
+        return (uint64_t(get_be32(in)) << 32) | get_be32(in + 4);
+}
+
+inline std::string to_hex(const unsigned char *data, size_t len)
+{
+        static const char digits[] = "0123456789abcdef";
+        std::string out;
+        for (size_t i = 0; i < len; i++)
+        {
+                out += digits[data[i] >> 4];
+                out += digits[data[i] & 0xf];
+        }
+        return out;
+}
+
+inline std::string from_hex(const std::string &text)
+{
+        auto nibble = [](char c) -> int
+        {
+                if (c >= '0' && c <= '9')
+                        return c - '0';
+                if (c >= 'a' && c <= 'f')
+                        return c - 'a' + 10;
+                if (c >= 'A' && c <= 'F')
+                        return c - 'A' + 10;
+                return -1;
+        };
+        std::string out;
+        for (size_t i = 0; i + 1 < text.size(); i += 2)
+        {
+                int hi = nibble(text[i]), lo = nibble(text[i + 1]);
+                if (hi < 0 || lo < 0)
+                        return "";
+                out += char(hi << 4 | lo);
+        }
+        return out;
+}
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <thread>
+
+// Bandwidth shaping for what a process sends. A token_bucket caps the rate,
+// with a burst allowance, and can be changed while transfers run. When
+// several transfers share the bucket a flow_scheduler decides who gets the
+// next tokens: strictly by priority class first, then weighted fair queueing
+// inside a class. A small urgent transfer overtakes bulk ones, and bulk
+// transfers split whatever is left in proportion to their weights.
+//
+// Senders ask for SHAPER_QUANTUM bytes at a time, which bounds how long a
+// higher-priority flow waits behind one that was just granted.
+
+#define SHAPER_QUANTUM (64 * 1024)
+
+class token_bucket
+{
+      private:
+        mutable std::mutex lock;
+        double rate   = 0; // bytes per second, 0 for no limit
+        double burst  = 0;
+        double tokens = 0;
+        std::chrono::steady_clock::time_point last;
+
+        void refill()
+        {
+                auto now       = std::chrono::steady_clock::now();
+                double elapsed = std::chrono::duration<double>(now - last).count();
+                tokens         = std::min(tokens + elapsed * rate, burst);
+                last           = now;
+        }
+
+      public:
+        // burst 0 allows 50 ms worth of traffic, at least SHAPER_QUANTUM
+        explicit token_bucket(double bytes_per_second = 0, double burst_bytes = 0)
+            : last(std::chrono::steady_clock::now())
+        {
+                set_rate(bytes_per_second, burst_bytes);
+                tokens = burst;
+        }
+
+        // Takes effect for the next request; transfers keep running
+        void set_rate(double bytes_per_second, double burst_bytes = 0)
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                refill();
+                rate   = std::max(bytes_per_second, 0.0);
+                burst  = burst_bytes > 0 ? burst_bytes
+                                         : std::max(rate * 0.05, double(SHAPER_QUANTUM));
+                tokens = std::min(tokens, burst);
+        }
+
+        double bytes_per_second() const
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                return rate;
+        }
+
+        // Takes `bytes` and returns 0, or returns how many microseconds to
+        // wait before asking again. A request may overdraw the bucket as long
+        // as it is not already in debt, so requests larger than the burst
+        // still go through, at the average rate.
+        int64_t try_take(size_t bytes)
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                if (rate <= 0)
+                        return 0;
+                refill();
+                if (tokens >= 0)
+                {
+                        tokens -= bytes;
+                        return 0;
+                }
+                return std::max<int64_t>(1, int64_t(-tokens / rate * 1e6));
+        }
+
+        void take(size_t bytes)
+        {
+                int64_t wait_us;
+                while ((wait_us = try_take(bytes)) > 0)
+                        std::this_thread::sleep_for(std::chrono::microseconds(wait_us));
+        }
+};
+
+// Self-clocked fair queueing over one token bucket. Every request is tagged
+// with a virtual finish time, max(now, the flow's previous finish) plus its
+// size over the flow's weight; among the flows waiting in the highest
+// priority class the smallest tag goes next.
+class flow_scheduler
+{
+      private:
+        struct flow
+        {
+                int priority  = 0;
+                double weight = 1;
+                double finish = 0;
+                double tag    = 0;
+                bool waiting  = false;
+        };
+
+        token_bucket &bucket;
+        std::mutex lock;
+        std::condition_variable changed;
+        std::map<int, flow> flows;
+        int next_id         = 0;
+        double virtual_time = 0;
+
+        bool is_next(int id) const
+        {
+                const flow &me = flows.at(id);
+                for (const auto &other : flows)
+                {
+                        const flow &f = other.second;
+                        if (!f.waiting || other.first == id)
+                                continue;
+                        if (f.priority > me.priority ||
+                            (f.priority == me.priority &&
+                             (f.tag < me.tag || (f.tag == me.tag && other.first < id))))
+                                return false;
+                }
+                return true;
+        }
+
+      public:
+        explicit flow_scheduler(token_bucket &shared) : bucket(shared) {}
+
+        // Higher priorities are served first; within a priority, flows share
+        // in proportion to weight
+        int add_flow(int priority = 0, double weight = 1)
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                flow f;
+                f.priority     = priority;
+                f.weight       = std::max(weight, 1e-3);
+                f.finish       = virtual_time;
+                flows[next_id] = f;
+                return next_id++;
+        }
+
+        void remove_flow(int id)
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                flows.erase(id);
+                changed.notify_all();
+        }
+
+        void set_priority(int id, int priority, double weight = 1)
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                auto it = flows.find(id);
+                if (it == flows.end())
+                        return;
+                it->second.priority = priority;
+                it->second.weight   = std::max(weight, 1e-3);
+                changed.notify_all();
+        }
+
+        token_bucket &limiter() { return bucket; }
+
+        // Blocks until `bytes` may be sent on flow `id`
+        void acquire(int id, size_t bytes)
+        {
+                std::unique_lock<std::mutex> guard(lock);
+                flow &me   = flows.at(id);
+                me.tag     = std::max(virtual_time, me.finish) + bytes / me.weight;
+                me.waiting = true;
+                while (true)
+                {
+                        if (!is_next(id))
+                        {
+                                changed.wait(guard);
+                                continue;
+                        }
+                        int64_t wait_us = bucket.try_take(bytes);
+                        if (wait_us == 0)
+                                break;
+                        // Someone more urgent may turn up meanwhile
+                        changed.wait_for(guard, std::chrono::microseconds(wait_us));
+                }
+                me.waiting   = false;
+                me.finish    = me.tag;
+                virtual_time = std::max(virtual_time, me.tag);
+                changed.notify_all();
+        }
+};
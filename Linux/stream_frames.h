@@ -0,0 +1,147 @@
+#pragma once
+
+#include "protocol.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <openssl/evp.h>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+// Payloads of unknown length, e.g. `zfs send | file_send --stdin`. Nothing is
+// staged on disk and no size is announced: the sender frames whatever it
+// reads as chunks of a 4-byte big-endian length and that many bytes. A
+// zero-length chunk ends the stream and is followed by the MD5 of everything
+// before it, which the receiver checks against its own running hash.
+//
+// Either side holds one chunk at a time, so memory stays at STREAM_CHUNK_SIZE
+// however long the stream runs.
+
+#define STREAM_HEADER_SIZE 4
+#define STREAM_CHUNK_SIZE (256 * 1024)
+#define STREAM_DIGEST_SIZE 16
+
+// MD5 updated piece by piece
+class running_md5
+{
+      private:
+        std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx;
+
+      public:
+        running_md5() : ctx(EVP_MD_CTX_new(), EVP_MD_CTX_free)
+        {
+                if (!ctx || EVP_DigestInit_ex(ctx.get(), EVP_md5(), nullptr) != 1)
+                        throw std::runtime_error("Failed to initialise md5");
+        }
+
+        void update(const void *data, size_t len) { EVP_DigestUpdate(ctx.get(), data, len); }
+
+        // The digest of everything so far; the hash cannot be updated after
+        std::string finish()
+        {
+                unsigned char out[EVP_MAX_MD_SIZE];
+                unsigned int out_len = 0;
+                EVP_DigestFinal_ex(ctx.get(), out, &out_len);
+                return std::string(reinterpret_cast<char *>(out), out_len);
+        }
+};
+
+// Frames chunks written in place at data() and hands them to `send`, which
+// lets the caller pace them
+class stream_writer
+{
+      private:
+        std::function<bool(const void *, size_t)> send;
+        std::vector<unsigned char> buffer;
+        running_md5 md5;
+        uint64_t total = 0;
+
+      public:
+        explicit stream_writer(std::function<bool(const void *, size_t)> send_chunk)
+            : send(std::move(send_chunk)), buffer(STREAM_HEADER_SIZE + STREAM_CHUNK_SIZE)
+        {
+        }
+
+        // Room for up to STREAM_CHUNK_SIZE bytes of the next chunk
+        unsigned char *data() { return buffer.data() + STREAM_HEADER_SIZE; }
+
+        // Sends the first `len` bytes at data(); an empty chunk sends nothing,
+        // the end is only marked by finish()
+        bool commit(size_t len)
+        {
+                if (len == 0)
+                        return true;
+                put_be32(buffer.data(), len);
+                md5.update(data(), len);
+                total += len;
+                return send(buffer.data(), STREAM_HEADER_SIZE + len);
+        }
+
+        // The end marker and the digest
+        bool finish()
+        {
+                unsigned char trailer[STREAM_HEADER_SIZE + STREAM_DIGEST_SIZE] = {};
+                std::string digest = md5.finish();
+                digest.copy(reinterpret_cast<char *>(trailer + STREAM_HEADER_SIZE),
+                            STREAM_DIGEST_SIZE);
+                return send(trailer, sizeof(trailer));
+        }
+
+        // Payload sent so far
+        uint64_t bytes() const { return total; }
+};
+
+// Reads one framed stream from a socket
+class stream_reader
+{
+      private:
+        int sock;
+        std::vector<unsigned char> buffer;
+        running_md5 md5;
+        uint64_t total = 0;
+        bool ended     = false;
+
+      public:
+        explicit stream_reader(int socket) : sock(socket), buffer(STREAM_CHUNK_SIZE) {}
+
+        // The next chunk, valid until the next call. False once the stream
+        // ended and its digest matched; throws if the connection drops first,
+        // a chunk is malformed or the digest is wrong.
+        bool next(const unsigned char *&data, size_t &len)
+        {
+                if (ended)
+                        return false;
+                unsigned char header[STREAM_HEADER_SIZE];
+                if (!recv_all(sock, header, sizeof(header)))
+                        throw std::runtime_error("Stream ended early after " +
+                                                 std::to_string(total) + " bytes");
+                len = get_be32(header);
+                if (len > STREAM_CHUNK_SIZE)
+                        throw std::runtime_error("Stream chunk of " + std::to_string(len) +
+                                                 " bytes is too large");
+                if (len == 0)
+                {
+                        char digest[STREAM_DIGEST_SIZE];
+                        if (!recv_all(sock, digest, sizeof(digest)))
+                                throw std::runtime_error("Stream ended before its hash");
+                        ended = true;
+                        if (md5.finish() != std::string(digest, sizeof(digest)))
+                                throw std::runtime_error("Stream hash mismatch");
+                        return false;
+                }
+                if (!recv_all(sock, buffer.data(), len))
+                        throw std::runtime_error("Stream ended early after " +
+                                                 std::to_string(total) + " bytes");
+                md5.update(buffer.data(), len);
+                total += len;
+                data = buffer.data();
+                return true;
+        }
+
+        // Payload received so far
+        uint64_t bytes() const { return total; }
+};
@@ -0,0 +1,865 @@
+#pragma once
+
+#include "dir_walker.h"
+#include "landing.h"
+#include "pipeline.h"
+#include "protocol.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <exception>
+#include <fcntl.h>
+#include <map>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include <zlib.h>
+
+// Native tar.gz writing from a dir_walker manifest, so building an archive
+// no longer means copying the selection to a temporary directory and
+// running tar over it. The output is plain ustar, gzip-compressed with zlib,
+// and extracts with `tar -xzf`; a name, link target or number that does not
+// fit a ustar field goes into a pax extended header in front of the entry.
+// The receiving side reads the same format back and materializes it on a
+// pool of threads instead of running `tar -xzf`.
+
+#define TAR_BLOCK 512
+#define TAR_READ_AHEAD (1 << 20)
+
+class tar_writer
+{
+      private:
+        gzFile out;
+        uint64_t total = 0;
+        // First path seen for each (device, inode) with more than one link
+        std::map<std::pair<uint64_t, uint64_t>, std::string> links;
+
+        void write(const void *data, size_t len)
+        {
+                if (len > 0 && gzwrite(out, data, len) != int(len))
+                        throw std::runtime_error("Failed to write archive");
+                total += len;
+        }
+
+        void pad(uint64_t len)
+        {
+                static const char zeros[TAR_BLOCK] = {};
+                if (len % TAR_BLOCK)
+                        write(zeros, TAR_BLOCK - len % TAR_BLOCK);
+        }
+
+        // width - 1 octal digits and a NUL; false if the value does not fit
+        static bool put_octal(char *field, size_t width, uint64_t value)
+        {
+                if (value >> (3 * (width - 1)) != 0)
+                        return false;
+                snprintf(field, width, "%0*llo", int(width - 1), (unsigned long long)value);
+                return true;
+        }
+
+        // "<length> key=value\n", where the length counts its own digits
+        static std::string pax_record(const std::string &key, const std::string &value)
+        {
+                size_t base = key.size() + value.size() + 3;
+                size_t len  = base + 1;
+                while (std::to_string(len).size() + base != len)
+                        len = std::to_string(len).size() + base;
+                return std::to_string(len) + " " + key + "=" + value + "\n";
+        }
+
+        void header(const manifest_entry &entry, char type, uint64_t size, const std::string &link)
+        {
+                char block[TAR_BLOCK] = {};
+                std::string pax;
+                if (entry.path.size() > 100)
+                        pax += pax_record("path", entry.path);
+                if (link.size() > 100)
+                        pax += pax_record("linkpath", link);
+                if (!put_octal(block + 124, 12, size))
+                        pax += pax_record("size", std::to_string(size));
+                if (!put_octal(block + 108, 8, entry.uid))
+                        pax += pax_record("uid", std::to_string(entry.uid));
+                if (!put_octal(block + 116, 8, entry.gid))
+                        pax += pax_record("gid", std::to_string(entry.gid));
+
+                if (!pax.empty())
+                {
+                        manifest_entry meta;
+                        std::string base = entry.path.substr(entry.path.find_last_of('/') + 1);
+                        meta.path        = ("PaxHeader/" + base).substr(0, 100);
+                        meta.mode        = 0644;
+                        header(meta, 'x', pax.size(), "");
+                        write(pax.data(), pax.size());
+                        pad(pax.size());
+                }
+
+                memcpy(block, entry.path.data(), std::min<size_t>(entry.path.size(), 100));
+                put_octal(block + 100, 8, entry.mode & 07777);
+                put_octal(block + 136, 12, entry.mtime < 0 ? 0 : entry.mtime);
+                block[156] = type;
+                memcpy(block + 157, link.data(), std::min<size_t>(link.size(), 100));
+                memcpy(block + 257, "ustar", 6);
+                memcpy(block + 263, "00", 2);
+
+                unsigned sum = 0;
+                memset(block + 148, ' ', 8);
+                for (unsigned char c : block)
+                        sum += c;
+                snprintf(block + 148, 8, "%06o", sum);
+                write(block, TAR_BLOCK);
+        }
+
+      public:
+        // level is the zlib compression level, 0 (store) to 9
+        tar_writer(const std::string &path, int level)
+        {
+                std::string mode = "wb" + std::to_string(std::min(std::max(level, 0), 9));
+                out = gzopen(path.c_str(), mode.c_str());
+                if (!out)
+                        throw std::runtime_error("Failed to create " + path);
+                gzbuffer(out, 256 * 1024);
+        }
+
+        ~tar_writer()
+        {
+                if (out)
+                        gzclose(out);
+        }
+
+        tar_writer(const tar_writer &)            = delete;
+        tar_writer &operator=(const tar_writer &) = delete;
+
+        // Adds one manifest entry. Regular file contents come from `data` when
+        // the caller already read them, otherwise from `fd` (size bytes; a
+        // file that shrank meanwhile is padded with zeros). Returns false for
+        // types tar cannot carry (sockets, devices).
+        bool add(const manifest_entry &entry, const std::vector<unsigned char> *data, int fd)
+        {
+                if (S_ISDIR(entry.mode))
+                {
+                        manifest_entry dir = entry;
+                        dir.path += "/";
+                        header(dir, '5', 0, "");
+                        return true;
+                }
+                if (S_ISLNK(entry.mode))
+                {
+                        header(entry, '2', 0, entry.link);
+                        return true;
+                }
+                if (S_ISFIFO(entry.mode))
+                {
+                        header(entry, '6', 0, "");
+                        return true;
+                }
+                if (!S_ISREG(entry.mode))
+                        return false;
+
+                if (entry.nlink > 1)
+                {
+                        auto key  = std::make_pair(entry.dev, entry.ino);
+                        auto seen = links.find(key);
+                        if (seen != links.end())
+                        {
+                                header(entry, '1', 0, seen->second);
+                                return true;
+                        }
+                        links[key] = entry.path;
+                }
+
+                header(entry, '0', entry.size, "");
+                uint64_t done = 0;
+                if (data)
+                {
+                        done = std::min<uint64_t>(data->size(), entry.size);
+                        write(data->data(), done);
+                }
+                else
+                {
+                        std::vector<unsigned char> buffer(TAR_READ_AHEAD);
+                        while (done < entry.size)
+                        {
+                                size_t want = std::min<uint64_t>(buffer.size(), entry.size - done);
+                                ssize_t got = read(fd, buffer.data(), want);
+                                if (got <= 0)
+                                        break;
+                                write(buffer.data(), got);
+                                done += got;
+                        }
+                }
+                static const unsigned char zeros[TAR_BLOCK] = {};
+                for (uint64_t left = entry.size - done; left > 0;)
+                {
+                        size_t len = std::min<uint64_t>(left, TAR_BLOCK);
+                        write(zeros, len);
+                        left -= len;
+                }
+                pad(entry.size);
+                return done == entry.size;
+        }
+
+        // End-of-archive marker; returns the uncompressed size
+        uint64_t finish()
+        {
+                static const char zeros[2 * TAR_BLOCK] = {};
+                write(zeros, sizeof(zeros));
+                int status = gzclose(out);
+                out        = nullptr;
+                if (status != Z_OK)
+                        throw std::runtime_error("Failed to write archive");
+                return total;
+        }
+};
+
+// A manifest entry on its way to the writer, with small files already read
+struct tar_item
+{
+        size_t index = 0;
+        std::vector<unsigned char> data;
+        bool loaded = false;
+        int error   = 0;
+};
+
+// Writes the manifest to `path`. Files up to TAR_READ_AHEAD are read on a
+// pool of threads while the compressor works, so it never waits on one
+// open()/read() at a time; bigger files are streamed by the writer itself.
+// Entries that could not be read are skipped and listed in `errors`.
+inline uint64_t write_archive(const std::string &path, const std::vector<manifest_entry> &entries,
+                              int level, std::vector<std::string> &errors)
+{
+        tar_writer writer(path, level);
+        ordered_stage<tar_item> stage(
+            walker_threads(), walker_threads() * 8,
+            [&](tar_item &item, size_t)
+            {
+                    const manifest_entry &entry = entries[item.index];
+                    if (!S_ISREG(entry.mode) || entry.size > TAR_READ_AHEAD || entry.nlink > 1)
+                            return;
+                    int fd = open(entry.source.c_str(), O_RDONLY | O_CLOEXEC | O_NOATIME);
+                    if (fd < 0 && errno == EPERM)
+                            fd = open(entry.source.c_str(), O_RDONLY | O_CLOEXEC);
+                    if (fd < 0)
+                    {
+                            item.error = errno;
+                            return;
+                    }
+                    item.data.resize(entry.size);
+                    size_t done = 0;
+                    while (done < entry.size)
+                    {
+                            ssize_t got = read(fd, item.data.data() + done, entry.size - done);
+                            if (got <= 0)
+                                    break;
+                            done += got;
+                    }
+                    item.data.resize(done);
+                    item.loaded = true;
+                    close(fd);
+            });
+
+        std::thread feeder(
+            [&]
+            {
+                    for (size_t i = 0; i < entries.size(); i++)
+                    {
+                            tar_item item;
+                            item.index = i;
+                            if (!stage.submit(std::move(item)))
+                                    break;
+                    }
+                    stage.close();
+            });
+
+        tar_item item;
+        try
+        {
+                while (stage.take(item))
+                {
+                        const manifest_entry &entry = entries[item.index];
+                        if (item.error)
+                        {
+                                errors.push_back(entry.source + ": " + strerror(item.error));
+                                continue;
+                        }
+                        int fd = -1;
+                        if (S_ISREG(entry.mode) && !item.loaded)
+                        {
+                                fd = open(entry.source.c_str(), O_RDONLY | O_CLOEXEC);
+                                if (fd < 0)
+                                {
+                                        errors.push_back(entry.source + ": " + strerror(errno));
+                                        continue;
+                                }
+                                posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+                        }
+                        bool complete = writer.add(entry, item.loaded ? &item.data : nullptr, fd);
+                        if (fd >= 0)
+                                close(fd);
+                        if (!complete && S_ISREG(entry.mode))
+                                errors.push_back(entry.source + ": file changed as we read it");
+                        else if (!complete)
+                                errors.push_back(entry.source + ": special file ignored");
+                }
+        }
+        catch (...)
+        {
+                stage.close();
+                feeder.join();
+                throw;
+        }
+        feeder.join();
+        return writer.finish();
+}
+
+// One entry as read back from an archive; type is the tar typeflag
+struct tar_entry
+{
+        std::string path;
+        std::string link;
+        char type           = '0';
+        uint32_t mode       = 0;
+        uint32_t uid        = 0;
+        uint32_t gid        = 0;
+        uint64_t size       = 0;
+        int64_t mtime       = 0;
+        uint32_t mtime_nsec = 0;
+        uint32_t dev_major  = 0;
+        uint32_t dev_minor  = 0;
+};
+
+// Reads ustar archives with pax extended headers, as tar_writer and GNU tar
+// write them, plus GNU long name records, one entry after another
+class tar_reader
+{
+      private:
+        gzFile in;
+        uint64_t remaining = 0; // content of the current entry not read yet
+        uint64_t padding   = 0;
+
+        void read_exact(void *data, size_t len)
+        {
+                if (len > 0 && gzread(in, data, len) != int(len))
+                        throw std::runtime_error("Truncated archive");
+        }
+
+        void skip(uint64_t len)
+        {
+                char buffer[64 * 1024];
+                while (len > 0)
+                {
+                        size_t part = std::min<uint64_t>(len, sizeof(buffer));
+                        read_exact(buffer, part);
+                        len -= part;
+                }
+        }
+
+        // Octal, or GNU base-256 when the top bit of the first byte is set
+        static uint64_t get_number(const char *field, size_t width)
+        {
+                uint64_t value = 0;
+                if ((unsigned char)field[0] & 0x80)
+                {
+                        value = (unsigned char)field[0] & 0x7f;
+                        for (size_t i = 1; i < width; i++)
+                                value = value << 8 | (unsigned char)field[i];
+                        return value;
+                }
+                size_t i = 0;
+                while (i < width && field[i] == ' ')
+                        i++;
+                for (; i < width && field[i] >= '0' && field[i] <= '7'; i++)
+                        value = value << 3 | (field[i] - '0');
+                return value;
+        }
+
+        static std::string get_string(const char *field, size_t width)
+        {
+                return std::string(field, strnlen(field, width));
+        }
+
+        // Body of a pax or GNU long name record
+        std::string read_record(uint64_t size)
+        {
+                if (size > TAR_READ_AHEAD)
+                        throw std::runtime_error("Corrupt archive: oversized extended header");
+                std::string data(size, '\0');
+                read_exact(&data[0], size);
+                skip((TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK);
+                return data;
+        }
+
+        static void parse_pax(const std::string &data, std::map<std::string, std::string> &pax)
+        {
+                size_t pos = 0;
+                while (pos < data.size())
+                {
+                        size_t len   = strtoull(data.c_str() + pos, nullptr, 10);
+                        size_t space = data.find(' ', pos);
+                        if (len == 0 || pos + len > data.size() || space == std::string::npos ||
+                            space >= pos + len)
+                                throw std::runtime_error("Corrupt archive: bad pax record");
+                        std::string record = data.substr(space + 1, pos + len - space - 2);
+                        size_t equals      = record.find('=');
+                        if (equals != std::string::npos)
+                                pax[record.substr(0, equals)] = record.substr(equals + 1);
+                        pos += len;
+                }
+        }
+
+      public:
+        explicit tar_reader(const std::string &path)
+        {
+                in = gzopen(path.c_str(), "rb");
+                if (!in)
+                        throw std::runtime_error("Failed to open " + path);
+                gzbuffer(in, 256 * 1024);
+        }
+
+        ~tar_reader() { gzclose(in); }
+
+        tar_reader(const tar_reader &)            = delete;
+        tar_reader &operator=(const tar_reader &) = delete;
+
+        // The next entry; false at the end of the archive. Whatever was not
+        // read of the previous entry's content is skipped.
+        bool next(tar_entry &entry)
+        {
+                skip(remaining + padding);
+                remaining = padding = 0;
+
+                std::map<std::string, std::string> pax;
+                std::string long_name, long_link;
+                char block[TAR_BLOCK];
+                while (true)
+                {
+                        int got = gzread(in, block, TAR_BLOCK);
+                        if (got == 0)
+                                return false;
+                        if (got != TAR_BLOCK)
+                                throw std::runtime_error("Truncated archive");
+                        if (std::all_of(block, block + TAR_BLOCK, [](char c) { return c == 0; }))
+                                return false;
+
+                        unsigned sum = 0;
+                        for (int i = 0; i < TAR_BLOCK; i++)
+                                sum += (i >= 148 && i < 156) ? ' ' : (unsigned char)block[i];
+                        if (sum != get_number(block + 148, 8))
+                                throw std::runtime_error("Corrupt archive: bad header checksum");
+
+                        entry      = tar_entry();
+                        entry.type = block[156] ? block[156] : '0';
+                        entry.size = get_number(block + 124, 12);
+                        if (entry.type == 'x' || entry.type == 'g')
+                        {
+                                std::string data = read_record(entry.size);
+                                if (entry.type == 'x')
+                                        parse_pax(data, pax);
+                                continue;
+                        }
+                        if (entry.type == 'L' || entry.type == 'K')
+                        {
+                                std::string data = read_record(entry.size);
+                                (entry.type == 'L' ? long_name : long_link) = data.c_str();
+                                continue;
+                        }
+                        break;
+                }
+
+                entry.path = get_string(block, 100);
+                if (memcmp(block + 257, "ustar", 6) == 0 && block[345])
+                        entry.path = get_string(block + 345, 155) + "/" + entry.path;
+                entry.link      = get_string(block + 157, 100);
+                entry.mode      = get_number(block + 100, 8);
+                entry.uid       = get_number(block + 108, 8);
+                entry.gid       = get_number(block + 116, 8);
+                entry.mtime     = get_number(block + 136, 12);
+                entry.dev_major = get_number(block + 329, 8);
+                entry.dev_minor = get_number(block + 337, 8);
+                if (!long_name.empty())
+                        entry.path = long_name;
+                if (!long_link.empty())
+                        entry.link = long_link;
+                for (const auto &record : pax)
+                {
+                        const char *value = record.second.c_str();
+                        if (record.first == "path")
+                                entry.path = record.second;
+                        else if (record.first == "linkpath")
+                                entry.link = record.second;
+                        else if (record.first == "size")
+                                entry.size = strtoull(value, nullptr, 10);
+                        else if (record.first == "uid")
+                                entry.uid = strtoul(value, nullptr, 10);
+                        else if (record.first == "gid")
+                                entry.gid = strtoul(value, nullptr, 10);
+                        else if (record.first == "mtime")
+                        {
+                                char *end;
+                                entry.mtime = strtoll(value, &end, 10);
+                                if (*end == '.')
+                                {
+                                        std::string digits = std::string(end + 1).substr(0, 9);
+                                        digits.resize(9, '0');
+                                        entry.mtime_nsec = strtoul(digits.c_str(), nullptr, 10);
+                                }
+                        }
+                }
+
+                // Links, devices, directories and fifos carry no data blocks
+                if (strchr("123456", entry.type))
+                        entry.size = 0;
+                remaining = entry.size;
+                padding   = (TAR_BLOCK - entry.size % TAR_BLOCK) % TAR_BLOCK;
+                return true;
+        }
+
+        // Up to `len` bytes of the current entry's content; 0 once it is all read
+        size_t read(void *data, size_t len)
+        {
+                len = std::min<uint64_t>(len, remaining);
+                read_exact(data, len);
+                remaining -= len;
+                return len;
+        }
+};
+
+// An archive name as a path below the extraction directory: leading slashes
+// and "." components are dropped, as tar does. False for names with ".."
+// components, which could climb out of it.
+inline bool tar_relative_path(const std::string &name, std::string &out)
+{
+        out.clear();
+        size_t start = 0;
+        while (start <= name.size())
+        {
+                size_t end = std::min(name.find('/', start), name.size());
+                std::string part = name.substr(start, end - start);
+                if (part == "..")
+                        return false;
+                if (!part.empty() && part != ".")
+                        out += (out.empty() ? "" : "/") + part;
+                start = end + 1;
+        }
+        return true;
+}
+
+// The process umask, read without changing it: umask() can only be queried
+// by setting it, which would briefly hand other threads a umask of 0. Read
+// once; 022 if the kernel does not report it.
+inline mode_t process_umask()
+{
+        static const mode_t mask = []
+        {
+                unsigned int value = 022;
+                FILE *status       = fopen("/proc/self/status", "re");
+                if (!status)
+                        return mode_t(value);
+                char line[256];
+                while (fgets(line, sizeof(line), status))
+                        if (sscanf(line, "Umask: %o", &value) == 1)
+                                break;
+                fclose(status);
+                return mode_t(value & 0777);
+        }();
+        return mask;
+}
+
+// A file on its way to the extraction pool, with its contents already read
+struct extract_job
+{
+        tar_entry entry;
+        std::string path;
+        std::vector<unsigned char> data;
+        int error = 0;
+};
+
+class tar_extractor
+{
+      private:
+        int root;
+        mode_t mask;
+        bool owner;
+        std::set<std::string> made; // directories known to exist
+        std::vector<tar_entry> dirs, links;
+        std::vector<std::string> failures;
+
+        void fail(const std::string &path, int error)
+        {
+                failures.push_back(path + ": " + strerror(error));
+        }
+
+        // mkdir -p of the directories above `path`
+        void make_parents(const std::string &path)
+        {
+                for (size_t slash = path.find('/'); slash != std::string::npos;
+                     slash        = path.find('/', slash + 1))
+                {
+                        std::string dir = path.substr(0, slash);
+                        if (made.count(dir))
+                                continue;
+                        if (mkdirat(root, dir.c_str(), 0777) < 0 && errno != EEXIST)
+                                fail(dir, errno);
+                        made.insert(dir);
+                }
+        }
+
+        // Runs `create`, and once more after removing whatever non-directory
+        // was in the way
+        template <typename F> int replace(const std::string &path, F create)
+        {
+                int result = create();
+                if (result < 0 && (errno == EEXIST || errno == ELOOP || errno == ETXTBSY))
+                {
+                        unlinkat(root, path.c_str(), 0);
+                        result = create();
+                }
+                return result;
+        }
+
+        // Owner, mode and mtime of a file whose contents are written, then
+        // its name; until then a crash leaves no half-written file behind
+        int finish_file(landing_file &file, const tar_entry &entry)
+        {
+                int error = 0;
+                if (owner && fchown(file.fd(), entry.uid, entry.gid) < 0)
+                        error = errno;
+                if (fchmod(file.fd(), entry.mode & 07777 & ~mask) < 0)
+                        error = errno;
+                struct timespec times[2] = {{0, UTIME_OMIT}, {entry.mtime, long(entry.mtime_nsec)}};
+                if (futimens(file.fd(), times) < 0)
+                        error = errno;
+                int published = file.publish();
+                return published ? published : error;
+        }
+
+        // Bigger files are streamed from the archive by the reader itself
+        void stream_file(tar_reader &reader, const tar_entry &entry, const std::string &path)
+        {
+                landing_file file(root, path);
+                if (!file.ok())
+                {
+                        fail(path, errno);
+                        return;
+                }
+                std::vector<unsigned char> buffer(TAR_READ_AHEAD);
+                int error = 0;
+                size_t got;
+                while ((got = reader.read(buffer.data(), buffer.size())) > 0)
+                        if (!error)
+                                error = write_all(file.fd(), buffer.data(), got) ? 0 : errno;
+                int finished = error ? 0 : finish_file(file, entry);
+                if (error || finished)
+                        fail(path, error ? error : finished);
+        }
+
+        void set_times(const std::string &path, const tar_entry &entry)
+        {
+                struct timespec times[2] = {{0, UTIME_OMIT}, {entry.mtime, long(entry.mtime_nsec)}};
+                if (utimensat(root, path.c_str(), times, AT_SYMLINK_NOFOLLOW) < 0)
+                        fail(path, errno);
+        }
+
+        // Entries whose link targets or contents have to exist first
+        void final_pass()
+        {
+                // Hard links before symlinks, so no link is made through one
+                std::stable_partition(links.begin(), links.end(),
+                                      [](const tar_entry &entry) { return entry.type == '1'; });
+                for (const tar_entry &entry : links)
+                {
+                        std::string target;
+                        if (entry.type == '1' &&
+                            (!tar_relative_path(entry.link, target) || target.empty()))
+                        {
+                                fail(entry.path, EPERM);
+                                continue;
+                        }
+                        int made_link = replace(
+                            entry.path,
+                            [&]
+                            {
+                                    return entry.type == '1'
+                                               ? linkat(root, target.c_str(), root,
+                                                        entry.path.c_str(), 0)
+                                               : symlinkat(entry.link.c_str(), root,
+                                                           entry.path.c_str());
+                            });
+                        if (made_link < 0)
+                        {
+                                fail(entry.path, errno);
+                                continue;
+                        }
+                        if (entry.type == '2')
+                        {
+                                if (owner)
+                                        fchownat(root, entry.path.c_str(), entry.uid, entry.gid,
+                                                 AT_SYMLINK_NOFOLLOW);
+                                set_times(entry.path, entry);
+                        }
+                }
+
+                // Deepest first: a child sorts after its parent
+                std::sort(dirs.begin(), dirs.end(), [](const tar_entry &a, const tar_entry &b)
+                          { return a.path > b.path; });
+                for (const tar_entry &entry : dirs)
+                {
+                        if (owner)
+                                fchownat(root, entry.path.c_str(), entry.uid, entry.gid, 0);
+                        if (fchmodat(root, entry.path.c_str(), entry.mode & 07777 & ~mask, 0) < 0)
+                                fail(entry.path, errno);
+                        set_times(entry.path, entry);
+                }
+        }
+
+        // Sequential part: parse the archive, create directories and special
+        // files, and queue the small files for the pool
+        void read_entries(tar_reader &reader, ordered_stage<extract_job> &stage, size_t &count)
+        {
+                tar_entry entry;
+                while (reader.next(entry))
+                {
+                        std::string path;
+                        if (!tar_relative_path(entry.path, path))
+                        {
+                                failures.push_back(entry.path + ": refusing path with \"..\"");
+                                continue;
+                        }
+                        if (path.empty())
+                                continue;
+                        count++;
+                        make_parents(path);
+                        entry.path = path;
+                        switch (entry.type)
+                        {
+                        case '5':
+                                if (!made.count(path))
+                                {
+                                        if (mkdirat(root, path.c_str(), 0700) < 0 && errno != EEXIST)
+                                                fail(path, errno);
+                                        made.insert(path);
+                                }
+                                dirs.push_back(entry);
+                                break;
+                        case '1':
+                        case '2':
+                                links.push_back(entry);
+                                break;
+                        case '3':
+                        case '4':
+                        case '6':
+                        {
+                                mode_t type = entry.type == '6'   ? S_IFIFO
+                                              : entry.type == '3' ? S_IFCHR
+                                                                  : S_IFBLK;
+                                dev_t dev   = makedev(entry.dev_major, entry.dev_minor);
+                                mode_t mode = type | (entry.mode & 07777 & ~mask);
+                                if (replace(path, [&]
+                                            { return mknodat(root, path.c_str(), mode, dev); }) < 0)
+                                        fail(path, errno);
+                                break;
+                        }
+                        default: // unknown types are extracted as regular files, like tar does
+                                if (entry.size > TAR_READ_AHEAD)
+                                {
+                                        stream_file(reader, entry, path);
+                                        break;
+                                }
+                                extract_job job;
+                                job.data.resize(entry.size);
+                                reader.read(job.data.data(), entry.size);
+                                job.entry = std::move(entry);
+                                job.path  = std::move(path);
+                                if (!stage.submit(std::move(job)))
+                                        return;
+                        }
+                }
+        }
+
+      public:
+        // `target` must exist. Ownership is restored only when running as root.
+        explicit tar_extractor(const std::string &target)
+        {
+                root = open(target.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (root < 0)
+                        throw std::runtime_error("Failed to open " + target);
+                owner = geteuid() == 0;
+                mask  = owner ? 0 : process_umask();
+        }
+
+        ~tar_extractor() { close(root); }
+
+        tar_extractor(const tar_extractor &)            = delete;
+        tar_extractor &operator=(const tar_extractor &) = delete;
+
+        // Returns the number of entries; those that could not be created are
+        // listed in `errors`. Throws if the archive itself is unreadable.
+        size_t extract(const std::string &archive, std::vector<std::string> &errors)
+        {
+                tar_reader reader(archive);
+                ordered_stage<extract_job> stage(
+                    walker_threads(), walker_threads() * 8,
+                    [&](extract_job &job, size_t)
+                    {
+                            landing_file file(root, job.path);
+                            if (!file.ok())
+                            {
+                                    job.error = errno;
+                                    return;
+                            }
+                            job.error =
+                                write_all(file.fd(), job.data.data(), job.data.size()) ? 0 : errno;
+                            if (!job.error)
+                                    job.error = finish_file(file, job.entry);
+                    });
+
+                size_t count = 0;
+                std::exception_ptr failed;
+                std::thread parser(
+                    [&]
+                    {
+                            try
+                            {
+                                    read_entries(reader, stage, count);
+                            }
+                            catch (...)
+                            {
+                                    failed = std::current_exception();
+                            }
+                            stage.close();
+                    });
+
+                extract_job job;
+                while (stage.take(job))
+                        if (job.error)
+                                errors.push_back(job.path + ": " + strerror(job.error));
+                parser.join();
+                if (failed)
+                        std::rethrow_exception(failed);
+
+                final_pass();
+                errors.insert(errors.end(), failures.begin(), failures.end());
+                return count;
+        }
+};
+
+// Materializes an archive under `target`, which must exist. The gzip stream
+// can only be parsed in order, but that is cheap next to creating files: the
+// parser makes each directory as soon as it or something inside it shows up,
+// and hands files up to TAR_READ_AHEAD, contents already in memory, to a pool
+// of threads that create, write, stamp and name them in parallel, so many small
+// files are bounded by the device's queue depth rather than by one
+// open()/write()/close() after another. Links and directory modes and times
+// are applied in a final pass once every file exists, deepest directory first
+// so creating children does not disturb a parent's mtime afterwards.
+inline size_t unpack_archive(const std::string &archive, const std::string &target,
+                             std::vector<std::string> &errors)
+{
+        tar_extractor extractor(target);
+        return extractor.extract(archive, errors);
+}
@@ -0,0 +1,860 @@
+#pragma once
+
+#include "protocol.h"
+#include "shaping.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <netinet/in.h>
+#include <poll.h>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+// UDP bulk transport for links where a single TCP stream collapses after a
+// few losses (2.4 GHz Wi-Fi, hotspots). The TCP connection stays up as the
+// control channel; the file itself goes as paced datagrams:
+//
+//   DATA    chunk id, payload               sender -> receiver
+//   PARITY  XOR of one FEC group            sender -> receiver
+//   FIN     total chunk count, "all sent"   sender -> receiver
+//   ACK     receiver id, cumulative ack,    receiver -> sender
+//           delay sample, delivered bytes,
+//           NACK ranges
+//
+// The sending rate follows one-way queueing delay rather than loss (LEDBAT
+// style), so random Wi-Fi loss does not slow the transfer down; only a
+// growing queue at the bottleneck does. Lost chunks are repaired from parity
+// when possible and otherwise retransmitted on NACK. The receiver writes
+// chunks at their offset and reports "done" on the TCP channel.
+//
+// The same sender also serves several receivers at once when the datagrams
+// go to a multicast group: each receiver has its own TCP control channel and
+// an id that tags its ACKs, the slowest one sets the pace, and a repair asked
+// for by any of them is multicast to all.
+
+#define UDP_PAYLOAD 1400
+#define UDP_HEADER 16
+#define UDP_ACK_HEADER 52
+#define UDP_MAX_NACKS 128
+#define UDP_MIN_REORDER_US 2000
+#define UDP_MAX_REORDER_US 100000
+#define UDP_TARGET_DELAY_US 15000
+#define UDP_IDLE_TIMEOUT_US 30000000LL
+#define UDP_FEEDBACK_US 5000
+
+enum udp_packet_type : uint8_t
+{
+        UDP_DATA   = 1,
+        UDP_PARITY = 2,
+        UDP_FIN    = 3,
+        UDP_ACK    = 4,
+};
+
+inline int64_t now_us()
+{
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+}
+
+inline void put_be16(unsigned char *out, uint16_t value)
+{
+        out[0] = value >> 8;
+        out[1] = value & 0xff;
+}
+
+inline uint16_t get_be16(const unsigned char *in) { return uint16_t(in[0] << 8 | in[1]); }
+
+#define UDP_FLAG_RETRANSMIT 1
+
+// Header shared by DATA, PARITY and FIN
+inline void put_udp_header(unsigned char *out, uint8_t type, uint16_t len, uint32_t id,
+                           uint8_t flags = 0)
+{
+        out[0] = type;
+        out[1] = flags;
+        put_be16(out + 2, len);
+        put_be32(out + 4, id);
+        put_be64(out + 8, now_us());
+}
+
+inline uint32_t udp_chunk_count(uint64_t size) { return (size + UDP_PAYLOAD - 1) / UDP_PAYLOAD; }
+
+inline size_t udp_chunk_len(uint64_t size, uint32_t chunk)
+{
+        uint64_t offset = uint64_t(chunk) * UDP_PAYLOAD;
+        return std::min<uint64_t>(UDP_PAYLOAD, size - offset);
+}
+
+inline bool same_peer(const sockaddr_in &a, const sockaddr_in &b)
+{
+        return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+}
+
+// The address at the other end of a control connection, which is where that
+// peer's datagrams have to come from. INADDR_ANY for a connection that is not
+// IPv4 (a local socket): the peer is on this host.
+inline in_addr control_peer(int control)
+{
+        sockaddr_in peer{};
+        socklen_t peer_len = sizeof(peer);
+        if (getpeername(control, (sockaddr *)&peer, &peer_len) == 0 && peer.sin_family == AF_INET)
+                return peer.sin_addr;
+        in_addr any{};
+        any.s_addr = htonl(INADDR_ANY);
+        return any;
+}
+
+// Whether a datagram from `from` may be from the peer at `expected`
+inline bool from_peer(in_addr expected, const sockaddr_in &from)
+{
+        if (expected.s_addr == htonl(INADDR_ANY))
+                return (ntohl(from.sin_addr.s_addr) >> 24) == IN_LOOPBACKNET;
+        return from.sin_addr.s_addr == expected.s_addr;
+}
+
+// Send multicast out of the interface that owns `local` (the address our TCP
+// connections to the receivers use). TTL 1 keeps the group on the LAN;
+// loopback stays on so receivers on this host get a copy too.
+inline bool udp_multicast_source(int sock, in_addr local)
+{
+        unsigned char ttl = 1, loop = 1;
+        return setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &local, sizeof(local)) == 0 &&
+               setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) == 0 &&
+               setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) == 0;
+}
+
+// Join `group` on the interface that owns `local`
+inline bool udp_join_group(int sock, in_addr group, in_addr local)
+{
+        ip_mreq request;
+        request.imr_multiaddr = group;
+        request.imr_interface = local;
+        return setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &request, sizeof(request)) == 0;
+}
+
+// The lowest one-way delay seen from one receiver. Each host stamps with its
+// own clock, so a raw delay is only meaningful against the floor of the same
+// receiver; the minimum is kept over two 30 s epochs so slow clock drift
+// between the hosts cannot masquerade as queueing forever.
+class owd_floor
+{
+      private:
+        int64_t lowest     = INT64_MAX;
+        int64_t old_lowest = INT64_MAX;
+        int64_t epoch      = 0;
+
+      public:
+        // Queueing delay of a fresh sample, in microseconds
+        int64_t queueing(int64_t owd_us, int64_t now)
+        {
+                if (now - epoch > 30000000)
+                {
+                        old_lowest = lowest;
+                        lowest     = INT64_MAX;
+                        epoch      = now;
+                }
+                lowest = std::min(lowest, owd_us);
+                return owd_us - std::min(lowest, old_lowest);
+        }
+};
+
+// Delay-based rate control. Queueing delay is one-way delay above the lowest
+// recently seen; below target the rate grows (doubling per RTT until the
+// queue first builds), above it the rate backs off in proportion to the
+// overshoot. Updates are scaled by the fraction of an RTT they cover, so the
+// feedback interval does not change how aggressive the controller is.
+class delay_rate_controller
+{
+      private:
+        double rate;
+        bool slow_start = true;
+        double min_rate = 1e6;
+        double max_rate = 10e9;
+
+      public:
+        explicit delay_rate_controller(double initial_bps = 20e6) : rate(initial_bps) {}
+
+        double bits_per_second() const { return rate; }
+
+        // Never go above `bps` (0 lifts the cap)
+        void limit(double bps)
+        {
+                max_rate = bps > 0 ? std::max(bps, min_rate) : 10e9;
+                rate     = std::min(rate, max_rate);
+        }
+
+        // `queueing_us` is one-way delay above its floor (see owd_floor)
+        void on_feedback(int64_t queueing_us, double delivered_bps, int64_t interval_us,
+                         int64_t rtt_us)
+        {
+                double queueing = double(queueing_us);
+                double off      = (UDP_TARGET_DELAY_US - queueing) / UDP_TARGET_DELAY_US;
+                double scale =
+                    std::min(1.0, double(interval_us) / std::max<int64_t>(rtt_us, 1000));
+
+                if (slow_start && queueing < UDP_TARGET_DELAY_US / 2)
+                        rate *= std::pow(2.0, scale);
+                else
+                {
+                        slow_start = false;
+                        if (off > 0)
+                                rate *= 1 + 0.25 * off * scale;
+                        else
+                                rate *= 1 + 0.25 * std::max(off, -1.0) * scale;
+                }
+
+                // Stay near what actually arrives: not far above it (a bottleneck
+                // that drops instead of queueing gives no delay signal), and not
+                // much below it while the queue we built is still draining
+                if (!slow_start && delivered_bps > 0)
+                        rate = std::min(std::max(rate, 0.85 * delivered_bps), 1.5 * delivered_bps);
+                rate = std::min(std::max(rate, min_rate), max_rate);
+        }
+};
+
+class udp_sender
+{
+      private:
+        struct peer
+        {
+                int control             = -1;
+                bool active             = true;
+                // ACKs count only from the address of its control connection;
+                // the first one from there pins the port
+                in_addr source{};
+                sockaddr_in address{};
+                bool pinned             = false;
+                int64_t heard_us        = 0;
+                uint32_t cum_ack        = 0;
+                int64_t queueing_us     = INT64_MIN;
+                owd_floor base;
+                uint64_t delivered      = 0;
+                int64_t delivered_at_us = 0;
+                double delivered_bps    = 0;
+        };
+
+        int udp_sock;
+        sockaddr_in destination;
+        int file_fd;
+        uint64_t size;
+        uint32_t chunks;
+        uint32_t fec_group;
+
+        std::vector<peer> peers;
+        delay_rate_controller controller;
+        const token_bucket *cap = nullptr;
+        // Every feedback repeats the outstanding NACKs, so queue each chunk
+        // once and repair the oldest hole first
+        std::set<uint32_t> retransmit;
+        std::unordered_map<uint32_t, int64_t> last_retransmit;
+        uint32_t next_new = 0;
+        int64_t srtt_us   = 10000;
+        int64_t last_update_us = 0;
+        uint64_t sent_packets = 0, retransmitted = 0;
+        size_t dropped_peers  = 0;
+
+        std::vector<unsigned char> parity;
+        uint32_t parity_members = 0;
+
+        uint32_t min_cum_ack() const
+        {
+                uint32_t lowest = UINT32_MAX;
+                for (const auto &p : peers)
+                        if (p.active)
+                                lowest = std::min(lowest, p.cum_ack);
+                return lowest == UINT32_MAX ? 0 : lowest;
+        }
+
+        // A receiver that hung up or went quiet no longer holds the others
+        // back; losing the last one ends the transfer
+        void drop_peer(peer &p, const char *reason)
+        {
+                p.control = -1;
+                p.active  = false;
+                dropped_peers++;
+                if (dropped_peers == peers.size())
+                        throw std::runtime_error(reason);
+        }
+
+        void send_packet(const unsigned char *packet, size_t len)
+        {
+                sendto(udp_sock, packet, len, 0, (const sockaddr *)&destination,
+                       sizeof(destination));
+                sent_packets++;
+        }
+
+        // New chunks feed the parity of their group; retransmissions are
+        // flagged so the receiver does not mistake them for reordering
+        bool send_chunk(uint32_t chunk, bool first_time)
+        {
+                unsigned char packet[UDP_HEADER + UDP_PAYLOAD];
+                size_t len = udp_chunk_len(size, chunk);
+                if (pread(file_fd, packet + UDP_HEADER, len, uint64_t(chunk) * UDP_PAYLOAD) !=
+                    ssize_t(len))
+                        return false;
+                put_udp_header(packet, UDP_DATA, len, chunk, first_time ? 0 : UDP_FLAG_RETRANSMIT);
+                send_packet(packet, UDP_HEADER + len);
+
+                if (first_time && fec_group > 0)
+                {
+                        for (size_t i = 0; i < len; i++)
+                                parity[UDP_HEADER + i] ^= packet[UDP_HEADER + i];
+                        parity_members++;
+                }
+                return true;
+        }
+
+        void send_parity(uint32_t group)
+        {
+                put_udp_header(parity.data(), UDP_PARITY, UDP_PAYLOAD, group);
+                send_packet(parity.data(), parity.size());
+                std::fill(parity.begin(), parity.end(), 0);
+                parity_members = 0;
+        }
+
+        void handle_feedback(const unsigned char *packet, size_t len, const sockaddr_in &from)
+        {
+                if (len < UDP_ACK_HEADER || packet[0] != UDP_ACK)
+                        return;
+                uint32_t id = get_be32(packet + 48);
+                if (id >= peers.size() || !peers[id].active)
+                        return;
+                auto it = peers.begin() + id;
+                // The id is only a claim; the address has to back it up
+                if (!it->pinned && from_peer(it->source, from))
+                {
+                        it->address = from;
+                        it->pinned  = true;
+                }
+                if (!it->pinned || !same_peer(from, it->address))
+                        return;
+
+                int64_t now      = now_us();
+                int64_t echo     = int64_t(get_be64(packet + 8));
+                int64_t hold     = int64_t(get_be64(packet + 16));
+                int64_t rtt      = now - echo - hold;
+                uint64_t bytes   = get_be64(packet + 32);
+                int64_t rx_clock = int64_t(get_be64(packet + 40));
+                bool fresh       = packet[1] == 0;
+                if (echo > 0 && rtt > 0)
+                        srtt_us = (7 * srtt_us + rtt) / 8;
+
+                it->cum_ack = std::max(it->cum_ack, get_be32(packet + 4));
+                if (fresh)
+                        it->queueing_us = it->base.queueing(int64_t(get_be64(packet + 24)), now);
+                it->heard_us = now;
+
+                // Delivery rate over at least two RTTs; shorter windows are
+                // mostly jitter
+                if (it->delivered_at_us == 0)
+                {
+                        it->delivered       = bytes;
+                        it->delivered_at_us = rx_clock;
+                }
+                else if (rx_clock - it->delivered_at_us >= std::max<int64_t>(2 * srtt_us, 100000))
+                {
+                        it->delivered_bps =
+                            (bytes - it->delivered) * 8e6 / double(rx_clock - it->delivered_at_us);
+                        it->delivered       = bytes;
+                        it->delivered_at_us = rx_clock;
+                }
+
+                // The slowest receiver sets the pace: the deepest queue, each
+                // measured against that receiver's own floor
+                int64_t queueing = INT64_MIN;
+                double delivered = 0;
+                for (const auto &p : peers)
+                {
+                        if (!p.active)
+                                continue;
+                        queueing = std::max(queueing, p.queueing_us);
+                        if (p.delivered_bps > 0 && (delivered == 0 || p.delivered_bps < delivered))
+                                delivered = p.delivered_bps;
+                }
+                if (fresh && queueing != INT64_MIN)
+                {
+                        int64_t interval = last_update_us ? now - last_update_us : UDP_FEEDBACK_US;
+                        controller.on_feedback(queueing, delivered, interval, srtt_us);
+                        last_update_us = now;
+                }
+
+                uint16_t nacks = get_be16(packet + 2);
+                for (size_t i = 0; i < nacks && UDP_ACK_HEADER + 8 * (i + 1) <= len; i++)
+                {
+                        uint32_t start = get_be32(packet + UDP_ACK_HEADER + 8 * i);
+                        uint32_t count = get_be32(packet + UDP_ACK_HEADER + 8 * i + 4);
+                        for (uint32_t c = start; c < start + count && c < chunks; c++)
+                                if (!recently_retransmitted(c, now))
+                                        retransmit.insert(c);
+                }
+        }
+
+        // A retransmission gets an RTT and a half to arrive before the same
+        // chunk may go again; NACKs repeat every feedback interval meanwhile
+        bool recently_retransmitted(uint32_t chunk, int64_t now) const
+        {
+                auto it = last_retransmit.find(chunk);
+                return it != last_retransmit.end() && now - it->second < srtt_us * 3 / 2 + 2000;
+        }
+
+        // True when this chunk is worth retransmitting right now
+        bool should_retransmit(uint32_t chunk, int64_t now)
+        {
+                if (chunk < min_cum_ack() || recently_retransmitted(chunk, now))
+                        return false;
+                last_retransmit[chunk] = now;
+                return true;
+        }
+
+        // True once every receiver still in the transfer reported done
+        bool poll_control(int64_t now)
+        {
+                bool finished = true;
+                for (auto &p : peers)
+                {
+                        if (!p.active || p.control < 0)
+                                continue;
+                        char reply[8];
+                        ssize_t got = recv(p.control, reply, sizeof(reply), MSG_DONTWAIT);
+                        if (got > 0 && std::string(reply, got).compare(0, 4, "done") == 0)
+                        {
+                                p.control = -1;
+                                continue;
+                        }
+                        if (got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+                                drop_peer(p, "Receiver closed the control channel");
+                        else if (now - p.heard_us > UDP_IDLE_TIMEOUT_US)
+                                drop_peer(p, "No feedback from receiver");
+                        else
+                                finished = false;
+                }
+                return finished;
+        }
+
+      public:
+        // `to` is the receiver, or the group with one control socket per
+        // receiver; receiver i tags its ACKs with id i. The control sockets
+        // are still the caller's to close.
+        udp_sender(int sock, const sockaddr_in &to, const std::vector<int> &control, int fd,
+                   uint64_t file_size, uint32_t group)
+            : udp_sock(sock), destination(to), file_fd(fd), size(file_size),
+              chunks(udp_chunk_count(file_size)), fec_group(group), peers(control.size()),
+              parity(UDP_HEADER + UDP_PAYLOAD, 0)
+        {
+                for (size_t i = 0; i < control.size(); i++)
+                {
+                        peers[i].control = control[i];
+                        peers[i].source  = control_peer(control[i]);
+                }
+                int buffer = 4 * 1024 * 1024;
+                setsockopt(udp_sock, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+                setsockopt(udp_sock, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+        }
+
+        double rate_bps() const { return controller.bits_per_second(); }
+
+        // Keep the pacing rate under the bucket's, which may change meanwhile
+        void limit_rate(const token_bucket *bucket) { cap = bucket; }
+
+        void run()
+        {
+                double tokens    = 0;
+                int64_t last     = now_us();
+                int64_t last_fin = 0;
+                unsigned char packet[2048];
+                for (auto &p : peers)
+                        p.heard_us = last;
+
+                while (true)
+                {
+                        ssize_t got;
+                        sockaddr_in from;
+                        socklen_t from_len = sizeof(from);
+                        while ((got = recvfrom(udp_sock, packet, sizeof(packet), MSG_DONTWAIT,
+                                               (sockaddr *)&from, &from_len)) > 0)
+                        {
+                                handle_feedback(packet, got, from);
+                                from_len = sizeof(from);
+                        }
+
+                        int64_t now = now_us();
+                        if (poll_control(now))
+                                return;
+
+                        if (cap)
+                                controller.limit(cap->bytes_per_second() * 8);
+                        double rate  = controller.bits_per_second();
+                        double burst = std::max(rate * 0.002 / 8, 4.0 * UDP_PAYLOAD);
+                        tokens       = std::min(tokens + (now - last) * rate / 8e6, burst);
+                        last         = now;
+
+                        bool idle = true;
+                        while (tokens >= UDP_HEADER + UDP_PAYLOAD)
+                        {
+                                bool sent = false;
+                                while (!retransmit.empty() && !sent)
+                                {
+                                        uint32_t chunk = *retransmit.begin();
+                                        retransmit.erase(retransmit.begin());
+                                        if (should_retransmit(chunk, now))
+                                        {
+                                                if (!send_chunk(chunk, false))
+                                                        throw std::runtime_error(
+                                                            "Error reading file");
+                                                retransmitted++;
+                                                sent = true;
+                                        }
+                                }
+                                if (!sent && fec_group > 0 &&
+                                    (parity_members == fec_group ||
+                                     (parity_members > 0 && next_new == chunks)))
+                                {
+                                        send_parity((next_new - 1) / fec_group);
+                                        sent = true;
+                                }
+                                if (!sent && next_new < chunks)
+                                {
+                                        if (!send_chunk(next_new++, true))
+                                                throw std::runtime_error("Error reading file");
+                                        sent = true;
+                                }
+                                if (!sent)
+                                        break;
+                                tokens -= UDP_HEADER + UDP_PAYLOAD;
+                                idle = false;
+                        }
+
+                        // Everything is out: remind the receivers of the total
+                        // so they can NACK a lost tail
+                        if (next_new == chunks && parity_members == 0 && retransmit.empty() &&
+                            now - last_fin > std::max<int64_t>(srtt_us, 5000))
+                        {
+                                unsigned char fin[UDP_HEADER];
+                                put_udp_header(fin, UDP_FIN, 0, chunks);
+                                send_packet(fin, sizeof(fin));
+                                last_fin = now;
+                        }
+
+                        // Sleep until there are tokens for the next packet
+                        std::vector<pollfd> fds{{udp_sock, POLLIN, 0}};
+                        for (const auto &p : peers)
+                                if (p.control >= 0)
+                                        fds.push_back({p.control, POLLIN, 0});
+                        int64_t wait_us =
+                            idle ? 1000
+                                 : int64_t((UDP_HEADER + UDP_PAYLOAD - tokens) * 8e6 / rate);
+                        timespec timeout{0, long(std::max<int64_t>(wait_us, 0) * 1000)};
+                        ppoll(fds.data(), fds.size(), &timeout, nullptr);
+                }
+        }
+
+        uint64_t packets_sent() const { return sent_packets; }
+        uint64_t packets_retransmitted() const { return retransmitted; }
+        size_t receivers_dropped() const { return dropped_peers; }
+};
+
+class udp_receiver
+{
+      private:
+        int udp_sock;
+        int control;
+        int file_fd;
+        uint64_t size;
+        uint32_t chunks;
+        uint32_t fec_group;
+        uint32_t receiver_id;
+
+        std::vector<bool> have;
+        uint32_t received_chunks = 0;
+        uint32_t cum_ack         = 0;
+        int64_t highest          = -1;
+        // (arrival time, highest chunk id) each time the highest id grew
+        std::deque<std::pair<int64_t, uint32_t>> highest_history;
+        uint32_t settled_highest = 0;
+        int64_t last_owd_us = INT64_MIN;
+        double jitter_us    = 0;
+        double reorder_us   = 0;
+        bool fin_seen            = false;
+        uint64_t received_bytes  = 0;
+        uint64_t recovered       = 0;
+
+        std::vector<uint32_t> group_missing;
+        std::unordered_map<uint32_t, std::vector<unsigned char>> parity;
+
+        // Datagrams count only from the sender's address; the first one
+        // from there also pins the port feedback goes to
+        in_addr sender_source{};
+        sockaddr_in sender_address{};
+        bool have_sender        = false;
+        int64_t echo_sent_us    = 0;
+        int64_t echo_arrived_us = 0;
+        int64_t min_owd_us      = INT64_MAX;
+        bool fresh_sample       = false;
+
+        void store(uint32_t chunk, const unsigned char *data, size_t len)
+        {
+                if (pwrite(file_fd, data, len, uint64_t(chunk) * UDP_PAYLOAD) != ssize_t(len))
+                        throw std::runtime_error("Failed to write file");
+                have[chunk] = true;
+                received_chunks++;
+                while (cum_ack < chunks && have[cum_ack])
+                        cum_ack++;
+                if (fec_group > 0)
+                {
+                        uint32_t group = chunk / fec_group;
+                        group_missing[group]--;
+                        try_recover(group);
+                }
+        }
+
+        // With exactly one chunk of a group missing, parity XOR the others is it
+        void try_recover(uint32_t group)
+        {
+                auto it = parity.find(group);
+                if (it == parity.end())
+                        return;
+                if (group_missing[group] != 1)
+                {
+                        if (group_missing[group] == 0)
+                                parity.erase(it);
+                        return;
+                }
+
+                std::vector<unsigned char> data = std::move(it->second);
+                parity.erase(it);
+                uint32_t first = group * fec_group;
+                uint32_t last  = std::min(chunks, first + fec_group);
+                uint32_t lost  = first;
+                unsigned char other[UDP_PAYLOAD];
+                for (uint32_t c = first; c < last; c++)
+                {
+                        if (!have[c])
+                        {
+                                lost = c;
+                                continue;
+                        }
+                        size_t len = udp_chunk_len(size, c);
+                        if (pread(file_fd, other, len, uint64_t(c) * UDP_PAYLOAD) != ssize_t(len))
+                                throw std::runtime_error("Failed to read back file");
+                        for (size_t i = 0; i < len; i++)
+                                data[i] ^= other[i];
+                }
+                recovered++;
+                store(lost, data.data(), udp_chunk_len(size, lost));
+        }
+
+        // How late a reordered chunk is: time since a higher chunk arrived
+        void note_reordering(uint32_t id, int64_t now)
+        {
+                auto later = std::upper_bound(
+                    highest_history.begin(), highest_history.end(), id,
+                    [](uint32_t value, const std::pair<int64_t, uint32_t> &entry)
+                    { return value < entry.second; });
+                if (later == highest_history.end())
+                        return;
+                reorder_us = std::max(reorder_us - reorder_us / 64, double(now - later->first));
+        }
+
+        // NACK only gaps below a chunk that arrived longer ago than the path
+        // reorders: the larger of the measured lateness and a few times the
+        // delay jitter
+        uint64_t nack_limit(int64_t now)
+        {
+                int64_t window = std::max<int64_t>(1.5 * reorder_us, 4 * jitter_us);
+                window = std::min<int64_t>(std::max<int64_t>(window, UDP_MIN_REORDER_US),
+                                           UDP_MAX_REORDER_US);
+                while (!highest_history.empty() &&
+                       highest_history.front().first < now - UDP_MAX_REORDER_US)
+                {
+                        settled_highest = highest_history.front().second;
+                        highest_history.pop_front();
+                }
+                auto settled = std::lower_bound(
+                    highest_history.begin(), highest_history.end(), now - window,
+                    [](const std::pair<int64_t, uint32_t> &entry, int64_t value)
+                    { return entry.first <= value; });
+                if (settled == highest_history.begin())
+                        return settled_highest;
+                return (settled - 1)->second;
+        }
+
+        void handle_packet(const unsigned char *packet, size_t len)
+        {
+                if (len < UDP_HEADER)
+                        return;
+                uint8_t type     = packet[0];
+                uint16_t payload = get_be16(packet + 2);
+                uint32_t id      = get_be32(packet + 4);
+                int64_t sent     = int64_t(get_be64(packet + 8));
+                int64_t now      = now_us();
+
+                if (type == UDP_FIN)
+                {
+                        fin_seen = true;
+                        return;
+                }
+                if (UDP_HEADER + size_t(payload) > len)
+                        return;
+
+                received_bytes += payload;
+                echo_sent_us    = sent;
+                echo_arrived_us = now;
+                min_owd_us      = std::min(min_owd_us, now - sent);
+                if (last_owd_us != INT64_MIN)
+                        jitter_us += (std::abs(double(now - sent - last_owd_us)) - jitter_us) / 16;
+                last_owd_us = now - sent;
+                fresh_sample    = true;
+
+                if (type == UDP_DATA && id < chunks && !have[id] &&
+                    payload == udp_chunk_len(size, id))
+                {
+                        if (int64_t(id) > highest)
+                        {
+                                highest = id;
+                                highest_history.emplace_back(now, id);
+                        }
+                        else if (!(packet[1] & UDP_FLAG_RETRANSMIT))
+                                note_reordering(id, now);
+                        store(id, packet + UDP_HEADER, payload);
+                }
+                else if (type == UDP_PARITY && fec_group > 0 && id < group_missing.size() &&
+                         group_missing[id] > 0 && payload == UDP_PAYLOAD)
+                {
+                        parity[id].assign(packet + UDP_HEADER, packet + UDP_HEADER + UDP_PAYLOAD);
+                        try_recover(id);
+                }
+        }
+
+        void send_feedback()
+        {
+                unsigned char packet[UDP_ACK_HEADER + 8 * UDP_MAX_NACKS];
+                memset(packet, 0, UDP_ACK_HEADER);
+                packet[0] = UDP_ACK;
+                packet[1] = fresh_sample ? 0 : 1; // 1: no new delay sample
+                put_be32(packet + 4, cum_ack);
+                put_be64(packet + 8, echo_sent_us);
+                put_be64(packet + 16, echo_sent_us ? now_us() - echo_arrived_us : 0);
+                put_be64(packet + 24, fresh_sample ? min_owd_us : 0);
+                put_be64(packet + 32, received_bytes);
+                put_be64(packet + 40, now_us());
+                put_be32(packet + 48, receiver_id);
+
+                // After FIN the whole tail is fair game
+                uint64_t limit = fin_seen ? chunks : nack_limit(now_us());
+                uint16_t ranges = 0;
+                for (uint32_t c = cum_ack; c < limit && ranges < UDP_MAX_NACKS;)
+                {
+                        if (have[c])
+                        {
+                                c++;
+                                continue;
+                        }
+                        uint32_t start = c;
+                        while (c < limit && !have[c])
+                                c++;
+                        put_be32(packet + UDP_ACK_HEADER + 8 * ranges, start);
+                        put_be32(packet + UDP_ACK_HEADER + 8 * ranges + 4, c - start);
+                        ranges++;
+                }
+                put_be16(packet + 2, ranges);
+
+                sendto(udp_sock, packet, UDP_ACK_HEADER + 8 * ranges, 0,
+                       (const sockaddr *)&sender_address, sizeof(sender_address));
+                fresh_sample = false;
+                min_owd_us   = INT64_MAX;
+        }
+
+      public:
+        udp_receiver(int sock, int control_sock, int fd, uint64_t file_size, uint32_t group,
+                     uint32_t id = 0)
+            : udp_sock(sock), control(control_sock), file_fd(fd), size(file_size),
+              chunks(udp_chunk_count(file_size)), fec_group(group), receiver_id(id),
+              have(chunks, false)
+        {
+                if (fec_group > 0)
+                {
+                        group_missing.resize((chunks + fec_group - 1) / fec_group, fec_group);
+                        if (chunks % fec_group)
+                                group_missing.back() = chunks % fec_group;
+                }
+                int buffer = 8 * 1024 * 1024;
+                setsockopt(udp_sock, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+
+                sender_source = control_peer(control);
+        }
+
+        // Multicast may leave the sender from another address than the one
+        // our control connection reached; it names that one in the offer
+        void expect_source(in_addr source) { sender_source = source; }
+
+        // Receive into file_fd until every chunk is there, then tell the sender
+        void run()
+        {
+                if (ftruncate(file_fd, size) < 0)
+                        throw std::runtime_error("Failed to size file");
+
+                int64_t last_packet   = now_us();
+                int64_t last_feedback = 0;
+                unsigned char packet[2048];
+
+                while (received_chunks < chunks)
+                {
+                        pollfd fds[2] = {{udp_sock, POLLIN, 0}, {control, POLLIN, 0}};
+                        poll(fds, 2, UDP_FEEDBACK_US / 1000);
+
+                        if (fds[1].revents)
+                        {
+                                char probe;
+                                if (recv(control, &probe, 1, MSG_DONTWAIT | MSG_PEEK) <= 0)
+                                        throw std::runtime_error(
+                                            "Sender closed the control channel");
+                        }
+
+                        sockaddr_in from;
+                        socklen_t from_len = sizeof(from);
+                        ssize_t got;
+                        int budget = 256; // keep feedback flowing under a flood
+                        while (received_chunks < chunks && budget-- > 0 &&
+                               (got = recvfrom(udp_sock, packet, sizeof(packet), MSG_DONTWAIT,
+                                               (sockaddr *)&from, &from_len)) > 0)
+                        {
+                                // A port or a shared group may carry other
+                                // traffic; only the sender's datagrams count
+                                if (!have_sender && from_peer(sender_source, from))
+                                {
+                                        sender_address = from;
+                                        have_sender    = true;
+                                }
+                                if (have_sender && same_peer(from, sender_address))
+                                {
+                                        handle_packet(packet, got);
+                                        last_packet = now_us();
+                                }
+                                from_len = sizeof(from);
+                        }
+
+                        int64_t now = now_us();
+                        if (now - last_packet > UDP_IDLE_TIMEOUT_US)
+                                throw std::runtime_error("Transfer stalled");
+                        if (have_sender && now - last_feedback >= UDP_FEEDBACK_US)
+                        {
+                                send_feedback();
+                                last_feedback = now;
+                        }
+                }
+
+                if (!send_all(control, "done", 4))
+                        throw std::runtime_error("Failed to confirm transfer");
+        }
+
+        uint64_t chunks_recovered() const { return recovered; }
+};
@@ -0,0 +1,203 @@
+#pragma once
+
+#include "protocol.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <linux/errqueue.h>
+#include <map>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <utility>
+#include <vector>
+
+// MSG_ZEROCOPY sends for buffers built in user space, such as encrypted
+// frames, where sendfile() has nothing to offer. The kernel pins the pages
+// instead of copying them into the socket, so a buffer may not be reused
+// until the socket's error queue says the kernel is done with it. Buffers
+// wait here until then. Every zero-copy send() call gets the next id, and
+// completions come back as ranges of ids; a buffer is released once every id
+// it was sent under is covered.
+//
+// When the kernel had to copy after all (loopback, or a device without
+// scatter-gather) the completion says so. A copy plus a notification costs
+// more than a plain copy, so after ZEROCOPY_PROBE copied completions and no
+// real ones the sender goes back to ordinary send().
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+#define ZEROCOPY_MAX_HELD 64
+#define ZEROCOPY_PROBE 8
+#define ZEROCOPY_FINISH_MS 5000
+
+class zerocopy_sender
+{
+      private:
+        struct held_buffer
+        {
+                uint32_t last_id;
+                std::vector<unsigned char> buffer;
+        };
+
+        int sock;
+        bool active;
+        std::function<void(std::vector<unsigned char> &&)> release;
+        std::deque<held_buffer> held;
+        uint32_t next_id    = 0; // id of the next zero-copy call
+        uint32_t done_below = 0; // every id before this one has completed
+        uint32_t hold_from  = 0; // first id of the buffer being sent
+        // Completed ranges beyond an id that is still outstanding
+        std::map<uint32_t, uint32_t> early;
+        uint64_t copied_calls = 0, zerocopy_calls = 0;
+
+        static bool before(uint32_t a, uint32_t b) { return int32_t(a - b) < 0; }
+
+        void complete(uint32_t lo, uint32_t hi)
+        {
+                if (before(done_below, lo))
+                {
+                        early[lo] = hi;
+                        return;
+                }
+                if (!before(hi, done_below))
+                        done_below = hi + 1;
+                for (auto it = early.begin(); it != early.end() && !before(done_below, it->first);
+                     it      = early.erase(it))
+                        if (!before(it->second, done_below))
+                                done_below = it->second + 1;
+        }
+
+        // Takes every completion queued on the socket, waiting up to
+        // `timeout_ms` for the first, and releases the buffers they cover
+        void reap(int timeout_ms)
+        {
+                if (timeout_ms > 0)
+                {
+                        // The error queue shows up as POLLERR
+                        struct pollfd ready = {sock, 0, 0};
+                        poll(&ready, 1, timeout_ms);
+                }
+                while (true)
+                {
+                        char control[128];
+                        struct msghdr msg = {};
+                        msg.msg_control    = control;
+                        msg.msg_controllen = sizeof(control);
+                        if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+                                break;
+                        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm;
+                             cm                 = CMSG_NXTHDR(&msg, cm))
+                        {
+                                if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                                      (cm->cmsg_level == SOL_IPV6 &&
+                                       cm->cmsg_type == IPV6_RECVERR)))
+                                        continue;
+                                auto *err = reinterpret_cast<sock_extended_err *>(CMSG_DATA(cm));
+                                if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                                        continue;
+                                uint32_t calls = err->ee_data - err->ee_info + 1;
+                                if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                                        copied_calls += calls;
+                                else
+                                        zerocopy_calls += calls;
+                                complete(err->ee_info, err->ee_data);
+                        }
+                }
+                while (!held.empty() && before(held.front().last_id, done_below))
+                {
+                        release(std::move(held.front().buffer));
+                        held.pop_front();
+                }
+                if (active && zerocopy_calls == 0 && copied_calls >= ZEROCOPY_PROBE)
+                        active = false;
+        }
+
+      public:
+        // `release` gets every buffer back once the kernel no longer needs it
+        zerocopy_sender(int socket, std::function<void(std::vector<unsigned char> &&)> released)
+            : sock(socket), release(std::move(released))
+        {
+                int one = 1;
+                active  = setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+        }
+
+        ~zerocopy_sender() { finish(); }
+
+        // False once the socket refused SO_ZEROCOPY or the kernel kept copying
+        bool zerocopy() const { return active; }
+
+        // Sends all of `data`, which must stay untouched until hold() has
+        // taken the buffer it lives in and handed it back
+        bool send(const void *data, size_t len)
+        {
+                if (!active)
+                        return send_all(sock, data, len);
+                const char *pos = static_cast<const char *>(data);
+                while (len > 0)
+                {
+                        ssize_t sent = ::send(sock, pos, len, MSG_ZEROCOPY | MSG_NOSIGNAL);
+                        if (sent < 0 && errno == EINTR)
+                                continue;
+                        // Too much pinned memory (optmem_max): wait for some of it back
+                        if (sent < 0 && errno == ENOBUFS)
+                        {
+                                reap(10);
+                                continue;
+                        }
+                        if (sent < 0)
+                                return false;
+                        next_id++;
+                        pos += sent;
+                        len -= sent;
+                }
+                return true;
+        }
+
+        // Takes the buffer behind every send() since the previous hold(); it
+        // goes back through `release` as soon as the kernel is done with it
+        void hold(std::vector<unsigned char> &&buffer)
+        {
+                if (next_id == hold_from)
+                        release(std::move(buffer));
+                else
+                        held.push_back({next_id - 1, std::move(buffer)});
+                hold_from = next_id;
+                reap(0);
+                while (held.size() > ZEROCOPY_MAX_HELD)
+                        reap(10);
+        }
+
+        // Waits for the outstanding completions, up to ZEROCOPY_FINISH_MS
+        // without progress, then hands back whatever is still held
+        void finish()
+        {
+                auto last_progress = std::chrono::steady_clock::now();
+                while (!held.empty() &&
+                       std::chrono::steady_clock::now() - last_progress <
+                           std::chrono::milliseconds(ZEROCOPY_FINISH_MS))
+                {
+                        size_t before_reap = held.size();
+                        reap(100);
+                        if (held.size() != before_reap)
+                                last_progress = std::chrono::steady_clock::now();
+                }
+                while (!held.empty())
+                {
+                        release(std::move(held.front().buffer));
+                        held.pop_front();
+                }
+        }
+
+        // Sends that went out without a copy, and those the kernel copied
+        uint64_t zerocopy_sends() const { return zerocopy_calls; }
+        uint64_t copied_sends() const { return copied_calls; }
+};